@@ -0,0 +1,197 @@
+#include "batch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "logger.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+struct Batch {
+    pthread_t * threads; // Workers besides the calling thread
+    size_t thread_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation; // Bumped for every step, workers wait for it to change
+    size_t busy;
+    bool running;
+
+    // The step being run, only written while the workers wait
+    GameBoy * const * envs;
+    uint8_t const * actions;
+    size_t count;
+    uint32_t frames;
+    BatchOutput output;
+    atomic_size_t next; // Instances are claimed one at a time, so uneven ones still spread across workers
+};
+
+static GameBoyInput batch_decode_input(uint8_t value) {
+    GameBoyInput input = {
+        value & GAMEBOY_BUTTON_A, value & GAMEBOY_BUTTON_B, value & GAMEBOY_BUTTON_START, value & GAMEBOY_BUTTON_SELECT,
+        value & GAMEBOY_BUTTON_UP, value & GAMEBOY_BUTTON_DOWN, value & GAMEBOY_BUTTON_LEFT, value & GAMEBOY_BUTTON_RIGHT
+    };
+    return input;
+}
+
+static void batch_run_instance(Batch * const batch, size_t index) {
+    GameBoy * const gb = batch->envs[index];
+    GameBoyInput input = batch_decode_input(batch->actions != NULL ? batch->actions[index] : 0);
+    BatchOutput const * const output = &batch->output;
+
+    bool skip_render = gb->skip_render;
+    for (uint32_t frame = 0; frame < batch->frames; frame++) {
+        gb->skip_render = output->type != BATCH_OUTPUT_DISPLAY || frame + 1 < batch->frames;
+        gameboy_run_frame(gb, input);
+    }
+    gb->skip_render = skip_render;
+
+    uint8_t * data = output->data + index * batch_get_output_size(output);
+    switch (output->type) {
+        case BATCH_OUTPUT_DISPLAY: gameboy_get_display_shades(gb, data, GAMEBOY_DISPLAY_PACKED_SIZE); break;
+        case BATCH_OUTPUT_MEMORY:
+            for (uint16_t i = 0; i < output->size; i++) data[i] = gameboy_read(gb, output->address + i);
+            break;
+
+        case BATCH_OUTPUT_NONE:
+        default: break;
+    }
+}
+
+static void batch_work(Batch * const batch) {
+    size_t index;
+    while ((index = atomic_fetch_add_explicit(&batch->next, 1, memory_order_relaxed)) < batch->count) {
+        batch_run_instance(batch, index);
+    }
+}
+
+static void * batch_thread(void * arg) {
+    Batch * const batch = arg;
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&batch->mutex);
+    while (true) {
+        while (batch->running && batch->generation == generation) pthread_cond_wait(&batch->start, &batch->mutex);
+        if (!batch->running) break;
+        generation = batch->generation;
+
+        pthread_mutex_unlock(&batch->mutex);
+        batch_work(batch);
+        pthread_mutex_lock(&batch->mutex);
+
+        if (--batch->busy == 0) pthread_cond_signal(&batch->done);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+
+    return NULL;
+}
+
+static size_t batch_get_processor_count(void) {
+#if defined(__unix__) || defined(__APPLE__)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 0) return (size_t)count;
+#endif
+    return 1;
+}
+
+Batch * batch_create(size_t threads) {
+    if (threads == 0) threads = batch_get_processor_count();
+
+    Batch * batch = calloc(1, sizeof(Batch));
+    if (batch == NULL) return NULL;
+
+    batch->threads = calloc(threads, sizeof(pthread_t));
+    if (batch->threads == NULL) {
+        free(batch);
+        return NULL;
+    }
+
+    batch->running = true;
+    pthread_mutex_init(&batch->mutex, NULL);
+    pthread_cond_init(&batch->start, NULL);
+    pthread_cond_init(&batch->done, NULL);
+
+    // The calling thread works every step too, so it needs one thread less
+    for (size_t i = 0; i + 1 < threads; i++) {
+        if (pthread_create(&batch->threads[i], NULL, batch_thread, batch) != 0) {
+            TRTLE_LOG_WARN("Only started %zu of %zu batch threads\n", i + 1, threads);
+            break;
+        }
+        batch->thread_count++;
+    }
+
+    return batch;
+}
+
+void batch_delete(Batch * batch) {
+    if (batch == NULL) return;
+
+    pthread_mutex_lock(&batch->mutex);
+    batch->running = false;
+    pthread_cond_broadcast(&batch->start);
+    pthread_mutex_unlock(&batch->mutex);
+    for (size_t i = 0; i < batch->thread_count; i++) pthread_join(batch->threads[i], NULL);
+
+    pthread_cond_destroy(&batch->done);
+    pthread_cond_destroy(&batch->start);
+    pthread_mutex_destroy(&batch->mutex);
+    free(batch->threads);
+    free(batch);
+}
+
+size_t batch_get_thread_count(Batch const * const batch) {
+    return batch->thread_count + 1;
+}
+
+size_t batch_get_output_size(BatchOutput const * const output) {
+    if (output == NULL) return 0;
+
+    switch (output->type) {
+        case BATCH_OUTPUT_DISPLAY: return GAMEBOY_DISPLAY_PACKED_SIZE;
+        case BATCH_OUTPUT_MEMORY: return output->size;
+
+        case BATCH_OUTPUT_NONE:
+        default: return 0;
+    }
+}
+
+bool batch_step(Batch * const batch, GameBoy * const * envs, uint8_t const * actions, size_t count, uint32_t frames, BatchOutput const * output) {
+    if (batch == NULL || (envs == NULL && count > 0)) {
+        TRTLE_LOG_ERR("Attempted to pass a null argument into batch_step");
+        return false;
+    }
+    if (batch_get_output_size(output) > 0 && output->data == NULL) {
+        TRTLE_LOG_ERR("Batch output requested without a buffer");
+        return false;
+    }
+
+    batch->envs = envs;
+    batch->actions = actions;
+    batch->count = count;
+    batch->frames = frames;
+    batch->output = output != NULL ? *output : (BatchOutput){ BATCH_OUTPUT_NONE };
+    atomic_store_explicit(&batch->next, 0, memory_order_relaxed);
+
+    // Too few instances to go around are run on the calling thread, waking the pool would cost more
+    if (batch->thread_count == 0 || count <= 1) {
+        batch_work(batch);
+        return true;
+    }
+
+    pthread_mutex_lock(&batch->mutex);
+    batch->busy = batch->thread_count;
+    batch->generation++;
+    pthread_cond_broadcast(&batch->start);
+    pthread_mutex_unlock(&batch->mutex);
+
+    batch_work(batch);
+
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->busy > 0) pthread_cond_wait(&batch->done, &batch->mutex);
+    pthread_mutex_unlock(&batch->mutex);
+
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef TRTLE_BATCH_H
+#define TRTLE_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gameboy.h"
+
+typedef struct Batch Batch;
+
+typedef enum BatchOutputType {
+    BATCH_OUTPUT_NONE,
+    BATCH_OUTPUT_DISPLAY, // The last frame as packed 2-bit shades, GAMEBOY_DISPLAY_PACKED_SIZE bytes
+    BATCH_OUTPUT_MEMORY,  // size bytes read from address after the last frame
+} BatchOutputType;
+
+// Instance i writes its output at data + i * batch_get_output_size(output), so data holds one slot per instance
+typedef struct BatchOutput {
+    BatchOutputType type;
+    uint16_t address;
+    uint16_t size;
+    uint8_t * data;
+} BatchOutput;
+
+// Runs instances on threads workers, the calling thread being one of them. 0 uses one per online processor.
+Batch * batch_create(size_t threads);
+void batch_delete(Batch * batch);
+
+size_t batch_get_thread_count(Batch const * const batch);
+size_t batch_get_output_size(BatchOutput const * const output);
+
+// Runs frames frames on each of count instances, holding the GameBoyButton mask actions[i] on instance i.
+// Only the last frame is drawn, and only when the display is asked for. Nothing is allocated per step, and
+// no instance may appear twice in one step.
+bool batch_step(Batch * const batch, GameBoy * const * envs, uint8_t const * actions, size_t count, uint32_t frames, BatchOutput const * output);
+
+#endif /* !TRTLE_BATCH_H */
@@ -1,12 +1,24 @@
 #include "cartridge.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CARTRIDGE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "gameboy.h"
+#include "memory_map.h"
 #include "logger.h"
 
+#define MBC_TITLE_ADDRESS          (0x0134)
 #define MBC_CARTRIDGE_TYPE_ADDRESS (0x0147)
 #define MBC_ROM_SIZE_ADDRESS       (0x0148)
 #define MBC_RAM_SIZE_ADDRESS       (0x0149)
@@ -23,15 +35,24 @@
 #define MBC2_RAMG_MASK     (0b00001111)
 #define MBC2_ROMB0_MASK    (0b00001111)
 
+#define MBC3_RAMG_MASK     (0b00001111)
+#define MBC3_ROMB0_MASK    (0b01111111)
+#define MBC3_RAMB_MASK     (0b00001111)
+#define MBC3_RTC_S         (0x08)
+#define MBC3_RTC_DH        (0x0C)
+
+#define RTC_CYCLES_PER_SECOND (4194304)
+#define RTC_SECONDS_PER_DAY   (86400)
+#define RTC_DAY_LIMIT         (512)
+#define RTC_DH_DAY_MASK       (0b00000001)
+#define RTC_DH_HALT_MASK      (0b01000000)
+#define RTC_DH_CARRY_MASK     (0b10000000)
+
 #define MBC5_ROMB1_MASK    (0b00000001)
 #define MBC5_RAMB_MASK     (0b00001111)
 
-static CartridgeError cartridge_setup_rom(Cartridge * const cart, const void * rom_data, size_t rom_len) {
-    cart->rom = calloc(1, rom_len);
-    memcpy(cart->rom, rom_data, rom_len);
-    cart->rom_size = rom_len;
-
-    size_t rom_size = cart->rom[MBC_ROM_SIZE_ADDRESS];
+static void cartridge_check_rom_size(CartridgeImage const * const image, size_t rom_len) {
+    size_t rom_size = image->rom[MBC_ROM_SIZE_ADDRESS];
     switch (rom_size) {
         case 0x00: rom_size = ROM_BANK_SIZE * 2; break;
         case 0x01: rom_size = ROM_BANK_SIZE * 4; break;
@@ -47,349 +68,750 @@ static CartridgeError cartridge_setup_rom(Cartridge * const cart, const void * r
         case 0x54: rom_size = ROM_BANK_SIZE * 96; break;
         default: TRTLE_LOG_ERR("Attempted to initialize a cart with an unknown ROM size: %zX\n", rom_size); break;
     }
-    if (cart->rom_size != rom_size) {
-        TRTLE_LOG_WARN("Cartridge size mismatch (Expected %zX bytes, Allocated %zX bytes)", rom_size, cart->rom_size);
+    if (rom_len != rom_size) {
+        TRTLE_LOG_WARN("Cartridge size mismatch (Expected %zX bytes, Allocated %zX bytes)", rom_size, rom_len);
     }
+}
+
+static CartridgeError cartridge_setup_rom(CartridgeImage * const image, const void * rom_data, size_t rom_len) {
+    // Pad up to a whole number of banks so every bank pointer covers a full window
+    size_t padded_len = (rom_len + ROM_BANK_SIZE - 1) & ~(size_t)(ROM_BANK_SIZE - 1);
+    if (padded_len < ROM_BANK_SIZE * 2) padded_len = ROM_BANK_SIZE * 2;
 
+    uint8_t * rom = malloc(padded_len);
+    if (rom == NULL) return CARTRIDGE_ERROR_ROM_ALLOCATION_FAILED;
+    memcpy(rom, rom_data, rom_len);
+    memset(rom + rom_len, 0xFF, padded_len - rom_len);
+    image->rom = rom;
+    image->rom_size = padded_len;
+    image->rom_mapped = false;
+
+    cartridge_check_rom_size(image, rom_len);
     return CARTRIDGE_ERROR_NONE;
 }
 
-static CartridgeError cartridge_setup_ram(Cartridge* const cart) {
-    uint8_t ram_size = cart->rom[MBC_RAM_SIZE_ADDRESS];
+static void cartridge_setup_ram_size(CartridgeImage * const image) {
+    uint8_t ram_size = image->rom[MBC_RAM_SIZE_ADDRESS];
     switch (ram_size) {
-        case 0x00: cart->ram_size = 0; break;
-        case 0x01: cart->ram_size = RAM_BANK_SIZE / 4; break;
-        case 0x02: cart->ram_size = RAM_BANK_SIZE; break;
-        case 0x03: cart->ram_size = RAM_BANK_SIZE * 4; break;
-        case 0x04: cart->ram_size = RAM_BANK_SIZE * 16; break;
-        case 0x05: cart->ram_size = RAM_BANK_SIZE * 8; break;
+        case 0x00: image->ram_size = 0; break;
+        case 0x01: image->ram_size = RAM_BANK_SIZE / 4; break;
+        case 0x02: image->ram_size = RAM_BANK_SIZE; break;
+        case 0x03: image->ram_size = RAM_BANK_SIZE * 4; break;
+        case 0x04: image->ram_size = RAM_BANK_SIZE * 16; break;
+        case 0x05: image->ram_size = RAM_BANK_SIZE * 8; break;
         default: TRTLE_LOG_ERR("Attempted to initialize a cart with an unknown RAM size: %X\n", ram_size); break;
     }
 
     // MBC2 declares itself to have a ram size of 0, so this is required
-    if (cart->type == MBC_MBC2 || cart->type == MBC_MBC2_BATTERY) cart->ram_size = 0x200;
+    if (image->type == MBC_MBC2 || image->type == MBC_MBC2_BATTERY) image->ram_size = 0x200;
+}
 
+struct CartridgeRAM {
+    atomic_uint references;
+    uint8_t data[];
+};
+
+static CartridgeRAM * cartridge_ram_create(size_t size) {
+    CartridgeRAM * block = malloc(sizeof(CartridgeRAM) + size);
+    if (block != NULL) atomic_init(&block->references, 1);
+    return block;
+}
+
+static void cartridge_ram_release(CartridgeRAM * block) {
+    if (block != NULL && atomic_fetch_sub_explicit(&block->references, 1, memory_order_acq_rel) == 1) free(block);
+}
+
+static CartridgeError cartridge_setup_ram(Cartridge * const cart) {
+    cart->ram_size = cart->image->ram_size;
     if (cart->ram_size > 0) {
-        cart->ram = calloc(1, cart->ram_size);
-        if (cart->ram == NULL) return CARTRIDGE_ERROR_RAM_ALLOCATION_FAILED;
+        cart->ram_block = cartridge_ram_create(cart->ram_size);
+        if (cart->ram_block == NULL) return CARTRIDGE_ERROR_RAM_ALLOCATION_FAILED;
+        cart->ram = cart->ram_block->data;
         memset(cart->ram, 0xFF, sizeof(uint8_t) * cart->ram_size);
     }
+    cart->ram_bank_size = cart->ram_size < RAM_BANK_SIZE ? cart->ram_size : RAM_BANK_SIZE;
 
     return CARTRIDGE_ERROR_NONE;
 }
 
-CartridgeError cartridge_from_memory(Cartridge ** return_cart, const void * data, size_t size) {
-    if (return_cart == NULL) return CARTIRDGE_ERROR_RETURN_ARGUMENT_NULL;
+static uint8_t const * cartridge_get_rom_bank(Cartridge const * const cart, size_t bank) {
+    return cart->image->rom + (bank % (cart->image->rom_size / ROM_BANK_SIZE)) * ROM_BANK_SIZE;
+}
 
-    Cartridge * cart = calloc(1, sizeof(Cartridge));
-    if (cart == NULL) return CARTRIDGE_ERROR_CARTRIDGE_ALLOCATION_FAILED;
-    memset(cart, 0, sizeof(Cartridge));
+static uint8_t * cartridge_get_ram_bank(Cartridge const * const cart, size_t bank) {
+    if (cart->ram_size == 0) return NULL;
+    if (cart->ram_size <= RAM_BANK_SIZE) return cart->ram;
+    return cart->ram + (bank % (cart->ram_size / RAM_BANK_SIZE)) * RAM_BANK_SIZE;
+}
 
-    CartridgeError error = cartridge_setup_rom(cart, data, size);
-    if (error) {
-        free(cart);
-        cart = NULL;
-        return error;
+static uint8_t mbc_read_ram(Cartridge const * const cart, uint16_t address) {
+    return 0xFF;
+}
+
+static void mbc_write_ram(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles) {
+    if (cart->ram_bank == NULL) return;
+    cart->ram_bank[address & (cart->ram_bank_size - 1)] = value;
+}
+
+static void mbc_none_initialize(Cartridge * const cart) {
+    cart->romb0 = 0;
+    cart->romb1 = 0;
+    cart->ramb = 0;
+    cart->ramg = false;
+    cart->mode = false;
+}
+
+static void mbc_none_write_rom(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles) {
+    TRTLE_LOG_INFO("Attempted to write to ROM with no MBC\n");
+}
+
+static void mbc_none_update_banks(Cartridge * const cart) {
+    cart->rom_bank0 = cartridge_get_rom_bank(cart, 0);
+    cart->rom_bank1 = cartridge_get_rom_bank(cart, 1);
+    cart->ram_bank = NULL; // TODO: External RAM with no MBC needs to be tested
+}
+
+static void mbc1_initialize(Cartridge * const cart) {
+    cart->romb0 = 1;
+    cart->romb1 = 0;
+    cart->ramb = 0;
+    cart->ramg = false;
+    cart->mode = false;
+}
+
+static void mbc1_write_rom(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles) {
+    if (address <= 0x1FFF) cart->ramg = (value & MBC1_RAMG_MASK) == RAMG_ENABLE;
+    else if (address <= 0x3FFF) cart->romb0 = (value & MBC1_ROMB0_MASK) == 0 ? 1 : (value & MBC1_ROMB0_MASK);
+    else if (address <= 0x5FFF) cart->romb1 = value & MBC1_ROMB1_MASK;
+    else cart->mode = value & 1;
+}
+
+static void mbc1_update_banks(Cartridge * const cart) {
+    cart->rom_bank0 = cartridge_get_rom_bank(cart, cart->mode ? ((size_t)cart->romb1 << 5) : 0);
+    cart->rom_bank1 = cartridge_get_rom_bank(cart, ((size_t)cart->romb1 << 5) | cart->romb0);
+    cart->ram_bank = cart->ramg ? cartridge_get_ram_bank(cart, cart->mode ? cart->romb1 : 0) : NULL;
+}
+
+static void mbc2_initialize(Cartridge * const cart) {
+    cart->romb0 = 1;
+    cart->romb1 = 0;
+    cart->ramb = 0;
+    cart->ramg = false;
+    cart->mode = false;
+}
+
+static void mbc2_write_rom(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles) {
+    if (address <= 0x3FFF) {
+        if (!((address >> 8) & 1)) cart->ramg = (value & MBC2_RAMG_MASK) == RAMG_ENABLE;
+        else cart->romb0 = (value & MBC2_ROMB0_MASK) == 0 ? 1 : (value & MBC2_ROMB0_MASK);
+    }
+}
+
+static void mbc2_write_ram(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles) {
+    if (cart->ram_bank == NULL) return;
+    // MBC2 is 4 bit ram, the upper bits are stored set so reads can use the bank pointer directly
+    cart->ram_bank[address & (cart->ram_bank_size - 1)] = value | 0xF0;
+}
+
+static void mbc2_update_banks(Cartridge * const cart) {
+    cart->rom_bank0 = cartridge_get_rom_bank(cart, 0);
+    cart->rom_bank1 = cartridge_get_rom_bank(cart, cart->romb0);
+    cart->ram_bank = cart->ramg ? cart->ram : NULL;
+}
+
+static void mbc5_initialize(Cartridge * const cart) {
+    cart->romb0 = 1;
+    cart->romb1 = 0;
+    cart->ramb = 0;
+    cart->ramg = false;
+    cart->mode = false;
+}
+
+static void mbc5_write_rom(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles) {
+    if (address <= 0x1FFF) cart->ramg = value == RAMG_ENABLE;
+    else if (address <= 0x2FFF) cart->romb0 = value;
+    else if (address <= 0x3FFF) cart->romb1 = value & MBC5_ROMB1_MASK;
+    else if (address <= 0x5FFF) cart->ramb = value & MBC5_RAMB_MASK;
+}
+
+static void mbc5_update_banks(Cartridge * const cart) {
+    cart->rom_bank0 = cartridge_get_rom_bank(cart, 0);
+    cart->rom_bank1 = cartridge_get_rom_bank(cart, ((size_t)cart->romb1 << 8) | cart->romb0);
+    cart->ram_bank = cart->ramg ? cartridge_get_ram_bank(cart, cart->ramb) : NULL;
+}
+
+static uint64_t rtc_get_counter(CartridgeRTC const * const rtc, uint64_t cycles) {
+    return rtc->halt ? rtc->halted : cycles - rtc->base;
+}
+
+static void rtc_set_counter(CartridgeRTC * const rtc, uint64_t counter, uint64_t cycles) {
+    if (rtc->halt) rtc->halted = counter;
+    else rtc->base = cycles - counter;
+}
+
+static void rtc_get_registers(CartridgeRTC * const rtc, uint64_t cycles, uint8_t registers[5]) {
+    uint64_t seconds = rtc_get_counter(rtc, cycles) / RTC_CYCLES_PER_SECOND;
+    uint64_t days = seconds / RTC_SECONDS_PER_DAY;
+    if (days >= RTC_DAY_LIMIT) {
+        // The day counter overflowed at some point since the last look, fold it back and latch the carry
+        uint64_t overflow = (days / RTC_DAY_LIMIT) * RTC_DAY_LIMIT;
+        rtc_set_counter(rtc, rtc_get_counter(rtc, cycles) - overflow * RTC_SECONDS_PER_DAY * RTC_CYCLES_PER_SECOND, cycles);
+        rtc->carry = true;
+        seconds -= overflow * RTC_SECONDS_PER_DAY;
+        days -= overflow;
+    }
+
+    registers[0] = seconds % 60;
+    registers[1] = (seconds / 60) % 60;
+    registers[2] = (seconds / 3600) % 24;
+    registers[3] = days & 0xFF;
+    registers[4] = ((days >> 8) & RTC_DH_DAY_MASK) | (rtc->halt ? RTC_DH_HALT_MASK : 0) | (rtc->carry ? RTC_DH_CARRY_MASK : 0);
+}
+
+static void rtc_set_registers(CartridgeRTC * const rtc, uint64_t cycles, uint8_t const registers[5], uint64_t subsecond) {
+    uint64_t days = registers[3] | ((uint64_t)(registers[4] & RTC_DH_DAY_MASK) << 8);
+    uint64_t seconds = days * RTC_SECONDS_PER_DAY + registers[2] * 3600 + registers[1] * 60 + registers[0];
+    uint64_t counter = seconds * RTC_CYCLES_PER_SECOND + subsecond;
+
+    rtc->halt = registers[4] & RTC_DH_HALT_MASK;
+    rtc->carry = registers[4] & RTC_DH_CARRY_MASK;
+    rtc_set_counter(rtc, counter, cycles);
+}
+
+static void mbc3_initialize(Cartridge * const cart) {
+    cart->romb0 = 1;
+    cart->romb1 = 0;
+    cart->ramb = 0;
+    cart->ramg = false;
+    cart->mode = false;
+    cart->rtc.latch = 0xFF;
+}
+
+static void mbc3_write_rom(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles) {
+    if (address <= 0x1FFF) cart->ramg = (value & MBC3_RAMG_MASK) == RAMG_ENABLE;
+    else if (address <= 0x3FFF) cart->romb0 = (value & MBC3_ROMB0_MASK) == 0 ? 1 : (value & MBC3_ROMB0_MASK);
+    else if (address <= 0x5FFF) cart->ramb = value & MBC3_RAMB_MASK;
+    else {
+        if (cart->image->rtc && cart->rtc.latch == 0 && value == 1) rtc_get_registers(&cart->rtc, cycles, cart->rtc.latched);
+        cart->rtc.latch = value;
     }
+}
+
+static uint8_t mbc3_read_ram(Cartridge const * const cart, uint16_t address) {
+    if (!cart->ramg || !cart->image->rtc || cart->ramb < MBC3_RTC_S || cart->ramb > MBC3_RTC_DH) return 0xFF;
+    return cart->rtc.latched[cart->ramb - MBC3_RTC_S];
+}
+
+static void mbc3_write_ram(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles) {
+    if (cart->ram_bank != NULL) {
+        mbc_write_ram(cart, address, value, cycles);
+        return;
+    }
+    if (!cart->ramg || !cart->image->rtc || cart->ramb < MBC3_RTC_S || cart->ramb > MBC3_RTC_DH) return;
+
+    static const uint8_t masks[5] = { 0b00111111, 0b00111111, 0b00011111, 0b11111111, 0b11000001 };
+    uint8_t registers[5];
+    rtc_get_registers(&cart->rtc, cycles, registers);
+    uint64_t subsecond = rtc_get_counter(&cart->rtc, cycles) % RTC_CYCLES_PER_SECOND;
+
+    // Writing the seconds register also resets the divider feeding it
+    if (cart->ramb == MBC3_RTC_S) subsecond = 0;
+    registers[cart->ramb - MBC3_RTC_S] = value & masks[cart->ramb - MBC3_RTC_S];
+    rtc_set_registers(&cart->rtc, cycles, registers, subsecond);
+
+    // The clock footer follows ram in the save file
+    size_t page = cart->ram_size >> SAVE_FILE_PAGE_SHIFT;
+    cart->ram_dirty[page / 64] |= 1ull << (page % 64);
+}
+
+static void mbc3_update_banks(Cartridge * const cart) {
+    cart->rom_bank0 = cartridge_get_rom_bank(cart, 0);
+    cart->rom_bank1 = cartridge_get_rom_bank(cart, cart->romb0);
+    cart->ram_bank = cart->ramg && cart->ramb < MBC3_RTC_S ? cartridge_get_ram_bank(cart, cart->ramb) : NULL;
+}
+
+static const CartridgeMBC mbc_none = { mbc_none_initialize, mbc_none_write_rom, mbc_read_ram, mbc_write_ram, mbc_none_update_banks };
+static const CartridgeMBC mbc1 = { mbc1_initialize, mbc1_write_rom, mbc_read_ram, mbc_write_ram, mbc1_update_banks };
+static const CartridgeMBC mbc2 = { mbc2_initialize, mbc2_write_rom, mbc_read_ram, mbc2_write_ram, mbc2_update_banks };
+static const CartridgeMBC mbc3 = { mbc3_initialize, mbc3_write_rom, mbc3_read_ram, mbc3_write_ram, mbc3_update_banks };
+static const CartridgeMBC mbc5 = { mbc5_initialize, mbc5_write_rom, mbc_read_ram, mbc_write_ram, mbc5_update_banks };
 
-    cart->type = cart->rom[MBC_CARTRIDGE_TYPE_ADDRESS];
-    switch (cart->type) {
+static CartridgeMBC const * cartridge_get_mbc(MBC type) {
+    switch (type) {
         case MBC_NONE:
         case MBC_NONE_RAM:
-        case MBC_NONE_RAM_BATTERY: {
-            cart->romb0 = 0;
-            cart->romb1 = 0;
-            cart->ramb = 0;
-            cart->ramg = false;
-            cart->mode = false;
-        } break;
+        case MBC_NONE_RAM_BATTERY: return &mbc_none;
 
         case MBC_MBC1:
         case MBC_MBC1_RAM:
-        case MBC_MBC1_RAM_BATTERY: {
-            cart->romb0 = 1;
-            cart->romb1 = 0;
-            cart->ramb = 0;
-            cart->ramg = false;
-            cart->mode = false;
-        } break;
+        case MBC_MBC1_RAM_BATTERY: return &mbc1;
 
         case MBC_MBC2:
-        case MBC_MBC2_BATTERY: {
-            cart->romb0 = 1;
-            cart->romb1 = 0;
-            cart->ramb = 0;
-            cart->ramg = false;
-            cart->mode = false;
-        } break;
+        case MBC_MBC2_BATTERY: return &mbc2;
+
+        case MBC_MBC3_TIMER_BATTERY:
+        case MBC_MBC3_TIMER_RAM_BATTERY:
+        case MBC_MBC3:
+        case MBC_MBC3_RAM:
+        case MBC_MBC3_RAM_BATTERY: return &mbc3;
 
         case MBC_MBC5:
         case MBC_MBC5_RAM:
         case MBC_MBC5_RAM_BATTERY:
         case MBC_MBC5_RUMBLE:
         case MBC_MBC5_RUMBLE_RAM:
-        case MBC_MBC5_RUMBLE_RAM_BATTERY: {
-            cart->romb0 = 1;
-            cart->romb1 = 0;
-            cart->ramb = 0;
-            cart->ramg = false;
-            cart->mode = false;
-        } break;
+        case MBC_MBC5_RUMBLE_RAM_BATTERY: return &mbc5;
+
+        default: return NULL;
+    }
+}
+
+static void cartridge_image_free_rom(CartridgeImage * const image) {
+    if (image->rom == NULL) return;
+#if defined(CARTRIDGE_MMAP)
+    if (image->rom_mapped) munmap((void *)image->rom, image->rom_size);
+    else free((void *)image->rom);
+#else
+    free((void *)image->rom);
+#endif
+    image->rom = NULL;
+}
+
+static bool cartridge_has_battery(MBC type) {
+    switch (type) {
+        case MBC_MBC1_RAM_BATTERY:
+        case MBC_MBC2_BATTERY:
+        case MBC_NONE_RAM_BATTERY:
+        case MBC_MMM01_RAM_BATTERY:
+        case MBC_MBC3_TIMER_BATTERY:
+        case MBC_MBC3_TIMER_RAM_BATTERY:
+        case MBC_MBC3_RAM_BATTERY:
+        case MBC_MBC5_RAM_BATTERY:
+        case MBC_MBC5_RUMBLE_RAM_BATTERY:
+        case MBC_MBC7_SENSOR_RUMBLE_RAM_BATTERY:
+        case MBC_HuC1_RAM_BATTERY: return true;
+        default: return false;
+    }
+}
+
+// Everything past the ROM bytes themselves, shared by the memory and file loaders
+static CartridgeError cartridge_image_setup(CartridgeImage * const image) {
+    image->type = image->rom[MBC_CARTRIDGE_TYPE_ADDRESS];
+    image->mbc = cartridge_get_mbc(image->type);
+    if (image->mbc == NULL) return CARTRIDGE_ERROR_MBC_NOT_SUPPORTED;
 
-        default: return CARTRIDGE_ERROR_MBC_NOT_SUPPORTED;
+    memcpy(image->title, &image->rom[MBC_TITLE_ADDRESS], CARTRIDGE_TITLE_LENGTH);
+    image->title[CARTRIDGE_TITLE_LENGTH] = '\0';
+
+    image->battery = cartridge_has_battery(image->type);
+    image->rtc = image->type == MBC_MBC3_TIMER_BATTERY || image->type == MBC_MBC3_TIMER_RAM_BATTERY;
+    cartridge_setup_ram_size(image);
+
+    // Banks from MBC3_RTC_S up select clock registers, and the save file footer must fit after ram
+    if (image->mbc == &mbc3 && image->ram_size > RAM_BANK_SIZE * MBC3_RTC_S) {
+        TRTLE_LOG_WARN("MBC3 cart declares %zX bytes of RAM, clamping to %X\n", image->ram_size, RAM_BANK_SIZE * MBC3_RTC_S);
+        image->ram_size = RAM_BANK_SIZE * MBC3_RTC_S;
     }
+    atomic_init(&image->references, 1);
+    return CARTRIDGE_ERROR_NONE;
+}
 
-    error = cartridge_setup_ram(cart);
+CartridgeError cartridge_image_from_memory(CartridgeImage ** return_image, const void * data, size_t size) {
+    if (return_image == NULL) return CARTIRDGE_ERROR_RETURN_ARGUMENT_NULL;
+
+    CartridgeImage * image = calloc(1, sizeof(CartridgeImage));
+    if (image == NULL) return CARTRIDGE_ERROR_CARTRIDGE_ALLOCATION_FAILED;
+
+    CartridgeError error = cartridge_setup_rom(image, data, size);
+    if (!error) error = cartridge_image_setup(image);
     if (error) {
-        free(cart->rom);
-        free(cart);
+        cartridge_image_free_rom(image);
+        free(image);
+        image = NULL;
+        return error;
+    }
+
+    *return_image = image;
+    return CARTRIDGE_ERROR_NONE;
+}
+
+static CartridgeError cartridge_read_file(CartridgeImage * const image, FILE * file, size_t size) {
+    void * data = malloc(size);
+    if (data == NULL) return CARTRIDGE_ERROR_ROM_ALLOCATION_FAILED;
+
+    CartridgeError error = CARTRIDGE_ERROR_FILE_READ_FAILED;
+    if (fread(data, 1, size, file) == size) error = cartridge_setup_rom(image, data, size);
+
+    free(data);
+    return error;
+}
+
+#if defined(CARTRIDGE_MMAP)
+// ROM images that aren't a whole number of banks are copied and padded so every bank pointer covers a full window
+static bool cartridge_rom_needs_padding(size_t rom_len) {
+    return rom_len < ROM_BANK_SIZE * 2 || (rom_len & (ROM_BANK_SIZE - 1)) != 0;
+}
+
+// Maps the ROM read-only so its pages come straight from the page cache and are shared between processes
+static CartridgeError cartridge_map_file(CartridgeImage * const image, int fd, size_t size) {
+    void * rom = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (rom == MAP_FAILED) return CARTRIDGE_ERROR_FILE_READ_FAILED;
+
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+#endif
+    madvise(rom, size, MADV_WILLNEED);
+
+    image->rom = rom;
+    image->rom_size = size;
+    image->rom_mapped = true;
+
+    cartridge_check_rom_size(image, size);
+    return CARTRIDGE_ERROR_NONE;
+}
+#endif
+
+CartridgeError cartridge_image_from_file(CartridgeImage ** return_image, const char * path) {
+    if (return_image == NULL) return CARTIRDGE_ERROR_RETURN_ARGUMENT_NULL;
+
+    FILE * file = fopen(path, "rb");
+    if (file == NULL) return CARTRIDGE_ERROR_FILE_NOT_FOUND;
+
+    size_t size = 0;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long end = ftell(file);
+        if (end > 0) size = (size_t)end;
+        rewind(file);
+    }
+    if (size == 0) {
+        fclose(file);
+        return CARTRIDGE_ERROR_FILE_READ_FAILED;
+    }
+
+    CartridgeImage * image = calloc(1, sizeof(CartridgeImage));
+    if (image == NULL) {
+        fclose(file);
+        return CARTRIDGE_ERROR_CARTRIDGE_ALLOCATION_FAILED;
+    }
+
+    CartridgeError error;
+#if defined(CARTRIDGE_MMAP)
+    if (!cartridge_rom_needs_padding(size)) error = cartridge_map_file(image, fileno(file), size);
+    else error = cartridge_read_file(image, file, size);
+#else
+    error = cartridge_read_file(image, file, size);
+#endif
+    fclose(file);
+
+    if (!error) error = cartridge_image_setup(image);
+    if (error) {
+        cartridge_image_free_rom(image);
+        free(image);
+        image = NULL;
+        return error;
+    }
+
+    *return_image = image;
+    return CARTRIDGE_ERROR_NONE;
+}
+
+CartridgeImage * cartridge_image_retain(CartridgeImage * image) {
+    if (image != NULL) atomic_fetch_add_explicit(&image->references, 1, memory_order_relaxed);
+    return image;
+}
+
+void cartridge_image_release(CartridgeImage * image) {
+    if (image != NULL && atomic_fetch_sub_explicit(&image->references, 1, memory_order_acq_rel) == 1) {
+        cartridge_image_free_rom(image);
+        free(image);
+    }
+}
+
+uint64_t cartridge_image_hash(CartridgeImage const * const image) {
+    // FNV-1a over whole words, the rom is always padded to a multiple of a bank
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < image->rom_size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, image->rom + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3;
+    }
+    return hash;
+}
+
+CartridgeError cartridge_create(Cartridge ** return_cart, CartridgeImage * image) {
+    if (return_cart == NULL) return CARTIRDGE_ERROR_RETURN_ARGUMENT_NULL;
+
+    Cartridge * cart = calloc(1, sizeof(Cartridge));
+    if (cart == NULL) return CARTRIDGE_ERROR_CARTRIDGE_ALLOCATION_FAILED;
+
+    cart->image = cartridge_image_retain(image);
+    cart->mbc = image->mbc;
+
+    CartridgeError error = cartridge_setup_ram(cart);
+    if (error) {
+        cartridge_delete(cart);
         cart = NULL;
         return error;
     }
 
+    cart->mbc->initialize(cart);
+    cart->mbc->update_banks(cart);
+
     *return_cart = cart;
     return CARTRIDGE_ERROR_NONE;
 }
 
+CartridgeError cartridge_fork(Cartridge ** return_cart, Cartridge * const cart) {
+    if (return_cart == NULL) return CARTIRDGE_ERROR_RETURN_ARGUMENT_NULL;
+    if (cart == NULL) {
+        *return_cart = NULL;
+        return CARTRIDGE_ERROR_NONE;
+    }
+
+    Cartridge * fork = malloc(sizeof(Cartridge));
+    if (fork == NULL) return CARTRIDGE_ERROR_CARTRIDGE_ALLOCATION_FAILED;
+
+    memcpy(fork, cart, sizeof(Cartridge));
+    cartridge_image_retain(fork->image);
+    fork->save_file = NULL;
+    fork->save_interval = 0;
+    fork->save_frames = 0;
+    memset(fork->ram_dirty, 0, sizeof(fork->ram_dirty));
+
+    if (cart->ram_block != NULL) atomic_fetch_add_explicit(&cart->ram_block->references, 1, memory_order_relaxed);
+    else if (cart->ram_size > 0) {
+        // The parent keeps writing through its file mapping, so the fork needs its own copy up front
+        fork->ram_block = cartridge_ram_create(cart->ram_size);
+        if (fork->ram_block == NULL) {
+            cartridge_image_release(fork->image);
+            free(fork);
+            return CARTRIDGE_ERROR_RAM_ALLOCATION_FAILED;
+        }
+        fork->ram = fork->ram_block->data;
+        memcpy(fork->ram, cart->ram, cart->ram_size);
+        fork->mbc->update_banks(fork);
+    }
+
+    *return_cart = fork;
+    return CARTRIDGE_ERROR_NONE;
+}
+
+bool cartridge_adopt(GameBoy * const gb, Cartridge * const fork) {
+    Cartridge * const cart = gb->cartridge;
+
+    // The fork only ever writes to ram of its own, and what it wrote is still marked dirty since it never flushes
+    if (fork->ram != cart->ram) {
+        if (!cartridge_own_ram(gb)) return false;
+        size_t pages = (cart->ram_size + SAVE_FILE_PAGE_SIZE - 1) >> SAVE_FILE_PAGE_SHIFT;
+        for (size_t page = 0; page < pages; page++) {
+            if (!(fork->ram_dirty[page / 64] & (1ull << (page % 64)))) continue;
+            size_t offset = page << SAVE_FILE_PAGE_SHIFT;
+            size_t size = cart->ram_size - offset < SAVE_FILE_PAGE_SIZE ? cart->ram_size - offset : SAVE_FILE_PAGE_SIZE;
+            memcpy(cart->ram + offset, fork->ram + offset, size);
+        }
+    }
+
+    memcpy(&cart->romb0, &fork->romb0, offsetof(Cartridge, ram_dirty) - offsetof(Cartridge, romb0));
+    for (size_t i = 0; i < SAVE_FILE_DIRTY_WORDS; i++) {
+        cart->ram_dirty[i] |= fork->ram_dirty[i];
+        cart->ram_written[i] |= fork->ram_written[i];
+    }
+    cartridge_refresh(gb);
+    return true;
+}
+
 void cartridge_delete(Cartridge * cart) {
     if (cart != NULL) {
-        if ((cart)->rom != NULL) {
-            free((cart)->rom);
-            (cart)->rom = NULL;
-        }
-        if ((cart)->ram != NULL) {
-            free((cart)->ram);
+        cartridge_image_release(cart->image);
+        if ((cart)->save_file != NULL) {
+            save_file_close((cart)->save_file);
+            (cart)->save_file = NULL;
             (cart)->ram = NULL;
         }
+        cartridge_ram_release(cart->ram_block);
         free(cart);
         cart = NULL;
     }
 }
 
-static uint8_t cartridge_read_low(GameBoy const * const gb, uint16_t address) {
-    address &= 0x3FFF;
-    size_t size = gb->cartridge->rom_size - 1; // For address wrap
-    switch (gb->cartridge->type) {
-        case MBC_NONE:
-        case MBC_NONE_RAM:
-        case MBC_NONE_RAM_BATTERY: {
-            return gb->cartridge->rom[address & size];
-        } break;
+bool cartridge_own_ram(GameBoy * const gb) {
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL || cart->ram_block == NULL) return true;
+    if (atomic_load_explicit(&cart->ram_block->references, memory_order_acquire) == 1) return true;
 
-        case MBC_MBC1:
-        case MBC_MBC1_RAM:
-        case MBC_MBC1_RAM_BATTERY: {
-            size_t rom_bank = gb->cartridge->mode ? ((size_t)gb->cartridge->romb1 << 5) : 0;
-            return gb->cartridge->rom[((rom_bank * ROM_BANK_SIZE) | address) & size];
-        } break;
+    CartridgeRAM * block = cartridge_ram_create(cart->ram_size);
+    if (block == NULL) {
+        TRTLE_LOG_ERR("Failed to allocate private cartridge ram");
+        return false;
+    }
 
-        case MBC_MBC2:
-        case MBC_MBC2_BATTERY: {
-            return gb->cartridge->rom[address & size];
-        } break;
+    memcpy(block->data, cart->ram, cart->ram_size);
+    cartridge_ram_release(cart->ram_block);
+    cart->ram_block = block;
+    cart->ram = block->data;
+    cartridge_refresh(gb);
+    return true;
+}
 
-        case MBC_MBC5:
-        case MBC_MBC5_RAM:
-        case MBC_MBC5_RAM_BATTERY:
-        case MBC_MBC5_RUMBLE:
-        case MBC_MBC5_RUMBLE_RAM:
-        case MBC_MBC5_RUMBLE_RAM_BATTERY: {
-            return gb->cartridge->rom[address & size];
-        } break;
+static void rtc_write_u32(uint8_t * data, uint32_t value) {
+    for (size_t i = 0; i < 4; i++) data[i] = value >> (i * 8);
+}
 
-        default: {
-            TRTLE_LOG_ERR("Attempted to read from ROM with a Non-supported MBC");
-            return 0xFF;
-        } break;
-    }
-    TRTLE_LOG_ERR("Switch leaked during low external ROM read");
+static uint32_t rtc_read_u32(uint8_t const * data) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < 4; i++) value |= (uint32_t)data[i] << (i * 8);
+    return value;
 }
 
-static uint8_t cartridge_read_high(GameBoy const * const gb, uint16_t address) {
-    address &= ROM_BANK_SIZE - 1;
-    size_t size = gb->cartridge->rom_size - 1; // For address wrap
-    switch (gb->cartridge->type) {
-        case MBC_NONE:
-        case MBC_NONE_RAM:
-        case MBC_NONE_RAM_BATTERY: {
-            return gb->cartridge->rom[((size_t)address + ROM_BANK_SIZE) & size];
-        } break;
+void cartridge_rtc_save(GameBoy const * const gb, uint8_t data[CARTRIDGE_RTC_SAVE_SIZE]) {
+    memset(data, 0, CARTRIDGE_RTC_SAVE_SIZE);
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL || !cart->image->rtc) return;
 
-        case MBC_MBC1:
-        case MBC_MBC1_RAM:
-        case MBC_MBC1_RAM_BATTERY: {
-            size_t rom_bank = (gb->cartridge->romb1 << 5) | gb->cartridge->romb0;
-            return gb->cartridge->rom[((rom_bank * ROM_BANK_SIZE) | address) & size];
-        } break;
+    uint8_t registers[5];
+    rtc_get_registers(&cart->rtc, gb->cycles, registers);
+    for (size_t i = 0; i < 5; i++) {
+        rtc_write_u32(data + i * 4, registers[i]);
+        rtc_write_u32(data + 20 + i * 4, cart->rtc.latched[i]);
+    }
 
-        case MBC_MBC2:
-        case MBC_MBC2_BATTERY: {
-            return gb->cartridge->rom[((gb->cartridge->romb0 * ROM_BANK_SIZE) | address) & size];
-        } break;
+    uint64_t timestamp = (uint64_t)time(NULL);
+    rtc_write_u32(data + 40, (uint32_t)timestamp);
+    rtc_write_u32(data + 44, (uint32_t)(timestamp >> 32));
+}
 
-        case MBC_MBC5:
-        case MBC_MBC5_RAM:
-        case MBC_MBC5_RAM_BATTERY:
-        case MBC_MBC5_RUMBLE:
-        case MBC_MBC5_RUMBLE_RAM:
-        case MBC_MBC5_RUMBLE_RAM_BATTERY: {
-            size_t rom_bank = (gb->cartridge->romb1 << 8) | gb->cartridge->romb0;
-            return gb->cartridge->rom[((rom_bank * ROM_BANK_SIZE) | address) & size];
-        } break;
+void cartridge_rtc_load(GameBoy * const gb, uint8_t const data[CARTRIDGE_RTC_SAVE_SIZE]) {
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL || !cart->image->rtc) return;
 
-        default: {
-            TRTLE_LOG_ERR("Attempted to read from ROM with a non-supported MBC");
-            return 0xFF;
-        } break;
+    uint8_t registers[5];
+    for (size_t i = 0; i < 5; i++) {
+        registers[i] = rtc_read_u32(data + i * 4);
+        cart->rtc.latched[i] = rtc_read_u32(data + 20 + i * 4);
     }
-    TRTLE_LOG_ERR("Switch leaked during high external ROM read");
-}
+    rtc_set_registers(&cart->rtc, gb->cycles, registers, 0);
 
-uint8_t cartridge_read_rom(GameBoy const * const gb, uint16_t address) {
-    if (gb->cartridge != NULL) {
-        if (address <= 0x3FFF) return cartridge_read_low(gb, address);
-        else return cartridge_read_high(gb, address);
+    // Time spent powered off still counts, unless the clock was halted
+    uint64_t timestamp = rtc_read_u32(data + 40) | ((uint64_t)rtc_read_u32(data + 44) << 32);
+    uint64_t now = (uint64_t)time(NULL);
+    if (!cart->rtc.halt && timestamp != 0 && now > timestamp) {
+        rtc_set_counter(&cart->rtc, rtc_get_counter(&cart->rtc, gb->cycles) + (now - timestamp) * RTC_CYCLES_PER_SECOND, gb->cycles);
     }
-
-    return 0xFF;
 }
 
-void cartridge_write_rom(GameBoy * const gb, uint16_t address, uint8_t value) {
-    switch (gb->cartridge->type) {
-        case MBC_NONE:
-        case MBC_NONE_RAM:
-        case MBC_NONE_RAM_BATTERY: {
-            TRTLE_LOG_INFO("Attempted to write to ROM with no MBC\n");
-        } break;
+CartridgeError cartridge_attach_save_file(GameBoy * const gb, const char * path, uint32_t flush_interval) {
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL || !cart->image->battery) return CARTRIDGE_ERROR_NO_BATTERY;
+
+    size_t footer = cart->image->rtc ? CARTRIDGE_RTC_SAVE_SIZE : 0;
+    size_t size = cart->ram_size + footer;
+    if (size == 0) return CARTRIDGE_ERROR_NO_BATTERY;
+
+    uint8_t * initial = malloc(size);
+    if (initial == NULL) return CARTRIDGE_ERROR_RAM_ALLOCATION_FAILED;
+    if (cart->ram_size > 0) memcpy(initial, cart->ram, cart->ram_size);
+    if (footer > 0) cartridge_rtc_save(gb, initial + cart->ram_size);
+
+    SaveFile * save = save_file_open(path, initial, size);
+    free(initial);
+    if (save == NULL) return CARTRIDGE_ERROR_SAVE_FILE_FAILED;
+
+    if (cart->save_file != NULL) save_file_close(cart->save_file);
+    cartridge_ram_release(cart->ram_block);
+    cart->ram_block = NULL;
+
+    cart->save_file = save;
+    cart->ram = save_file_get_data(save);
+    cart->save_interval = flush_interval;
+    cart->save_frames = 0;
+    memset(cart->ram_dirty, 0, sizeof(cart->ram_dirty));
+    if (footer > 0) cartridge_rtc_load(gb, cart->ram + cart->ram_size);
+
+    // Ram and the clock were just replaced wholesale, which no written page bit records
+    gameboy_invalidate_snapshot(gb);
+    cart->mbc->update_banks(cart);
+    gameboy_map_cartridge(gb);
+    return CARTRIDGE_ERROR_NONE;
+}
 
-        case MBC_MBC1:
-        case MBC_MBC1_RAM:
-        case MBC_MBC1_RAM_BATTERY: {
-            if (address <= 0x1FFF) gb->cartridge->ramg = (value & MBC1_RAMG_MASK) == RAMG_ENABLE;
-            else if (address <= 0x3FFF) gb->cartridge->romb0 = (value & MBC1_ROMB0_MASK) == 0 ? 1 : (value & MBC1_ROMB0_MASK);
-            else if (address <= 0x5FFF) gb->cartridge->romb1 = value & MBC1_ROMB1_MASK;
-            else gb->cartridge->mode = value & 1;
-        } break;
+void cartridge_flush(GameBoy * const gb) {
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL || cart->save_file == NULL) return;
 
-        case MBC_MBC2:
-        case MBC_MBC2_BATTERY: {
-            if (address <= 0x3FFF) {
-                if (!((address >> 8) & 1)) gb->cartridge->ramg = (value & MBC2_RAMG_MASK) == RAMG_ENABLE;
-                else gb->cartridge->romb0 = (value & MBC2_ROMB0_MASK) == 0 ? 1 : (value & MBC2_ROMB0_MASK);
-            }
-        } break;
+    bool dirty = false;
+    for (size_t i = 0; i < SAVE_FILE_DIRTY_WORDS; i++) dirty |= cart->ram_dirty[i] != 0;
+    if (!dirty) return;
 
-        case MBC_MBC5:
-        case MBC_MBC5_RAM:
-        case MBC_MBC5_RAM_BATTERY:
-        case MBC_MBC5_RUMBLE:
-        case MBC_MBC5_RUMBLE_RAM:
-        case MBC_MBC5_RUMBLE_RAM_BATTERY: {
-            if (address <= 0x1FFF) gb->cartridge->ramg = value == RAMG_ENABLE;
-            else if (address <= 0x2FFF) gb->cartridge->romb0 = value;
-            else if (address <= 0x3FFF) gb->cartridge->romb1 = value & MBC5_ROMB1_MASK;
-            else if (address <= 0x5FFF) gb->cartridge->ramb = value & MBC5_RAMB_MASK;
-        } break;
+    // The footer pairs the clock with a timestamp, so it is only refreshed alongside other changes
+    if (cart->image->rtc) {
+        cartridge_rtc_save(gb, cart->ram + cart->ram_size);
+        size_t page = cart->ram_size >> SAVE_FILE_PAGE_SHIFT;
+        cart->ram_dirty[page / 64] |= 1ull << (page % 64);
+    }
 
-        default: {
-            TRTLE_LOG_ERR("Attempted to write to ROM with a non-supported MBC");
-        } break;
+    // A busy flush thread just means the pages stay dirty and go out with the next batch
+    if (save_file_flush_async(cart->save_file, cart->ram_dirty)) {
+        memset(cart->ram_dirty, 0, sizeof(cart->ram_dirty));
+        cart->save_frames = 0;
     }
 }
 
-uint8_t cartridge_read_ram(GameBoy const * const gb, uint16_t address) {
-    address &= RAM_BANK_SIZE - 1;
-    size_t size = gb->cartridge->ram_size - 1; // For address wrap
-    switch (gb->cartridge->type) {
-        case MBC_NONE_RAM:
-        case MBC_NONE_RAM_BATTERY: {
-            TRTLE_LOG_WARN("Attempted to read from external RAM with no MBC, this needs to be tested"); // TODO:
-        } break;
-
-        case MBC_MBC1_RAM:
-        case MBC_MBC1_RAM_BATTERY: {
-            if (gb->cartridge->ramg) {
-                size_t ram_bank = gb->cartridge->mode ? gb->cartridge->romb1 : 0;
-                return gb->cartridge->ram[((ram_bank * RAM_BANK_SIZE) | address) & size];
-            }
-            else return 0xFF;
-        } break;
+void cartridge_end_frame(GameBoy * const gb) {
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL || cart->save_file == NULL) return;
+    if (++cart->save_frames < cart->save_interval) return;
 
-        case MBC_MBC2:
-        case MBC_MBC2_BATTERY: {
-            if (gb->cartridge->ramg) return 0xF0 | (gb->cartridge->ram[address & size] & 0x0F);
-            else return 0xFF;
-        } break;
+    cartridge_flush(gb);
+}
 
-        case MBC_MBC5_RAM:
-        case MBC_MBC5_RAM_BATTERY:
-        case MBC_MBC5_RUMBLE_RAM:
-        case MBC_MBC5_RUMBLE_RAM_BATTERY: {
-            if (gb->cartridge->ramg) {
-                return gb->cartridge->ram[((gb->cartridge->ramb * RAM_BANK_SIZE) | address) & size];
-            }
-            else return 0xFF;
-        } break;
+void cartridge_refresh(GameBoy * const gb) {
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL) return;
 
-        case MBC_NONE:
-        case MBC_MBC1:
-        case MBC_MBC5:
-        case MBC_MBC5_RUMBLE: {
-            return 0xFF;
-        } break;
+    cart->mbc->update_banks(cart);
+    gameboy_map_cartridge(gb);
+}
 
-        default: {
-            TRTLE_LOG_ERR("Attempted to read from RAM with a non-supported MBC");
-            return 0xFF;
-        } break;
+uint8_t cartridge_read_rom(GameBoy const * const gb, uint16_t address) {
+    if (gb->cartridge != NULL) {
+        if (address <= 0x3FFF) return gb->cartridge->rom_bank0[address & (ROM_BANK_SIZE - 1)];
+        else return gb->cartridge->rom_bank1[address & (ROM_BANK_SIZE - 1)];
     }
-    TRTLE_LOG_ERR("Switch leaked during external RAM read");
+
     return 0xFF;
 }
 
-void cartridge_write_ram(GameBoy * const gb, uint16_t address, uint8_t value) {
-    address &= RAM_BANK_SIZE - 1;
-    size_t size = gb->cartridge->ram_size - 1; // For address wrap
-    switch (gb->cartridge->type) {
-        case MBC_NONE_RAM:
-        case MBC_NONE_RAM_BATTERY: {
-            TRTLE_LOG_WARN("Attempted to write external RAM with no MBC, this needs to be tested\n"); // TODO:
-        } break;
+void cartridge_write_rom(GameBoy * const gb, uint16_t address, uint8_t value) {
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL) return;
 
-        case MBC_MBC1_RAM:
-        case MBC_MBC1_RAM_BATTERY: {
-            if (gb->cartridge->ramg) {
-                size_t ram_bank = gb->cartridge->mode ? gb->cartridge->romb1 : 0;
-                gb->cartridge->ram[((ram_bank * RAM_BANK_SIZE) | address) & size] = value;
-            }
-        } break;
+    uint8_t const * rom_bank0 = cart->rom_bank0;
+    uint8_t const * rom_bank1 = cart->rom_bank1;
+    uint8_t * ram_bank = cart->ram_bank;
 
-        case MBC_MBC2:
-        case MBC_MBC2_BATTERY: {
-            if (gb->cartridge->ramg) {
-                // MBC2 is 4 bit ram hence the bitwise and on the value
-                gb->cartridge->ram[address & size] = value & 0x0F;
-            }
-        } break;
+    cart->mbc->write_rom(cart, address, value, gb->cycles);
+    cart->mbc->update_banks(cart);
 
-        case MBC_MBC5_RAM:
-        case MBC_MBC5_RAM_BATTERY:
-        case MBC_MBC5_RUMBLE_RAM:
-        case MBC_MBC5_RUMBLE_RAM_BATTERY: {
-            if (gb->cartridge->ramg) {
-                gb->cartridge->ram[((gb->cartridge->ramb * RAM_BANK_SIZE) | address) & size] = value;
-            }
-        } break;
+    if (cart->rom_bank0 != rom_bank0 || cart->rom_bank1 != rom_bank1 || cart->ram_bank != ram_bank) {
+        gameboy_map_cartridge(gb);
+    }
+}
 
-        case MBC_NONE:
-        case MBC_MBC1:
-        case MBC_MBC5:
-        case MBC_MBC5_RUMBLE: {
-            // Swallow
-        } break;
+uint8_t cartridge_read_ram(GameBoy const * const gb, uint16_t address) {
+    if (gb->cartridge == NULL) return 0xFF;
+    if (gb->cartridge->ram_bank == NULL) return gb->cartridge->mbc->read_ram(gb->cartridge, address);
+    return gb->cartridge->ram_bank[address & (gb->cartridge->ram_bank_size - 1)];
+}
 
-        default: {
-            TRTLE_LOG_ERR("Attempted to write RAM with a non-supported MBC\n");
-        } break;
-    }
+void cartridge_write_ram(GameBoy * const gb, uint16_t address, uint8_t value) {
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL) return;
+    if (cart->ram_bank != NULL && !cartridge_own_ram(gb)) return;
+    cart->mbc->write_ram(cart, address, value, gb->cycles);
+    if (cart->ram_bank == NULL) return;
+
+    size_t offset = (size_t)(cart->ram_bank - cart->ram) + (address & (cart->ram_bank_size - 1));
+    size_t page = offset >> SAVE_FILE_PAGE_SHIFT;
+    cart->ram_dirty[page / 64] |= 1ull << (page % 64);
+    cart->ram_written[page / 64] |= 1ull << (page % 64);
 }
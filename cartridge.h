@@ -1,9 +1,15 @@
 #ifndef TRTLE_CARTRIDGE_H
 #define TRTLE_CARTRIDGE_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "save_file.h"
+
+typedef struct CartridgeMBC CartridgeMBC;
+typedef struct CartridgeRAM CartridgeRAM;
 typedef struct GameBoy GameBoy;
 
 typedef enum CartridgeError {
@@ -13,7 +19,10 @@ typedef enum CartridgeError {
     CARTRIDGE_ERROR_CARTRIDGE_ALLOCATION_FAILED,
     CARTRIDGE_ERROR_ROM_ALLOCATION_FAILED,
     CARTRIDGE_ERROR_RAM_ALLOCATION_FAILED,
-    CARTRIDGE_ERROR_MBC_NOT_SUPPORTED
+    CARTRIDGE_ERROR_MBC_NOT_SUPPORTED,
+    CARTRIDGE_ERROR_FILE_READ_FAILED,
+    CARTRIDGE_ERROR_NO_BATTERY,
+    CARTRIDGE_ERROR_SAVE_FILE_FAILED
 } CartridgeError;
 
 typedef enum MBC {
@@ -48,23 +57,105 @@ typedef enum MBC {
     MBC_HuC1_RAM_BATTERY               = 0xFF
 } MBC;
 
-typedef struct Cartridge {
+#define CARTRIDGE_TITLE_LENGTH (16)
+
+// Size of the clock footer stored after save ram, in the layout shared by most emulators
+#define CARTRIDGE_RTC_SAVE_SIZE (48)
+
+// The immutable, shareable part of a cartridge: the ROM bytes and everything parsed from the header.
+// Images are reference counted so any number of instances, on any thread, can run from one copy.
+typedef struct CartridgeImage {
+    atomic_size_t references;
     MBC type;
-    uint8_t * rom;
-    uint8_t * ram;
+    CartridgeMBC const * mbc;
+    uint8_t const * rom;
     size_t rom_size;
     size_t ram_size;
+    bool rom_mapped;
+    bool battery;
+    bool rtc;
+    char title[CARTRIDGE_TITLE_LENGTH + 1];
+} CartridgeImage;
+
+// The MBC3 clock is never ticked, its registers are derived from the cycle counter when latched or written
+typedef struct CartridgeRTC {
+    uint64_t base;    // Cycle at which the counter last read zero
+    uint64_t halted;  // Frozen counter value while the halt flag is set
+    bool halt;
+    bool carry;
+    uint8_t latch;
+    uint8_t latched[5];
+} CartridgeRTC;
+
+// The per-instance part of a cartridge: bank registers, derived bank pointers and save RAM
+typedef struct Cartridge {
+    CartridgeImage * image;
+    CartridgeMBC const * mbc;
+    uint8_t * ram;
+    size_t ram_size;
+    CartridgeRAM * ram_block; // Owner of ram unless it is backed by a save file, shared by forks until written
 
+    // Host pointers for the 0x0000, 0x4000 and 0xA000 windows, recomputed when a bank register changes
+    uint8_t const * rom_bank0;
+    uint8_t const * rom_bank1;
+    uint8_t * ram_bank;
+    size_t ram_bank_size;
+
+    // Bank registers and clock, saved as a single block in savestates
     uint8_t romb0;
     uint8_t romb1;
     uint8_t ramb;
     bool ramg;
     bool mode;
+
+    CartridgeRTC rtc;
+
+    // One bit per SAVE_FILE_PAGE_SIZE bytes of ram written since the last flush
+    uint64_t ram_dirty[SAVE_FILE_DIRTY_WORDS];
+    // The same, but since the last snapshot save or restore
+    uint64_t ram_written[SAVE_FILE_DIRTY_WORDS];
+    SaveFile * save_file;
+    uint32_t save_interval;
+    uint32_t save_frames;
 } Cartridge;
 
-CartridgeError cartridge_from_memory(Cartridge ** return_cart, const void * data, size_t size);
+typedef struct CartridgeMBC {
+    void (*initialize)(Cartridge * const cart);
+    void (*write_rom)(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles);
+    uint8_t (*read_ram)(Cartridge const * const cart, uint16_t address);
+    void (*write_ram)(Cartridge * const cart, uint16_t address, uint8_t value, uint64_t cycles);
+    void (*update_banks)(Cartridge * const cart);
+} CartridgeMBC;
+
+CartridgeError cartridge_image_from_memory(CartridgeImage ** return_image, const void * data, size_t size);
+CartridgeError cartridge_image_from_file(CartridgeImage ** return_image, const char * path);
+CartridgeImage * cartridge_image_retain(CartridgeImage * image);
+void cartridge_image_release(CartridgeImage * image);
+
+// Identifies the rom contents, so state saved for one game is never applied to another
+uint64_t cartridge_image_hash(CartridgeImage const * const image);
+
+CartridgeError cartridge_create(Cartridge ** return_cart, CartridgeImage * image);
+// The fork shares ram with cart until either writes to it, but never the save file
+CartridgeError cartridge_fork(Cartridge ** return_cart, Cartridge * const cart);
+// Takes over the banks, clock and ram writes of a fork of gb's cartridge, which keeps its own save file
+bool cartridge_adopt(GameBoy * const gb, Cartridge * const fork);
 void cartridge_delete(Cartridge * cart);
 
+// Makes ram private to the instance before it is written, remapping it if it had to be copied
+bool cartridge_own_ram(GameBoy * const gb);
+
+// Backs battery ram with a memory mapped file, flushed in the background at most every flush_interval frames
+CartridgeError cartridge_attach_save_file(GameBoy * const gb, const char * path, uint32_t flush_interval);
+void cartridge_end_frame(GameBoy * const gb);
+// Rebuilds bank pointers after the registers were replaced wholesale, as when loading a state
+void cartridge_refresh(GameBoy * const gb);
+void cartridge_flush(GameBoy * const gb);
+
+// Converts the clock to and from the footer layout, catching up on wall clock time spent powered off
+void cartridge_rtc_save(GameBoy const * const gb, uint8_t data[CARTRIDGE_RTC_SAVE_SIZE]);
+void cartridge_rtc_load(GameBoy * const gb, uint8_t const data[CARTRIDGE_RTC_SAVE_SIZE]);
+
 uint8_t cartridge_read_rom(GameBoy const* const gb, uint16_t address);
 void cartridge_write_rom(GameBoy* const gb, uint16_t address, uint8_t value);
 
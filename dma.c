@@ -1,7 +1,10 @@
 #include "dma.h"
 
+#include <string.h>
+
 #include "cartridge.h"
 #include "gameboy.h"
+#include "memory_map.h"
 #include "ppu.h"
 #include "processor.h"
 
@@ -13,6 +16,25 @@ void dma_initialize(DMA * const dma, bool skip_bootrom) {
     dma->active = false;
 }
 
+// The whole block is copied as soon as the transfer starts, the remaining cycles only model the bus conflict
+static void dma_transfer(GameBoy * const gb) {
+    uint16_t source = gb->dma->dma << 8;
+    uint8_t * oam = gb->memory->oam;
+    if (source <= 0x7FFF) {
+        if (gb->cartridge == NULL) memset(oam, 0xFF, DMA_TRANSFER_LENGTH);
+        else {
+            uint8_t const * bank = source <= 0x3FFF ? gb->cartridge->rom_bank0 : gb->cartridge->rom_bank1;
+            memcpy(oam, &bank[source & 0x3FFF], DMA_TRANSFER_LENGTH);
+        }
+    }
+    else if (source <= 0x9FFF) memcpy(oam, gameboy_get_page(gb, GAMEBOY_VRAM_PAGE + (source - 0x8000) / GAMEBOY_PAGE_SIZE), DMA_TRANSFER_LENGTH);
+    else if (source <= 0xBFFF) {
+        for (size_t i = 0; i < DMA_TRANSFER_LENGTH; i++) oam[i] = cartridge_read_ram(gb, (source | i) - 0xA000);
+    }
+    else if (source <= 0xDFFF) memcpy(oam, gameboy_get_page(gb, GAMEBOY_WRAM_PAGE + (source - 0xC000) / GAMEBOY_PAGE_SIZE), DMA_TRANSFER_LENGTH);
+    else memcpy(oam, gameboy_get_page(gb, GAMEBOY_WRAM_PAGE + (source - 0xE000) / GAMEBOY_PAGE_SIZE), DMA_TRANSFER_LENGTH);
+}
+
 void dma_cycle(GameBoy * const gb) {
     if (gb->dma->queue != -1) {
         if (!gb->dma->delay) {
@@ -20,22 +42,19 @@ void dma_cycle(GameBoy * const gb) {
             gb->dma->queue = -1;
             gb->dma->current = 0x00;
             gb->dma->active = true;
+            dma_transfer(gb);
+            gameboy_map_memory(gb);
         }
         else gb->dma->delay = false;
     }
 
-    if (gb->dma->active && gb->dma->current < 0xA0) {
-        uint8_t value;
-        uint16_t address = (gb->dma->dma << 8) | gb->dma->current;
-        if (address <= 0x7FFF) value = cartridge_read_rom(gb, address);
-        else if (address <= 0x9FFF) value = ppu_read_vram(gb, address - 0x8000);
-        else if (address <= 0xBFFF) value = cartridge_read_ram(gb, address - 0xA000);
-        else if (address <= 0xDFFF) value = gb->processor->ram[address - 0xC000];
-        else value = gb->processor->ram[address - 0xE000];
-        gameboy_write(gb, GAMEBOY_OAM_ADDRESS | gb->dma->current, value);
-        gb->dma->current++;
+    if (gb->dma->active) {
+        if (gb->dma->current < DMA_TRANSFER_LENGTH) gb->dma->current++;
+        else {
+            gb->dma->active = false;
+            gameboy_map_memory(gb);
+        }
     }
-    else gb->dma->active = false;
 }
 
 void dma_write_dma(GameBoy * const gb, uint8_t value) {
@@ -43,22 +62,25 @@ void dma_write_dma(GameBoy * const gb, uint8_t value) {
     gb->dma->delay = true;
 }
 
-uint8_t dma_read_external_rom(GameBoy const * const gb, uint16_t address) {
-    if (gb->dma->active) return cartridge_read_rom(gb, (gb->dma->dma << 8) | gb->dma->current);
-    else return cartridge_read_rom(gb, address);
-}
-
-uint8_t dma_read_external_ram(GameBoy const * const gb, uint16_t address) {
-    if (gb->dma->active) return cartridge_read_ram(gb, (gb->dma->dma << 8) | gb->dma->current);
-    else return cartridge_read_ram(gb, address);
+// Reads on the bus the DMA is using see the byte currently being transferred
+static uint8_t dma_read_conflict(GameBoy * const gb, uint16_t address) {
+    uint8_t current = gb->dma->current < DMA_TRANSFER_LENGTH ? gb->dma->current : DMA_TRANSFER_LENGTH - 1;
+    return gb->memory->oam[current];
 }
 
-uint8_t dma_read_oam(GameBoy const * const gb, uint16_t address) {
-    if (gb->dma->active) return 0xFF;
-    else return ppu_read_oam(gb, address);
+static uint8_t dma_read_oam(GameBoy * const gb, uint16_t address) {
+    if (address <= 0xFE9F) return 0xFF;
+    else return 0x00;
 }
 
-uint8_t dma_read_vram(GameBoy const * const gb, uint16_t address) {
-    if (gb->dma->active) return ppu_read_vram(gb, (gb->dma->dma << 8) | gb->dma->current);
-    else return ppu_read_vram(gb, address);
+void dma_map_memory(GameBoy * const gb) {
+    MemoryMap * const map = gb->memory_map;
+    if (gb->dma->dma >= 0x80 && gb->dma->dma <= 0x9F) {
+        memory_map_map_read(map, 0x80, 0x9F, NULL, dma_read_conflict);
+    }
+    else {
+        memory_map_map_read(map, 0x00, 0x7F, NULL, dma_read_conflict);
+        memory_map_map_read(map, 0xA0, 0xFD, NULL, dma_read_conflict);
+    }
+    memory_map_map_read(map, 0xFE, 0xFE, NULL, dma_read_oam);
 }
@@ -4,6 +4,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#define DMA_TRANSFER_LENGTH (0xA0)
+
 typedef struct GameBoy GameBoy;
 
 typedef struct DMA {
@@ -20,12 +22,6 @@ void dma_cycle(GameBoy * const gb);
 
 void dma_write_dma(GameBoy * const gb, uint8_t value);
 
-uint8_t dma_read_external_rom(GameBoy const * const gb, uint16_t address);
-
-uint8_t dma_read_external_ram(GameBoy const * const gb, uint16_t address);
-
-uint8_t dma_read_oam(GameBoy const * const gb, uint16_t address);
-
-uint8_t dma_read_vram(GameBoy const * const gb, uint16_t address);
+void dma_map_memory(GameBoy * const gb);
 
 #endif /* !TRTLE_DMA_H */
@@ -1,12 +1,15 @@
 #include "gameboy.h"
 
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cartridge.h"
 #include "dma.h"
 #include "interrupt_controller.h"
 #include "joypad.h"
 #include "logger.h"
+#include "memory_map.h"
 #include "ppu.h"
 #include "processor.h"
 #include "serial.h"
@@ -34,21 +37,170 @@ static uint8_t dmg_boot[] = {
     0xF5, 0x06, 0x19, 0x78, 0x86, 0x23, 0x05, 0x20, 0xFB, 0x86, 0x20, 0xFE, 0x3E, 0x01, 0xE0, 0x50
 };
 
+typedef struct GameBoyInputEdge {
+    uint64_t cycle;
+    uint8_t mask;
+} GameBoyInputEdge;
+
+// Hot state touched on nearly every cycle sits right behind the handle, bulk memory and the map live in shared blocks
+typedef struct GameBoyArena {
+    GameBoy gb;
+    Processor processor;
+    InterruptController interrupt_controller;
+    Timer timer;
+    PPU ppu;
+    DMA dma;
+    Joypad joypad;
+    Serial serial;
+    SoundController sound_controller;
+    GameBoyMemory memory;
+
+    // Bookkeeping that is never touched while running sits behind the bulk state
+    uint64_t snapshot_id; // The snapshot whose written pages are being tracked, zero for none
+    GameBoySnapshot * baseline;
+    GameBoyInputCallback input_callback;
+    void * input_userdata;
+    GameBoyInputEdge input_queue[GAMEBOY_INPUT_QUEUE_SIZE]; // Sorted by cycle, edges at the same cycle keep their order
+    uint8_t input_queue_count;
+    bool input_queued; // Input was queued since the last clear, so runs leave the joypad to the queue
+    uint16_t breakpoints[GAMEBOY_MAX_BREAKPOINTS];
+    uint8_t breakpoint_count;
+    GameBoySerialSource serial_source;
+    void * serial_source_userdata;
+    GameBoySerialSink serial_sink;
+    void * serial_sink_userdata;
+    uint16_t serial_capture_size;
+    uint8_t serial_capture[GAMEBOY_SERIAL_CAPTURE_SIZE];
+    GameBoy * link;
+    int64_t link_offset; // The linked instance's cycles less this one's at the same moment
+} GameBoyArena;
+
+// Offsets into a saved state, after its header: the registers, OAM and HRAM, every memory page, then the cartridge
+#define GAMEBOY_STATE_OFFSET    (offsetof(GameBoyArena, gb) + offsetof(GameBoy, cycles))
+#define GAMEBOY_STATE_HOT_SIZE  (offsetof(GameBoyArena, sound_controller) + sizeof(SoundController) - GAMEBOY_STATE_OFFSET)
+#define GAMEBOY_STATE_OAM       (GAMEBOY_STATE_HOT_SIZE)
+#define GAMEBOY_STATE_OAM_SIZE  (GAMEBOY_OAM_SIZE + GAMEBOY_HRAM_SIZE)
+#define GAMEBOY_STATE_PAGES     (GAMEBOY_STATE_OAM + GAMEBOY_STATE_OAM_SIZE)
+#define GAMEBOY_STATE_SIZE      (GAMEBOY_STATE_PAGES + GAMEBOY_PAGE_COUNT * GAMEBOY_PAGE_SIZE)
+
+#define GAMEBOY_CARTRIDGE_STATE_SIZE (offsetof(Cartridge, ram_dirty) - offsetof(Cartridge, romb0))
+
+#define GAMEBOY_ALL_PAGES (~0ull >> (64 - GAMEBOY_PAGE_COUNT))
+
+_Static_assert(offsetof(GameBoyArena, joypad) <= 3 * 64, "Hot state no longer fits in the first cache lines");
+_Static_assert(offsetof(GameBoyMemory, hram) == offsetof(GameBoyMemory, oam) + GAMEBOY_OAM_SIZE, "OAM and HRAM are saved as one block");
+
+// The handle heads its arena, so the bookkeeping behind it is reached from the handle alone
+static inline GameBoyArena * gameboy_arena(GameBoy * const gb) {
+    return (GameBoyArena *)gb;
+}
+
+#define GAMEBOY_ARENA_SIZE ((sizeof(GameBoyArena) + GAMEBOY_ARENA_ALIGNMENT - 1) & ~(size_t)(GAMEBOY_ARENA_ALIGNMENT - 1))
+
+static GameBoyArena * gameboy_arena_alloc(void) {
+#if defined(_WIN32)
+    return _aligned_malloc(GAMEBOY_ARENA_SIZE, GAMEBOY_ARENA_ALIGNMENT);
+#else
+    return aligned_alloc(GAMEBOY_ARENA_ALIGNMENT, GAMEBOY_ARENA_SIZE);
+#endif
+}
+
+static void gameboy_arena_free(GameBoyArena * arena) {
+#if defined(_WIN32)
+    _aligned_free(arena);
+#else
+    free(arena);
+#endif
+}
+
+static void gameboy_arena_link(GameBoyArena * arena) {
+    GameBoy * gb = &arena->gb;
+    gb->dma = &arena->dma;
+    gb->interrupt_controller = &arena->interrupt_controller;
+    gb->joypad = &arena->joypad;
+    gb->memory = &arena->memory;
+    gb->ppu = &arena->ppu;
+    gb->processor = &arena->processor;
+    gb->serial = &arena->serial;
+    gb->sound_controller = &arena->sound_controller;
+    gb->timer = &arena->timer;
+}
+
+static void gameboy_page_release(GameBoyPage * page) {
+    if (page != NULL && atomic_fetch_sub_explicit(&page->references, 1, memory_order_acq_rel) == 1) free(page);
+}
+
+static void gameboy_page_table_release(GameBoyPageTable * table) {
+    if (table == NULL || atomic_fetch_sub_explicit(&table->references, 1, memory_order_acq_rel) != 1) return;
+    for (size_t page = 0; page < GAMEBOY_PAGE_COUNT; page++) gameboy_page_release(table->pages[page]);
+    free(table);
+}
+
+static GameBoyPageTable * gameboy_page_table_create(void) {
+    GameBoyPageTable * table = calloc(1, sizeof(GameBoyPageTable));
+    if (table == NULL) return NULL;
+    atomic_init(&table->references, 1);
+
+    bool allocated = true;
+    for (size_t page = 0; page < GAMEBOY_PAGE_COUNT; page++) {
+        GameBoyPage * frame = calloc(1, sizeof(GameBoyPage));
+        if (frame != NULL) atomic_init(&frame->references, 1);
+        table->pages[page] = frame;
+        allocated &= frame != NULL;
+    }
+    if (!allocated) {
+        gameboy_page_table_release(table);
+        return NULL;
+    }
+    return table;
+}
+
+// The copy takes a reference on every page, which stay shared until written
+static GameBoyPageTable * gameboy_page_table_clone(GameBoyPageTable const * const table) {
+    GameBoyPageTable * clone = malloc(sizeof(GameBoyPageTable));
+    if (clone == NULL) return NULL;
+    atomic_init(&clone->references, 1);
+
+    for (size_t page = 0; page < GAMEBOY_PAGE_COUNT; page++) {
+        clone->pages[page] = table->pages[page];
+        atomic_fetch_add_explicit(&clone->pages[page]->references, 1, memory_order_relaxed);
+    }
+    return clone;
+}
+
+static void gameboy_release_memory(GameBoy * const gb) {
+    gameboy_page_table_release(gb->memory->table);
+    memory_map_release(gb->memory_map);
+    ppu_cache_release(gb->ppu_cache);
+}
+
+static bool gameboy_was_written(GameBoy const * const gb, uint8_t page) {
+    return gb->memory->written[page / 64] & (1ull << (page % 64));
+}
+
+static void gameboy_clear_written(GameBoy * const gb) {
+    memset(gb->memory->written, 0, sizeof(gb->memory->written));
+}
+
 GameBoy * gameboy_create() {
-    GameBoy * gb = calloc(1, sizeof(GameBoy));
+    GameBoyArena * arena = gameboy_arena_alloc();
+    if (arena == NULL) return NULL;
+    memset(arena, 0, sizeof(GameBoyArena));
+    gameboy_arena_link(arena);
 
+    GameBoy * gb = &arena->gb;
     gb->cartridge = NULL;
-    gb->dma = calloc(1, sizeof(DMA));
-    gb->interrupt_controller = calloc(1, sizeof(InterruptController));
-    gb->joypad = calloc(1, sizeof(Joypad));
-    gb->ppu = calloc(1, sizeof(PPU));
-    gb->processor = calloc(1, sizeof(Processor));
-    gb->serial = calloc(1, sizeof(Serial));
-    gb->sound_controller = calloc(1, sizeof(SoundController));
-    gb->timer = calloc(1, sizeof(Timer));
-    gb->boot = false;
+    gb->memory->table = gameboy_page_table_create();
+    gb->memory_map = memory_map_create();
+    gb->ppu_cache = ppu_cache_create();
+    if (gb->memory->table == NULL || gb->memory_map == NULL || gb->ppu_cache == NULL) {
+        gameboy_release_memory(gb);
+        gameboy_arena_free(arena);
+        return NULL;
+    }
 
     bool skip_bootrom = true;
+    gb->boot = skip_bootrom;
     dma_initialize(gb->dma, skip_bootrom);
     interrupt_controller_initialize(gb->interrupt_controller, skip_bootrom);
     joypad_initialize(gb->joypad, skip_bootrom);
@@ -58,26 +210,25 @@ GameBoy * gameboy_create() {
     sound_controller_initialize(gb->sound_controller, skip_bootrom);
     timer_initialize(gb->timer, skip_bootrom);
 
+    gameboy_map_memory(gb);
+
     return gb;
 }
 
 void gameboy_delete(GameBoy * const gb) { 
     if (gb != NULL) {
-        free(gb->dma);
-        free(gb->interrupt_controller);
-        free(gb->joypad);
-        free(gb->ppu);
-        free(gb->processor);
-        free(gb->serial);
-        free(gb->sound_controller);
-        free(gb->timer);
-
-        free(gb);
+        gameboy_unlink(gb);
+        cartridge_flush(gb);
+        cartridge_delete(gb->cartridge);
+        gameboy_snapshot_delete(gameboy_arena(gb)->baseline);
+        gameboy_release_memory(gb);
+        gameboy_arena_free((GameBoyArena *)gb);
     }
 };
 
 void gameboy_reset(GameBoy * gb) {
     bool skip_bootrom = true;
+    gb->boot = skip_bootrom;
     dma_initialize(gb->dma, skip_bootrom);
     interrupt_controller_initialize(gb->interrupt_controller, skip_bootrom);
     joypad_initialize(gb->joypad, skip_bootrom);
@@ -86,10 +237,123 @@ void gameboy_reset(GameBoy * gb) {
     serial_initialize(gb->serial, skip_bootrom);
     sound_controller_initialize(gb->sound_controller, skip_bootrom);
     timer_initialize(gb->timer, skip_bootrom);
+
+    gameboy_map_memory(gb);
 }
 
-void gameboy_set_cartridge(GameBoy * const gb, Cartridge * const cart) {
+bool gameboy_set_cartridge(GameBoy * const gb, CartridgeImage * const image) {
+    Cartridge * cart = NULL;
+    if (image != NULL && cartridge_create(&cart, image) != CARTRIDGE_ERROR_NONE) return false;
+
+    cartridge_flush(gb);
+    cartridge_delete(gb->cartridge);
     gb->cartridge = cart;
+    gameboy_invalidate_snapshot(gb);
+    gameboy_map_cartridge(gb);
+    return true;
+}
+
+static void gameboy_write_wram(GameBoy * const gb, uint16_t address, uint8_t value);
+
+GameBoy * gameboy_fork(GameBoy * const gb) {
+    if (gb == NULL) {
+        TRTLE_LOG_ERR("Attempted to pass a null argument into gameboy_fork");
+        return NULL;
+    }
+
+    GameBoyArena * arena = gameboy_arena_alloc();
+    if (arena == NULL) return NULL;
+
+    // A shared map may only write through handlers, so the parent gives up its direct WRAM writes first
+    if (gb->memory->shared != GAMEBOY_ALL_PAGES) {
+        MemoryMap * map = gameboy_own_memory_map(gb);
+        if (map == NULL) {
+            gameboy_arena_free(arena);
+            return NULL;
+        }
+        memory_map_map_write(map, 0xC0, 0xFD, NULL, gameboy_write_wram);
+        gb->memory->shared = GAMEBOY_ALL_PAGES;
+    }
+
+    // Nothing in the map points into the arena itself, so a copy stays valid for the fork
+    memcpy(arena, gb, sizeof(GameBoyArena));
+    gameboy_arena_link(arena);
+    GameBoy * fork = &arena->gb;
+    if (cartridge_fork(&fork->cartridge, gb->cartridge) != CARTRIDGE_ERROR_NONE) {
+        gameboy_arena_free(arena);
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&gb->memory->table->references, 1, memory_order_relaxed);
+    fork->memory_map = memory_map_retain(gb->memory_map);
+    fork->ppu_cache = ppu_cache_retain(gb->ppu_cache);
+    arena->snapshot_id = 0;
+    arena->baseline = NULL;
+    arena->input_callback = NULL;
+    arena->input_userdata = NULL;
+    arena->serial_source = NULL;
+    arena->serial_source_userdata = NULL;
+    arena->serial_sink = NULL;
+    arena->serial_sink_userdata = NULL;
+    arena->link = NULL;
+    fork->input_pending = false;
+
+    if (fork->cartridge != NULL && fork->cartridge->ram != gb->cartridge->ram) gameboy_map_cartridge(fork);
+
+    return fork;
+}
+
+bool gameboy_adopt(GameBoy * const gb, GameBoy * fork) {
+    if (gb == NULL || fork == NULL) {
+        TRTLE_LOG_ERR("Attempted to pass a null argument into gameboy_adopt");
+        return false;
+    }
+    if ((gb->cartridge == NULL) != (fork->cartridge == NULL) || (gb->cartridge != NULL && gb->cartridge->image != fork->cartridge->image)) {
+        TRTLE_LOG_ERR("Attempted to adopt an instance running another cartridge");
+        return false;
+    }
+    if (gb->cartridge != NULL && !cartridge_adopt(gb, fork->cartridge)) return false;
+
+    GameBoyArena * const arena = gameboy_arena(gb);
+    GameBoyArena * const branch = gameboy_arena(fork);
+    memcpy((uint8_t *)gb + GAMEBOY_STATE_OFFSET, (uint8_t *)fork + GAMEBOY_STATE_OFFSET, GAMEBOY_STATE_HOT_SIZE);
+    memcpy(gb->memory->oam, fork->memory->oam, GAMEBOY_STATE_OAM_SIZE);
+
+    // The fork's table already holds every page gb had when it was made, so the two trade tables, maps and caches
+    // and the old ones go with the fork. Written pages are merged so a tracked snapshot still syncs all of them.
+    GameBoyPageTable * table = gb->memory->table;
+    uint64_t shared = gb->memory->shared;
+    MemoryMap * map = gb->memory_map;
+    PPUCache * cache = gb->ppu_cache;
+    gb->memory->table = fork->memory->table;
+    gb->memory->shared = fork->memory->shared;
+    gb->memory_map = fork->memory_map;
+    gb->ppu_cache = fork->ppu_cache;
+    fork->memory->table = table;
+    fork->memory->shared = shared;
+    fork->memory_map = map;
+    fork->ppu_cache = cache;
+    for (size_t i = 0; i < sizeof(gb->memory->written) / sizeof(gb->memory->written[0]); i++) gb->memory->written[i] |= fork->memory->written[i];
+
+    memcpy(arena->input_queue, branch->input_queue, sizeof(arena->input_queue));
+    arena->input_queue_count = branch->input_queue_count;
+    memcpy(arena->serial_capture, branch->serial_capture, branch->serial_capture_size);
+    arena->serial_capture_size = branch->serial_capture_size;
+
+    gameboy_map_cartridge(gb);
+    gameboy_delete(fork);
+    return true;
+}
+
+// Applies every queued edge that is due, the last one wins
+static void gameboy_apply_input_queue(GameBoy * const gb) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    uint8_t due = 0;
+    while (due < arena->input_queue_count && arena->input_queue[due].cycle <= gb->cycles) due++;
+    if (due == 0) return;
+
+    joypad_set_buttons(gb, arena->input_queue[due - 1].mask);
+    arena->input_queue_count -= due;
+    memmove(arena->input_queue, arena->input_queue + due, arena->input_queue_count * sizeof(GameBoyInputEdge));
 }
 
 void gameboy_update(GameBoy * const gb, GameBoyInput input) {
@@ -98,22 +362,578 @@ void gameboy_update(GameBoy * const gb, GameBoyInput input) {
         return;
     }
 
-    joypad_update_p1(gb, input);
+    GameBoyArena * const arena = gameboy_arena(gb);
+    if (!arena->input_queued) joypad_update_p1(gb, input);
+    else if (arena->input_queue_count > 0) gameboy_apply_input_queue(gb);
+    serial_update(gb);
     processor_process_instruction(gb);
 }
 
-void gameboy_update_to_vblank(GameBoy* const gb, GameBoyInput input) {
+static bool gameboy_is_breakpoint(GameBoy const * const gb, uint16_t address) {
+    GameBoyArena const * const arena = (GameBoyArena const *)gb;
+    for (uint8_t i = 0; i < arena->breakpoint_count; i++) {
+        if (arena->breakpoints[i] == address) return true;
+    }
+    return false;
+}
+
+// Input is latched once for the whole run, the joypad only samples it when P1 is read.
+// Queued input and serial transfers end the deadline early when they are due, so without either the loop only
+// ever compares cycles against the end.
+static uint32_t gameboy_run(GameBoy * const gb, GameBoyInput input, uint64_t cycles, uint32_t events) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    if (!arena->input_queued) joypad_update_p1(gb, input);
+    gb->input_pending = arena->input_callback != NULL && !arena->input_queued;
+    gb->run_events = events;
+    gb->run_exit = 0;
+
+    uint64_t const end = cycles < UINT64_MAX - gb->cycles ? gb->cycles + cycles : UINT64_MAX;
+    bool const breakpoints = (events & GAMEBOY_EVENT_BREAKPOINT) && arena->breakpoint_count > 0;
+    bool first = true;
+    bool halted = false;
+
+    do {
+        if (arena->input_queue_count > 0) gameboy_apply_input_queue(gb);
+        serial_update(gb);
+        gb->run_deadline = end;
+        if (arena->input_queue_count > 0 && arena->input_queue[0].cycle < gb->run_deadline) gb->run_deadline = arena->input_queue[0].cycle;
+        if (gb->serial->transfer_end < gb->run_deadline) gb->run_deadline = gb->serial->transfer_end;
+        if (gb->run_exit != 0) break;
+
+        // Only runs that stop on breakpoints pay for checking the program counter, never on the first instruction
+        // so a run can resume from the breakpoint it stopped on. A halted processor stays on one address, so it
+        // only stops there once.
+        if (breakpoints) {
+            while (gb->cycles < gb->run_deadline) {
+                if (!first && !(halted && gb->processor->halt_mode) && gameboy_is_breakpoint(gb, gb->processor->pc)) {
+                    gb->run_exit |= GAMEBOY_EVENT_BREAKPOINT;
+                    break;
+                }
+                first = false;
+                halted = gb->processor->halt_mode;
+                processor_process_instruction(gb);
+            }
+        }
+        else {
+            while (gb->cycles < gb->run_deadline) processor_process_instruction(gb);
+        }
+    } while (gb->run_exit == 0 && gb->cycles < end);
+
+    if (arena->input_queue_count > 0) gameboy_apply_input_queue(gb);
+    serial_update(gb);
+    gb->run_events = 0;
+    gb->input_pending = false;
+    return gb->run_exit;
+}
+
+uint64_t gameboy_run_cycles(GameBoy * const gb, GameBoyInput input, uint64_t cycles) {
     if (gb == NULL) {
-        TRTLE_LOG_ERR("Attempted to pass a null argument into gameboy_update_to_vblank");
+        TRTLE_LOG_ERR("Attempted to pass a null argument into gameboy_run_cycles");
+        return 0;
+    }
+
+    uint64_t start = gb->cycles;
+    gameboy_run(gb, input, cycles, 0);
+    return gb->cycles - start;
+}
+
+uint32_t gameboy_run_until(GameBoy * const gb, GameBoyInput input, uint32_t events, uint64_t cycles) {
+    if (gb == NULL) {
+        TRTLE_LOG_ERR("Attempted to pass a null argument into gameboy_run_until");
+        return 0;
+    }
+
+    return gameboy_run(gb, input, cycles, events);
+}
+
+bool gameboy_run_frame(GameBoy * const gb, GameBoyInput input) {
+    if (gb == NULL) {
+        TRTLE_LOG_ERR("Attempted to pass a null argument into gameboy_run_frame");
+        return false;
+    }
+
+    // With the LCD on vblank comes exactly a frame after the last one, so the budget only ends frames without it
+    bool vblank = gameboy_run(gb, input, GAMEBOY_FRAME_CYCLES, GAMEBOY_EVENT_VBLANK) & GAMEBOY_EVENT_VBLANK;
+    cartridge_end_frame(gb);
+    return vblank;
+}
+
+void gameboy_update_to_vblank(GameBoy * const gb, GameBoyInput input) {
+    gameboy_run_frame(gb, input);
+}
+
+void gameboy_set_input_callback(GameBoy * const gb, GameBoyInputCallback callback, void * userdata) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    arena->input_callback = callback;
+    arena->input_userdata = userdata;
+    gb->input_pending = false;
+}
+
+void gameboy_poll_input(GameBoy * const gb) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    gb->input_pending = false;
+    if (arena->input_callback != NULL) joypad_update_p1(gb, arena->input_callback(arena->input_userdata));
+}
+
+bool gameboy_queue_input(GameBoy * const gb, uint64_t cycle, uint8_t mask) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    if (arena->input_queue_count == GAMEBOY_INPUT_QUEUE_SIZE) return false;
+
+    uint8_t index = arena->input_queue_count;
+    while (index > 0 && arena->input_queue[index - 1].cycle > cycle) {
+        arena->input_queue[index] = arena->input_queue[index - 1];
+        index--;
+    }
+    arena->input_queue[index] = (GameBoyInputEdge){ cycle, mask };
+    arena->input_queue_count++;
+    arena->input_queued = true;
+    return true;
+}
+
+void gameboy_clear_input_queue(GameBoy * const gb) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    arena->input_queue_count = 0;
+    arena->input_queued = false;
+}
+
+void gameboy_set_serial_source(GameBoy * const gb, GameBoySerialSource source, void * userdata) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    arena->serial_source = source;
+    arena->serial_source_userdata = userdata;
+}
+
+void gameboy_set_serial_sink(GameBoy * const gb, GameBoySerialSink sink, void * userdata) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    arena->serial_sink = sink;
+    arena->serial_sink_userdata = userdata;
+}
+
+bool gameboy_link(GameBoy * const a, GameBoy * const b) {
+    if (a == NULL || b == NULL || a == b) {
+        TRTLE_LOG_ERR("Attempted to link an instance to nothing or to itself");
+        return false;
+    }
+
+    gameboy_unlink(a);
+    gameboy_unlink(b);
+    gameboy_arena(a)->link = b;
+    gameboy_arena(b)->link = a;
+    gameboy_arena(a)->link_offset = (int64_t)(b->cycles - a->cycles);
+    gameboy_arena(b)->link_offset = (int64_t)(a->cycles - b->cycles);
+    return true;
+}
+
+void gameboy_unlink(GameBoy * const gb) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    if (arena->link == NULL) return;
+    gameboy_arena(arena->link)->link = NULL;
+    arena->link = NULL;
+}
+
+GameBoy * gameboy_get_link(GameBoy * const gb) {
+    return gameboy_arena(gb)->link;
+}
+
+// A transfer started during a slice completes at least seven bit periods later, so a slice shorter than that, with
+// room for an instruction running over its end, never misses one
+#define GAMEBOY_LINK_SLICE (6 * SERIAL_BIT_CYCLES)
+
+static uint32_t gameboy_link_run_to(GameBoy * const gb, GameBoyInput input, uint64_t target, uint32_t events) {
+    return gb->cycles < target ? gameboy_run(gb, input, target - gb->cycles, events) : 0;
+}
+
+bool gameboy_link_run_frame(GameBoy * const gb, GameBoyInput input, GameBoyInput link_input) {
+    if (gb == NULL || gameboy_arena(gb)->link == NULL) {
+        TRTLE_LOG_ERR("Attempted to pass a null or unlinked instance into gameboy_link_run_frame");
+        return false;
+    }
+
+    GameBoyArena * const arena = gameboy_arena(gb);
+    GameBoy * const peer = arena->link;
+
+    // Loading a state into one side breaks the time the two were linked at, so the other is brought back in line
+    uint64_t peer_now = gb->cycles + arena->link_offset;
+    if (peer->cycles > peer_now + GAMEBOY_FRAME_CYCLES || peer->cycles + GAMEBOY_FRAME_CYCLES < peer_now) {
+        arena->link_offset = (int64_t)(peer->cycles - gb->cycles);
+        gameboy_arena(peer)->link_offset = -arena->link_offset;
+    }
+
+    uint64_t const end = gb->cycles + GAMEBOY_FRAME_CYCLES;
+    bool vblank = false;
+    while (!vblank && gb->cycles < end) {
+        uint64_t target = end - gb->cycles < GAMEBOY_LINK_SLICE ? end : gb->cycles + GAMEBOY_LINK_SLICE;
+        uint64_t peer_end = peer->serial->transfer_end - arena->link_offset;
+        if (gb->serial->transfer_end > gb->cycles && gb->serial->transfer_end < target) target = gb->serial->transfer_end;
+        if (peer->serial->transfer_end != UINT64_MAX && peer_end > gb->cycles && peer_end < target) target = peer_end;
+
+        // The side clocking a transfer that completes on this slice runs last, so the other is already there to answer
+        if (gb->serial->transfer_end == target) {
+            gameboy_link_run_to(peer, link_input, target + arena->link_offset, 0);
+            vblank = gameboy_link_run_to(gb, input, target, GAMEBOY_EVENT_VBLANK);
+        }
+        else {
+            vblank = gameboy_link_run_to(gb, input, target, GAMEBOY_EVENT_VBLANK);
+            gameboy_link_run_to(peer, link_input, gb->cycles + arena->link_offset, 0);
+        }
+    }
+
+    cartridge_end_frame(gb);
+    cartridge_end_frame(peer);
+    return vblank;
+}
+
+int gameboy_serial_receive(GameBoy * const gb) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    return arena->serial_source != NULL ? arena->serial_source(arena->serial_source_userdata) : -1;
+}
+
+void gameboy_serial_send(GameBoy * const gb, uint8_t byte) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    if (arena->serial_capture_size == GAMEBOY_SERIAL_CAPTURE_SIZE) {
+        arena->serial_capture_size = GAMEBOY_SERIAL_CAPTURE_SIZE / 2;
+        memmove(arena->serial_capture, arena->serial_capture + GAMEBOY_SERIAL_CAPTURE_SIZE / 2, GAMEBOY_SERIAL_CAPTURE_SIZE / 2);
+    }
+    arena->serial_capture[arena->serial_capture_size++] = byte;
+    if (arena->serial_sink != NULL) arena->serial_sink(arena->serial_sink_userdata, byte);
+}
+
+uint8_t const * gameboy_get_serial_capture(GameBoy * const gb, size_t * size) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    *size = arena->serial_capture_size;
+    return arena->serial_capture;
+}
+
+void gameboy_clear_serial_capture(GameBoy * const gb) {
+    gameboy_arena(gb)->serial_capture_size = 0;
+}
+
+bool gameboy_set_breakpoint(GameBoy * const gb, uint16_t address) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    if (gameboy_is_breakpoint(gb, address)) return true;
+    if (arena->breakpoint_count == GAMEBOY_MAX_BREAKPOINTS) return false;
+
+    arena->breakpoints[arena->breakpoint_count++] = address;
+    return true;
+}
+
+void gameboy_clear_breakpoint(GameBoy * const gb, uint16_t address) {
+    GameBoyArena * const arena = gameboy_arena(gb);
+    for (uint8_t i = 0; i < arena->breakpoint_count; i++) {
+        if (arena->breakpoints[i] != address) continue;
+        arena->breakpoints[i] = arena->breakpoints[--arena->breakpoint_count];
         return;
     }
+}
+
+#define GAMEBOY_STATE_MAGIC      (0x4C545254) // "TRTL"
+#define GAMEBOY_STATE_MAX_BLOCKS (GAMEBOY_PAGE_COUNT + 4)
+
+typedef struct GameBoyStateHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+} GameBoyStateHeader;
+
+typedef struct GameBoyStateBlock {
+    void * data;
+    size_t size;
+} GameBoyStateBlock;
+
+// The state is these blocks back to back: the registers, OAM and HRAM, the memory pages, then the cartridge
+static size_t gameboy_get_state_blocks(GameBoy const * const gb, GameBoyStateBlock blocks[GAMEBOY_STATE_MAX_BLOCKS]) {
+    size_t count = 0;
+    blocks[count++] = (GameBoyStateBlock){ (uint8_t *)gb + GAMEBOY_STATE_OFFSET, GAMEBOY_STATE_HOT_SIZE };
+    blocks[count++] = (GameBoyStateBlock){ gb->memory->oam, GAMEBOY_STATE_OAM_SIZE };
+    for (size_t page = 0; page < GAMEBOY_PAGE_COUNT; page++) {
+        blocks[count++] = (GameBoyStateBlock){ (uint8_t *)gameboy_get_page(gb, page), GAMEBOY_PAGE_SIZE };
+    }
+    if (gb->cartridge != NULL) {
+        Cartridge * const cart = gb->cartridge;
+        blocks[count++] = (GameBoyStateBlock){ &cart->romb0, GAMEBOY_CARTRIDGE_STATE_SIZE };
+        if (cart->ram_size > 0) blocks[count++] = (GameBoyStateBlock){ cart->ram, cart->ram_size };
+    }
+    return count;
+}
+
+size_t gameboy_get_state_size(GameBoy const * const gb) {
+    GameBoyStateBlock blocks[GAMEBOY_STATE_MAX_BLOCKS];
+    size_t count = gameboy_get_state_blocks(gb, blocks);
+
+    size_t size = sizeof(GameBoyStateHeader);
+    for (size_t i = 0; i < count; i++) size += blocks[i].size;
+    return size;
+}
+
+bool gameboy_save_state(GameBoy const * const gb, void * data, size_t size) {
+    if (gb == NULL || data == NULL) {
+        TRTLE_LOG_ERR("Null argument received while saving state");
+        return false;
+    }
+
+    size_t state_size = gameboy_get_state_size(gb);
+    if (size < state_size) return false;
+
+    GameBoyStateHeader header = { GAMEBOY_STATE_MAGIC, GAMEBOY_STATE_VERSION, state_size };
+    uint8_t * out = data;
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
 
-    while (ppu_get_mode(gb) == GRAPHICS_MODE_VBLANK) {
-        gameboy_update(gb, input);
+    GameBoyStateBlock blocks[GAMEBOY_STATE_MAX_BLOCKS];
+    size_t count = gameboy_get_state_blocks(gb, blocks);
+    for (size_t i = 0; i < count; i++) {
+        memcpy(out, blocks[i].data, blocks[i].size);
+        out += blocks[i].size;
     }
-    while (ppu_get_mode(gb) != GRAPHICS_MODE_VBLANK) {
-        gameboy_update(gb, input);
+    return true;
+}
+
+bool gameboy_load_state(GameBoy * const gb, void const * data, size_t size) {
+    if (gb == NULL || data == NULL) {
+        TRTLE_LOG_ERR("Null argument received while loading state");
+        return false;
+    }
+
+    GameBoyStateHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != GAMEBOY_STATE_MAGIC || header.version != GAMEBOY_STATE_VERSION) {
+        TRTLE_LOG_WARN("Rejected a savestate with an unknown format (version %u)\n", header.version);
+        return false;
     }
+    if (header.size != gameboy_get_state_size(gb) || size < header.size) {
+        TRTLE_LOG_WARN("Rejected a savestate that does not match the inserted cartridge\n");
+        return false;
+    }
+
+    // Everything is about to be overwritten, so none of it may stay shared with a fork
+    for (size_t page = 0; page < GAMEBOY_PAGE_COUNT; page++) {
+        if (gameboy_own_page(gb, page) == NULL) return false;
+    }
+    if (!cartridge_own_ram(gb)) return false;
+
+    uint8_t const * in = (uint8_t const *)data + sizeof(header);
+    GameBoyStateBlock blocks[GAMEBOY_STATE_MAX_BLOCKS];
+    size_t count = gameboy_get_state_blocks(gb, blocks);
+    for (size_t i = 0; i < count; i++) {
+        memcpy(blocks[i].data, in, blocks[i].size);
+        in += blocks[i].size;
+    }
+
+    // All of ram may have changed under an attached save file
+    if (gb->cartridge != NULL) memset(gb->cartridge->ram_dirty, 0xFF, sizeof(gb->cartridge->ram_dirty));
+    gameboy_invalidate_snapshot(gb);
+
+    ppu_rebuild_tiles(gb);
+    cartridge_refresh(gb);
+    gameboy_map_memory(gb);
+    return true;
+}
+
+#define GAMEBOY_SUSPEND_MAGIC (0x50535254) // "TRSP"
+
+typedef struct GameBoySuspendHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t rom_hash;
+} GameBoySuspendHeader;
+
+bool gameboy_suspend(GameBoy const * const gb, const char * path) {
+    if (gb == NULL || path == NULL) {
+        TRTLE_LOG_ERR("Null argument received while suspending");
+        return false;
+    }
+    if (gb->cartridge == NULL) return false;
+
+    size_t state_size = gameboy_get_state_size(gb);
+    uint8_t * data = malloc(sizeof(GameBoySuspendHeader) + state_size);
+    if (data == NULL) return false;
+
+    GameBoySuspendHeader header = { GAMEBOY_SUSPEND_MAGIC, 0, cartridge_image_hash(gb->cartridge->image) };
+    memcpy(data, &header, sizeof(header));
+    bool suspended = gameboy_save_state(gb, data + sizeof(header), state_size)
+        && save_file_write_atomic(path, data, sizeof(header) + state_size);
+
+    free(data);
+    return suspended;
+}
+
+bool gameboy_resume(GameBoy * const gb, const char * path) {
+    if (gb == NULL || path == NULL) {
+        TRTLE_LOG_ERR("Null argument received while resuming");
+        return false;
+    }
+    if (gb->cartridge == NULL) return false;
+
+    size_t size = 0;
+    uint8_t const * data = save_file_map_readonly(path, &size);
+    if (data == NULL) return false;
+
+    GameBoySuspendHeader header = { 0 };
+    if (size >= sizeof(header)) memcpy(&header, data, sizeof(header));
+
+    bool resumed = false;
+    if (header.magic != GAMEBOY_SUSPEND_MAGIC) TRTLE_LOG_WARN("Ignored %s, it is not a suspend file\n", path);
+    else if (header.rom_hash != cartridge_image_hash(gb->cartridge->image)) {
+        TRTLE_LOG_WARN("Ignored %s, it was suspended on a different rom\n", path);
+    }
+    else resumed = gameboy_load_state(gb, data + sizeof(header), size - sizeof(header));
+
+    save_file_unmap(data, size);
+    return resumed;
+}
+
+struct GameBoySnapshot {
+    uint64_t id;
+    uint8_t * state; // Laid out exactly as gameboy_save_state writes it
+    size_t size;
+};
+
+static atomic_uint_fast64_t gameboy_snapshot_next_id = 1;
+
+GameBoySnapshot * gameboy_snapshot_create(void) {
+    GameBoySnapshot * snapshot = calloc(1, sizeof(GameBoySnapshot));
+    if (snapshot != NULL) snapshot->id = atomic_fetch_add_explicit(&gameboy_snapshot_next_id, 1, memory_order_relaxed);
+    return snapshot;
+}
+
+void gameboy_snapshot_delete(GameBoySnapshot * snapshot) {
+    if (snapshot != NULL) {
+        free(snapshot->state);
+        free(snapshot);
+    }
+}
+
+static void gameboy_snapshot_copy(uint8_t * live, uint8_t * saved, size_t size, bool restore) {
+    if (live == NULL) return;
+    if (restore) memcpy(live, saved, size);
+    else memcpy(saved, live, size);
+}
+
+static void gameboy_snapshot_copy_page(GameBoy * const gb, size_t page, uint8_t * saved, bool restore) {
+    uint8_t * live = restore ? gameboy_own_page(gb, page) : (uint8_t *)gameboy_get_page(gb, page);
+    gameboy_snapshot_copy(live, saved + GAMEBOY_STATE_PAGES + page * GAMEBOY_PAGE_SIZE, GAMEBOY_PAGE_SIZE, restore);
+}
+
+// Copies the small always-changing state in full and bulk memory only where pages were written
+static void gameboy_snapshot_sync(GameBoy * const gb, GameBoySnapshot * const snapshot, bool restore) {
+    uint8_t * saved = snapshot->state + sizeof(GameBoyStateHeader);
+
+    gameboy_snapshot_copy((uint8_t *)gb + GAMEBOY_STATE_OFFSET, saved, GAMEBOY_STATE_HOT_SIZE, restore);
+    gameboy_snapshot_copy(gb->memory->oam, saved + GAMEBOY_STATE_OAM, GAMEBOY_STATE_OAM_SIZE, restore);
+    for (uint8_t page = 0; page < GAMEBOY_VRAM_SIZE / GAMEBOY_PAGE_SIZE; page++) {
+        if (!gameboy_was_written(gb, 0x80 + page)) continue;
+        gameboy_snapshot_copy_page(gb, GAMEBOY_VRAM_PAGE + page, saved, restore);
+        if (restore) ppu_rebuild_tile_range(gb, page * GAMEBOY_PAGE_SIZE, GAMEBOY_PAGE_SIZE);
+    }
+    for (uint8_t page = 0; page < GAMEBOY_WRAM_SIZE / GAMEBOY_PAGE_SIZE; page++) {
+        bool echo = page < 0x1E && gameboy_was_written(gb, 0xE0 + page);
+        if (!echo && !gameboy_was_written(gb, 0xC0 + page)) continue;
+        gameboy_snapshot_copy_page(gb, GAMEBOY_WRAM_PAGE + page, saved, restore);
+    }
+    gameboy_clear_written(gb);
+
+    Cartridge * const cart = gb->cartridge;
+    if (cart == NULL) return;
+
+    saved += GAMEBOY_STATE_SIZE;
+    gameboy_snapshot_copy(&cart->romb0, saved, GAMEBOY_CARTRIDGE_STATE_SIZE, restore);
+
+    saved += GAMEBOY_CARTRIDGE_STATE_SIZE;
+    if (restore && !cartridge_own_ram(gb)) return;
+    size_t pages = (cart->ram_size + SAVE_FILE_PAGE_SIZE - 1) >> SAVE_FILE_PAGE_SHIFT;
+    for (size_t page = 0; page < pages; page++) {
+        if (!(cart->ram_written[page / 64] & (1ull << (page % 64)))) continue;
+        size_t offset = page << SAVE_FILE_PAGE_SHIFT;
+        size_t size = cart->ram_size - offset < SAVE_FILE_PAGE_SIZE ? cart->ram_size - offset : SAVE_FILE_PAGE_SIZE;
+        gameboy_snapshot_copy(cart->ram + offset, saved + offset, size, restore);
+    }
+    if (restore) {
+        for (size_t i = 0; i < SAVE_FILE_DIRTY_WORDS; i++) cart->ram_dirty[i] |= cart->ram_written[i];
+    }
+    memset(cart->ram_written, 0, sizeof(cart->ram_written));
+}
+
+void gameboy_invalidate_snapshot(GameBoy * const gb) {
+    gameboy_arena(gb)->snapshot_id = 0;
+}
+
+bool gameboy_snapshot_save(GameBoy * const gb, GameBoySnapshot * const snapshot) {
+    if (gb == NULL || snapshot == NULL) {
+        TRTLE_LOG_ERR("Null argument received while saving a snapshot");
+        return false;
+    }
+
+    size_t size = gameboy_get_state_size(gb);
+    if (gameboy_arena(gb)->snapshot_id == snapshot->id && snapshot->size == size) {
+        gameboy_snapshot_sync(gb, snapshot, false);
+        return true;
+    }
+
+    if (snapshot->size != size) {
+        uint8_t * state = realloc(snapshot->state, size);
+        if (state == NULL) return false;
+        snapshot->state = state;
+        snapshot->size = size;
+    }
+    gameboy_save_state(gb, snapshot->state, size);
+
+    gameboy_clear_written(gb);
+    if (gb->cartridge != NULL) memset(gb->cartridge->ram_written, 0, sizeof(gb->cartridge->ram_written));
+    gameboy_arena(gb)->snapshot_id = snapshot->id;
+    return true;
+}
+
+bool gameboy_snapshot_restore(GameBoy * const gb, GameBoySnapshot * const snapshot) {
+    if (gb == NULL || snapshot == NULL) {
+        TRTLE_LOG_ERR("Null argument received while restoring a snapshot");
+        return false;
+    }
+
+    if (gameboy_arena(gb)->snapshot_id != snapshot->id) {
+        if (!gameboy_load_state(gb, snapshot->state, snapshot->size)) return false;
+
+        gameboy_clear_written(gb);
+        if (gb->cartridge != NULL) memset(gb->cartridge->ram_written, 0, sizeof(gb->cartridge->ram_written));
+        gameboy_arena(gb)->snapshot_id = snapshot->id;
+        return true;
+    }
+
+    // Pages remap themselves as they are taken over, so only the cartridge windows move unless a
+    // DMA or the boot rom holds windows on either side of the restore
+    bool remap = gb->dma->active || !gb->boot;
+    gameboy_snapshot_sync(gb, snapshot, true);
+    cartridge_refresh(gb);
+    if (remap || gb->dma->active || !gb->boot) gameboy_map_memory(gb);
+    return true;
+}
+
+void const * gameboy_snapshot_get_data(GameBoySnapshot const * const snapshot, size_t * size) {
+    if (size != NULL) *size = snapshot->size;
+    return snapshot->state;
+}
+
+bool gameboy_set_baseline(GameBoy * const gb) {
+    if (gb == NULL) {
+        TRTLE_LOG_ERR("Attempted to pass a null argument into gameboy_set_baseline");
+        return false;
+    }
+
+    GameBoyArena * const arena = gameboy_arena(gb);
+    if (arena->baseline == NULL) arena->baseline = gameboy_snapshot_create();
+    return arena->baseline != NULL && gameboy_snapshot_save(gb, arena->baseline);
+}
+
+bool gameboy_restore_baseline(GameBoy * const gb) {
+    if (gb == NULL) {
+        TRTLE_LOG_ERR("Attempted to pass a null argument into gameboy_restore_baseline");
+        return false;
+    }
+    if (gameboy_arena(gb)->baseline == NULL) {
+        TRTLE_LOG_WARN("Attempted to restore a baseline that was never set\n");
+        return false;
+    }
+
+    return gameboy_snapshot_restore(gb, gameboy_arena(gb)->baseline);
 }
 
 size_t gameboy_get_background_data(GameBoy const * const gb, uint32_t * data, size_t length) {
@@ -134,6 +954,14 @@ size_t gameboy_get_display_data(GameBoy const * const gb, uint32_t * data, size_
     return ppu_get_display_data(gb, data, length);
 }
 
+size_t gameboy_get_display_shades(GameBoy const * const gb, uint8_t * data, size_t length) {
+    if (gb == NULL || data == NULL) {
+        TRTLE_LOG_ERR("Null argument received while fetching display shades");
+        return 0;
+    }
+    return ppu_get_display_shades(gb, data, length);
+}
+
 size_t gameboy_get_tileset_data(GameBoy const * const gb, uint32_t * data, size_t length) {
     if (gb == NULL || data == NULL) {
         TRTLE_LOG_ERR("Null argument received while fetching tileset data");
@@ -144,22 +972,50 @@ size_t gameboy_get_tileset_data(GameBoy const * const gb, uint32_t * data, size_
 }
 
 void gameboy_cycle(GameBoy * const gb) { 
+    gb->cycles += 4;
     dma_cycle(gb);
     timer_cycle(gb);
     ppu_cycle(gb);
 }
 
-uint8_t gameboy_read(GameBoy * const gb, uint16_t address) {
-    if      (address <= 0x00FF && !gb->boot) return dmg_boot[address];
-    else if (address <= 0x7FFF) return dma_read_external_rom(gb, address);
-    else if (address <= 0x9FFF) return dma_read_vram(gb, address - 0x8000);
-    else if (address <= 0xBFFF) return dma_read_external_ram(gb, address);
-    else if (address <= 0xDFFF) return gb->processor->ram[address - 0xC000];
-    else if (address <= 0xFDFF) return gb->processor->ram[address - 0xE000];      // Read from ECHO
-    else if (address <= 0xFE9F) return dma_read_oam(gb, address - 0xFE00); // Read from OAM
-    else if (address <= 0xFEFF) return 0x00;
-    else if (address == 0xFF00) return joypad_read_p1(gb);
-    else if (address == 0xFF01) return gb->serial->sb;
+static uint8_t gameboy_read_open_bus(GameBoy * const gb, uint16_t address) {
+    return 0xFF;
+}
+
+static void gameboy_write_rom(GameBoy * const gb, uint16_t address, uint8_t value) {
+    cartridge_write_rom(gb, address, value);
+}
+
+static void gameboy_write_vram(GameBoy * const gb, uint16_t address, uint8_t value) {
+    ppu_write_vram(gb, address - 0x8000, value);
+}
+
+// Only reached for pages still shared with a fork, the rest are written directly through the map
+static void gameboy_write_wram(GameBoy * const gb, uint16_t address, uint8_t value) {
+    uint8_t * page = gameboy_own_page(gb, GAMEBOY_WRAM_PAGE + ((address - 0xC000) & (GAMEBOY_WRAM_SIZE - 1)) / GAMEBOY_PAGE_SIZE);
+    if (page != NULL) page[address % GAMEBOY_PAGE_SIZE] = value;
+}
+
+static uint8_t gameboy_read_external_ram(GameBoy * const gb, uint16_t address) {
+    return cartridge_read_ram(gb, address - 0xA000);
+}
+
+static void gameboy_write_external_ram(GameBoy * const gb, uint16_t address, uint8_t value) {
+    cartridge_write_ram(gb, address - 0xA000, value);
+}
+
+static uint8_t gameboy_read_oam(GameBoy * const gb, uint16_t address) {
+    if (address <= 0xFE9F) return ppu_read_oam(gb, address - 0xFE00);
+    else return 0x00;
+}
+
+static void gameboy_write_oam(GameBoy * const gb, uint16_t address, uint8_t value) {
+    if (address <= 0xFE9F) ppu_write_oam(gb, address - 0xFE00, value);
+}
+
+static uint8_t gameboy_read_io(GameBoy * const gb, uint16_t address) {
+    if      (address == 0xFF00) return joypad_read_p1(gb);
+    else if (address == 0xFF01) return serial_read_sb(gb);
     else if (address == 0xFF02) return serial_read_sc(gb);
     else if (address == 0xFF03) return UNMAPPED_ALL_ONES;
     else if (address == 0xFF04) return gb->timer->div;
@@ -218,22 +1074,16 @@ uint8_t gameboy_read(GameBoy * const gb, uint16_t address) {
     else if (address == 0xFF4F) return UNMAPPED_ALL_ONES;
     else if (address == 0xFF50) return gb->boot | 0b11111110; 
     else if (address >= 0xFF51 && address <= 0xFF7F) return UNMAPPED_ALL_ONES;
-    else if (address >= 0xFF80 && address <= 0xFFFE) return gb->processor->hram[address - 0xFF80];
+    else if (address >= 0xFF80 && address <= 0xFFFE) return gb->memory->hram[address - 0xFF80];
     else if (address == 0xFFFF) return interrupt_controller_get_enables(gb);
     else TRTLE_LOG_ERR("Attempted to read an unsupported address %X\n", address);
     return 0xFF;
 }
 
-void gameboy_write(GameBoy * const gb, uint16_t address, uint8_t value) {
-    if      (address <= 0x7FFF) cartridge_write_rom(gb, address, value);
-    else if (address <= 0x9FFF) ppu_write_vram(gb, address - 0x8000, value);
-    else if (address <= 0xBFFF) cartridge_write_ram(gb, address, value - 0xA000);
-    else if (address <= 0xDFFF) gb->processor->ram[address - 0xC000] = value;
-    else if (address <= 0xFDFF) gb->processor->ram[address - 0xE000] = value;
-    else if (address <= 0xFE9F) ppu_write_oam(gb, address - 0xFE00, value);
-    else if (address == 0xFF00) joypad_write_p1(gb, value);
+static void gameboy_write_io(GameBoy * const gb, uint16_t address, uint8_t value) {
+    if      (address == 0xFF00) joypad_write_p1(gb, value);
     else if (address == 0xFF01) gb->serial->sb = value;
-    else if (address == 0xFF02) gb->serial->sc = value;
+    else if (address == 0xFF02) serial_write_sc(gb, value);
     else if (address == 0xFF03) return; // Unmapped
     else if (address == 0xFF04) timer_write_div(gb);
     else if (address == 0xFF05) timer_write_tima(gb, value);
@@ -286,9 +1136,139 @@ void gameboy_write(GameBoy * const gb, uint16_t address, uint8_t value) {
     else if (address == 0xFF4A) gb->ppu->wy = value;
     else if (address == 0xFF4B) gb->ppu->wx = value;
     else if (address >= 0xFF4C && address <= 0xFF4F) return; // Unmapped
-    else if (address == 0xFF50) { if (gb->boot == 0) gb->boot = value == 0 ? 0 : 1; }
+    else if (address == 0xFF50) {
+        if (gb->boot == 0 && value != 0) {
+            gb->boot = 1;
+            gameboy_map_memory(gb);
+        }
+    }
     else if (address >= 0xFF51 && address <= 0xFF7F) return; // Unmapped
-    else if (address >= 0xFF80 && address <= 0xFFFE) gb->processor->hram[address - 0xFF80] = value;
+    else if (address >= 0xFF80 && address <= 0xFFFE) gb->memory->hram[address - 0xFF80] = value;
     else if (address == 0xFFFF) interrupt_controller_set_enables(gb, value);
     else TRTLE_LOG_ERR("Attempted to write to an unsupported address %X\n", address);
 }
+
+void gameboy_map_cartridge(GameBoy * const gb) {
+    MemoryMap * const map = gameboy_own_memory_map(gb);
+    if (map == NULL) return;
+    Cartridge const * const cart = gb->cartridge;
+    if (cart != NULL) {
+        memory_map_map_read(map, 0x00, 0x3F, cart->rom_bank0, NULL);
+        memory_map_map_read(map, 0x40, 0x7F, cart->rom_bank1, NULL);
+    }
+    else memory_map_map_read(map, 0x00, 0x7F, NULL, gameboy_read_open_bus);
+    memory_map_map_write(map, 0x00, 0x7F, NULL, gameboy_write_rom);
+    if (!gb->boot) memory_map_map_read(map, 0x00, 0x00, dmg_boot, NULL);
+
+    if (cart != NULL && cart->ram_bank != NULL) {
+        // Banks smaller than the window are mirrored across it
+        uint8_t pages = cart->ram_bank_size >> MEMORY_MAP_PAGE_SHIFT;
+        for (uint16_t page = 0xA0; page <= 0xBF; page += pages) {
+            memory_map_map_read(map, page, page + pages - 1, cart->ram_bank, NULL);
+        }
+    }
+    else memory_map_map_read(map, 0xA0, 0xBF, NULL, gameboy_read_external_ram);
+    memory_map_map_write(map, 0xA0, 0xBF, NULL, gameboy_write_external_ram);
+
+    if (gb->dma->active) dma_map_memory(gb);
+}
+
+// Points every window onto a memory page at its current frame. With a previous frame given, only
+// reads still aimed at it are moved, so handlers installed over the page by a running DMA stay in place.
+static void gameboy_map_page(GameBoy * const gb, size_t page, uint8_t const * previous) {
+    MemoryMap * const map = gameboy_own_memory_map(gb);
+    if (map == NULL) return;
+    uint8_t * data = gb->memory->table->pages[page]->data;
+    bool shared = gb->memory->shared & (1ull << page);
+
+    uint8_t windows[2];
+    size_t count = 0;
+    if (page >= GAMEBOY_VRAM_PAGE) windows[count++] = 0x80 + page - GAMEBOY_VRAM_PAGE;
+    else {
+        windows[count++] = 0xC0 + page;
+        if (0xE0 + page <= 0xFD) windows[count++] = 0xE0 + page; // ECHO
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (previous == NULL || map->read_pages[windows[i]] == previous) memory_map_map_read(map, windows[i], windows[i], data, NULL);
+        if (page < GAMEBOY_VRAM_PAGE) memory_map_map_write(map, windows[i], windows[i], shared ? NULL : data, gameboy_write_wram);
+    }
+}
+
+uint8_t * gameboy_own_page(GameBoy * const gb, size_t page) {
+    GameBoyMemory * const memory = gb->memory;
+    if (!(memory->shared & (1ull << page))) return memory->table->pages[page]->data;
+
+    // The first write after a fork splits the table, the pages in it are only split as they are written
+    GameBoyPageTable * table = memory->table;
+    if (atomic_load_explicit(&table->references, memory_order_acquire) > 1) {
+        GameBoyPageTable * clone = gameboy_page_table_clone(table);
+        if (clone == NULL) {
+            TRTLE_LOG_ERR("Failed to allocate a private page table");
+            return NULL;
+        }
+        memory->table = clone;
+        gameboy_page_table_release(table);
+    }
+
+    // The last fork sharing the page may already be gone, in which case it can be taken over as is
+    GameBoyPage * frame = memory->table->pages[page];
+    if (atomic_load_explicit(&frame->references, memory_order_acquire) > 1) {
+        GameBoyPage * copy = malloc(sizeof(GameBoyPage));
+        if (copy == NULL) {
+            TRTLE_LOG_ERR("Failed to allocate a private memory page");
+            return NULL;
+        }
+        atomic_init(&copy->references, 1);
+        memcpy(copy->data, frame->data, GAMEBOY_PAGE_SIZE);
+        memory->table->pages[page] = copy;
+    }
+
+    memory->shared &= ~(1ull << page);
+    gameboy_map_page(gb, page, frame->data);
+    if (memory->table->pages[page] != frame) gameboy_page_release(frame);
+    return memory->table->pages[page]->data;
+}
+
+MemoryMap * gameboy_own_memory_map(GameBoy * const gb) {
+    MemoryMap * map = gb->memory_map;
+    if (atomic_load_explicit(&map->references, memory_order_acquire) == 1) return map;
+
+    MemoryMap * clone = memory_map_clone(map);
+    if (clone == NULL) {
+        TRTLE_LOG_ERR("Failed to allocate a private memory map");
+        return NULL;
+    }
+    gb->memory_map = clone;
+    memory_map_release(map);
+    return clone;
+}
+
+void gameboy_map_memory(GameBoy * const gb) {
+    MemoryMap * const map = gameboy_own_memory_map(gb);
+    if (map == NULL) return;
+    gameboy_map_cartridge(gb);
+    memory_map_map_write(map, 0x80, 0x9F, NULL, gameboy_write_vram);
+    for (size_t page = 0; page < GAMEBOY_PAGE_COUNT; page++) gameboy_map_page(gb, page, NULL);
+    memory_map_map_read(map, 0xFE, 0xFE, NULL, gameboy_read_oam);
+    memory_map_map_write(map, 0xFE, 0xFE, NULL, gameboy_write_oam);
+    memory_map_map_read(map, 0xFF, 0xFF, NULL, gameboy_read_io);
+    memory_map_map_write(map, 0xFF, 0xFF, NULL, gameboy_write_io);
+
+    if (gb->dma->active) dma_map_memory(gb);
+}
+
+uint8_t gameboy_read(GameBoy * const gb, uint16_t address) {
+    uint8_t page = address >> MEMORY_MAP_PAGE_SHIFT;
+    uint8_t const * data = gb->memory_map->read_pages[page];
+    if (data != NULL) return data[address & MEMORY_MAP_PAGE_MASK];
+    return gb->memory_map->read_handlers[page](gb, address);
+}
+
+void gameboy_write(GameBoy * const gb, uint16_t address, uint8_t value) {
+    uint8_t page = address >> MEMORY_MAP_PAGE_SHIFT;
+    gb->memory->written[page / 64] |= 1ull << (page % 64);
+    uint8_t * data = gb->memory_map->write_pages[page];
+    if (data != NULL) data[address & MEMORY_MAP_PAGE_MASK] = value;
+    else gb->memory_map->write_handlers[page](gb, address, value);
+}
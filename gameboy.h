@@ -1,7 +1,10 @@
 #ifndef TRTLE_GAMEBOY_H
 #define TRTLE_GAMEBOY_H
 
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define GAMEBOY_TILESET_WIDTH  (128)
@@ -11,17 +14,42 @@
 #define GAMEBOY_DISPLAY_WIDTH  (160)
 #define GAMEBOY_DISPLAY_HEIGHT (144)
 #define GAMEBOY_DISPLAY_PIXEL_COUNT (GAMEBOY_DISPLAY_WIDTH * GAMEBOY_DISPLAY_HEIGHT)
+#define GAMEBOY_DISPLAY_PACKED_SIZE (GAMEBOY_DISPLAY_PIXEL_COUNT / 4)
 
 #define GAMEBOY_BOOTROM_ADDRESS     (0x0000)
 #define GAMEBOY_ROM_ADDRESS         (0x0000)
 #define GAMEBOY_VRAM_ADDRESS        (0x8000)
 #define GAMEBOY_OAM_ADDRESS         (0xFE00)
 
+#define GAMEBOY_WRAM_SIZE (0x2000)
+#define GAMEBOY_VRAM_SIZE (0x2000)
+#define GAMEBOY_OAM_SIZE  (0xA0)
+#define GAMEBOY_HRAM_SIZE (0x7F)
+
+#define GAMEBOY_FRAME_CYCLES (70224)
+#define GAMEBOY_MAX_BREAKPOINTS (8)
+#define GAMEBOY_INPUT_QUEUE_SIZE (32)
+#define GAMEBOY_SERIAL_CAPTURE_SIZE (1024)
+
+#define GAMEBOY_ARENA_ALIGNMENT (64)
+
+// WRAM and VRAM are held in pages the size of a memory map page, VRAM pages follow the WRAM ones
+#define GAMEBOY_PAGE_SIZE  (0x100)
+#define GAMEBOY_WRAM_PAGE  (0)
+#define GAMEBOY_VRAM_PAGE  (GAMEBOY_WRAM_SIZE / GAMEBOY_PAGE_SIZE)
+#define GAMEBOY_PAGE_COUNT ((GAMEBOY_WRAM_SIZE + GAMEBOY_VRAM_SIZE) / GAMEBOY_PAGE_SIZE)
+
+#define GAMEBOY_STATE_VERSION (5)
+
 typedef struct Cartridge Cartridge;
+typedef struct CartridgeImage CartridgeImage;
 typedef struct DMA DMA;
 typedef struct InterruptController InterruptController;
 typedef struct Joypad Joypad;
+typedef struct MemoryMap MemoryMap;
 typedef struct PPU PPU;
+typedef struct PPUCache PPUCache;
+typedef struct GameBoySnapshot GameBoySnapshot;
 typedef struct Processor Processor;
 typedef struct Serial Serial;
 typedef struct SoundController SoundController;
@@ -38,16 +66,82 @@ typedef struct GameBoyInput {
     bool right;
 } GameBoyInput;
 
+// Buttons as bits of an input mask, in the order movies and rollback sessions store them
+typedef enum GameBoyButton {
+    GAMEBOY_BUTTON_A      = 0b00000001,
+    GAMEBOY_BUTTON_B      = 0b00000010,
+    GAMEBOY_BUTTON_START  = 0b00000100,
+    GAMEBOY_BUTTON_SELECT = 0b00001000,
+    GAMEBOY_BUTTON_UP     = 0b00010000,
+    GAMEBOY_BUTTON_DOWN   = 0b00100000,
+    GAMEBOY_BUTTON_LEFT   = 0b01000000,
+    GAMEBOY_BUTTON_RIGHT  = 0b10000000,
+} GameBoyButton;
+
+// Asked for input the first time a run reads P1, so the game sees input sampled as late as it allows
+typedef GameBoyInput (*GameBoyInputCallback)(void * userdata);
+
+// The other end of the link port. The source is asked for the byte to receive as an internally clocked transfer
+// completes, and returns -1 when nothing is there so 0xFF is read. An externally clocked transfer asks when it starts
+// and keeps asking at each run until the source answers. The sink is handed each byte sent once its transfer completes.
+typedef int (*GameBoySerialSource)(void * userdata);
+typedef void (*GameBoySerialSink)(void * userdata, uint8_t byte);
+
+// Events a run can stop on. They are raised where they happen rather than polled after every instruction.
+typedef enum GameBoyEvent {
+    GAMEBOY_EVENT_VBLANK     = 0b001, // The PPU entered vblank
+    GAMEBOY_EVENT_SERIAL     = 0b010, // A serial transfer completed
+    GAMEBOY_EVENT_BREAKPOINT = 0b100, // The instruction at a breakpoint is about to run
+} GameBoyEvent;
+
+// A reference counted page of bulk memory, shared between page tables until written through one of them
+typedef struct GameBoyPage {
+    atomic_uint references;
+    uint8_t data[GAMEBOY_PAGE_SIZE];
+} GameBoyPage;
+
+// Forks share a whole table, so forking takes one reference and the pages are only counted once a side writes
+typedef struct GameBoyPageTable {
+    atomic_uint references;
+    GameBoyPage * pages[GAMEBOY_PAGE_COUNT];
+} GameBoyPageTable;
+
+typedef struct GameBoyMemory {
+    GameBoyPageTable * table;
+    uint64_t shared;     // Pages that may still be referenced by another instance, their writes go through a handler
+    uint64_t written[4]; // Pages of the address space written since the last snapshot save or restore
+
+    uint8_t oam[GAMEBOY_OAM_SIZE];
+    uint8_t hram[GAMEBOY_HRAM_SIZE];
+} GameBoyMemory;
+
+_Static_assert(GAMEBOY_PAGE_COUNT <= 64, "The shared page mask no longer fits in a word");
+
+// Every component lives in a single arena allocation headed by this struct.
+// Registers run contiguously from cycles through the end of the components, bulk memory and caches are shared by forks.
 typedef struct GameBoy {
     Cartridge * cartridge;
     DMA * dma;
     InterruptController * interrupt_controller;
     Joypad * joypad;
+    GameBoyMemory * memory;
+    MemoryMap * memory_map;
     PPU * ppu;
+    PPUCache * ppu_cache;
     Processor * processor;
     Serial * serial;
     SoundController * sound_controller;
     Timer * timer;
+
+    bool skip_render;   // Emulate without drawing, for frames that will never be shown
+    bool input_pending; // The input callback is due on the next P1 read
+
+    // An event the current run waits on clears the deadline, so the run loop only ever compares cycles against it
+    uint64_t run_deadline;
+    uint32_t run_events;
+    uint32_t run_exit;
+
+    uint64_t cycles; // T-cycles since power on, the time base for anything computed lazily
     uint8_t boot;
 } GameBoy;
 
@@ -55,13 +149,94 @@ GameBoy * gameboy_create();
 void gameboy_delete(GameBoy * gb);
 void gameboy_reset(GameBoy * gb);
 
-void gameboy_set_cartridge(GameBoy * const gb, Cartridge * const cartridge);
+bool gameboy_set_cartridge(GameBoy * const gb, CartridgeImage * const image);
+
+// Creates an independent copy of an instance. Registers are copied, everything else is shared
+// copy-on-write, so memory pages are only duplicated once the parent or the child writes to them.
+GameBoy * gameboy_fork(GameBoy * const gb);
+
+// Moves a fork of gb that has run on back into gb and deletes it, as when a speculative branch turns out right.
+// Only its registers and the cartridge ram it wrote are copied, gb keeps its save file, callbacks and link.
+bool gameboy_adopt(GameBoy * const gb, GameBoy * fork);
 
 void gameboy_update(GameBoy * const gb, GameBoyInput input);
+
+// Runs whole instructions until at least cycles T-cycles have passed, returning how many did
+uint64_t gameboy_run_cycles(GameBoy * const gb, GameBoyInput input, uint64_t cycles);
+
+// Runs until one of events or for at most cycles T-cycles, returning the events that stopped it or 0 at the budget
+uint32_t gameboy_run_until(GameBoy * const gb, GameBoyInput input, uint32_t events, uint64_t cycles);
+
+// Runs to the next vblank, but never longer than a frame, so a game with the LCD off still returns on time.
+// Returns false if the frame ended on the budget.
+bool gameboy_run_frame(GameBoy * const gb, GameBoyInput input);
+
+// Kept for existing callers, the same as gameboy_run_frame
 void gameboy_update_to_vblank(GameBoy * const gb, GameBoyInput input);
 
+// While a callback is set, the input passed to a run only stands until the game first reads P1 in it.
+// The callback is not inherited by forks.
+void gameboy_set_input_callback(GameBoy * const gb, GameBoyInputCallback callback, void * userdata);
+void gameboy_poll_input(GameBoy * const gb);
+
+// Presses exactly the buttons in mask once cycle is reached, at the first instruction boundary at or after it.
+// Once input is queued the queue drives the joypad and runs ignore their input until the queue is cleared.
+// Returns false if the queue is full.
+bool gameboy_queue_input(GameBoy * const gb, uint64_t cycle, uint8_t mask);
+void gameboy_clear_input_queue(GameBoy * const gb);
+
+// Connects the serial ports of two instances, replacing any link either had. A linked pair has to be run together
+// with gameboy_link_run_frame so neither gets ahead of the other. Forks are never linked.
+bool gameboy_link(GameBoy * const a, GameBoy * const b);
+void gameboy_unlink(GameBoy * const gb);
+GameBoy * gameboy_get_link(GameBoy * const gb);
+
+// Runs a linked pair to gb's next vblank, but never longer than a frame, with the other side running for the same time.
+// Both advance in slices that end whenever a transfer completes, so each byte is exchanged with both sides at the same
+// cycle. Returns false if the frame ended on the budget.
+bool gameboy_link_run_frame(GameBoy * const gb, GameBoyInput input, GameBoyInput link_input);
+
+// Neither end is inherited by forks, and a linked instance only asks its source while it runs the clock
+void gameboy_set_serial_source(GameBoy * const gb, GameBoySerialSource source, void * userdata);
+void gameboy_set_serial_sink(GameBoy * const gb, GameBoySerialSink sink, void * userdata);
+int gameboy_serial_receive(GameBoy * const gb);
+void gameboy_serial_send(GameBoy * const gb, uint8_t byte);
+
+// Every byte sent is also kept in a capture buffer, so headless tools can read what test roms report without a sink.
+// Once full the oldest half is dropped. The capture is not part of savestates.
+uint8_t const * gameboy_get_serial_capture(GameBoy * const gb, size_t * size);
+void gameboy_clear_serial_capture(GameBoy * const gb);
+
+bool gameboy_set_breakpoint(GameBoy * const gb, uint16_t address);
+void gameboy_clear_breakpoint(GameBoy * const gb, uint16_t address);
+
+// Savestates are a header followed by raw copies of each component, only valid for the same build and cartridge
+size_t gameboy_get_state_size(GameBoy const * const gb);
+bool gameboy_save_state(GameBoy const * const gb, void * data, size_t size);
+bool gameboy_load_state(GameBoy * const gb, void const * data, size_t size);
+
+// A suspend file is a savestate tagged with a hash of the rom, so it is never resumed on another cartridge.
+// Resuming maps the file and restores straight from it.
+bool gameboy_suspend(GameBoy const * const gb, const char * path);
+bool gameboy_resume(GameBoy * const gb, const char * path);
+
+// A snapshot is a savestate kept in memory. Saving or restoring the snapshot an instance last saved or
+// restored only copies the pages written in between, so repeated runahead or reset cycles stay cheap.
+GameBoySnapshot * gameboy_snapshot_create(void);
+void gameboy_snapshot_delete(GameBoySnapshot * snapshot);
+bool gameboy_snapshot_save(GameBoy * const gb, GameBoySnapshot * const snapshot);
+bool gameboy_snapshot_restore(GameBoy * const gb, GameBoySnapshot * const snapshot);
+void const * gameboy_snapshot_get_data(GameBoySnapshot const * const snapshot, size_t * size);
+
+// The baseline is a snapshot owned by the instance, for fuzzers and episodic training that reset to the same
+// point over and over. Restoring it only copies back the pages written since, and is not inherited by forks.
+bool gameboy_set_baseline(GameBoy * const gb);
+bool gameboy_restore_baseline(GameBoy * const gb);
+
 size_t gameboy_get_background_data(GameBoy const * const gb, uint32_t * data, size_t length);
 size_t gameboy_get_display_data(GameBoy const * const gb, uint32_t * data, size_t length);
+// The display as 2-bit shades, four pixels to a byte with the leftmost in the high bits
+size_t gameboy_get_display_shades(GameBoy const * const gb, uint8_t * data, size_t length);
 size_t gameboy_get_tileset_data(GameBoy const * const gb, uint32_t * data, size_t length);
 
 void gameboy_cycle(GameBoy* const gb);
@@ -69,4 +244,31 @@ void gameboy_cycle(GameBoy* const gb);
 uint8_t gameboy_read(GameBoy* const gb, uint16_t address);
 void gameboy_write(GameBoy* const gb, uint16_t address, uint8_t value);
 
+void gameboy_map_memory(GameBoy * const gb);
+void gameboy_map_cartridge(GameBoy * const gb);
+
+// Stops tracking written pages after state was replaced behind the tracker's back, so the next snapshot copies all of it
+void gameboy_invalidate_snapshot(GameBoy * const gb);
+
+// Returns the page for writing, first copying it if another instance still shares it
+uint8_t * gameboy_own_page(GameBoy * const gb, size_t page);
+
+// Returns the map for remapping, first copying it if another instance still shares it
+MemoryMap * gameboy_own_memory_map(GameBoy * const gb);
+
+static inline void gameboy_signal(GameBoy * const gb, GameBoyEvent event) {
+    if (gb->run_events & event) {
+        gb->run_exit |= event;
+        gb->run_deadline = 0;
+    }
+}
+
+static inline uint8_t const * gameboy_get_page(GameBoy const * const gb, size_t page) {
+    return gb->memory->table->pages[page]->data;
+}
+
+static inline uint8_t gameboy_read_vram(GameBoy const * const gb, uint16_t offset) {
+    return gameboy_get_page(gb, GAMEBOY_VRAM_PAGE + offset / GAMEBOY_PAGE_SIZE)[offset % GAMEBOY_PAGE_SIZE];
+}
+
 #endif /* !TRTLE_GAMEBOY_H */
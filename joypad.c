@@ -37,13 +37,15 @@ static void joypad_update_internal(GameBoy * const gb) {
     }
     input &= P1_BIT_READONLY;
 
-    if (prev != input) gb->interrupt_controller->flags |= JOYPAD_INTERRUPT_BIT;
+    // Only a line falling from high to low requests the interrupt
+    if (prev & ~input) gb->interrupt_controller->flags |= JOYPAD_INTERRUPT_BIT;
 
     gb->joypad->p1 &= ~P1_BIT_READONLY;
     gb->joypad->p1 |= input;
 }
 
 uint8_t joypad_read_p1(GameBoy * const gb) {
+    if (gb->input_pending) gameboy_poll_input(gb);
     joypad_update_internal(gb);
     return gb->joypad->p1 | P1_BIT_UNUSED;
 }
@@ -66,3 +68,26 @@ void joypad_update_p1(GameBoy * const gb, GameBoyInput input) {
     if (input.up) gb->joypad->directions |= P1_BIT_UP;
     if (input.down) gb->joypad->directions |= P1_BIT_DOWN;
 }
+
+void joypad_set_buttons(GameBoy * const gb, uint8_t mask) {
+    gb->joypad->buttons = 0;
+    if (mask & GAMEBOY_BUTTON_A) gb->joypad->buttons |= P1_BIT_A;
+    if (mask & GAMEBOY_BUTTON_B) gb->joypad->buttons |= P1_BIT_B;
+    if (mask & GAMEBOY_BUTTON_SELECT) gb->joypad->buttons |= P1_BIT_SELECT;
+    if (mask & GAMEBOY_BUTTON_START) gb->joypad->buttons |= P1_BIT_START;
+
+    gb->joypad->directions = 0;
+    if (mask & GAMEBOY_BUTTON_RIGHT) gb->joypad->directions |= P1_BIT_RIGHT;
+    if (mask & GAMEBOY_BUTTON_LEFT) gb->joypad->directions |= P1_BIT_LEFT;
+    if (mask & GAMEBOY_BUTTON_UP) gb->joypad->directions |= P1_BIT_UP;
+    if (mask & GAMEBOY_BUTTON_DOWN) gb->joypad->directions |= P1_BIT_DOWN;
+
+    joypad_update_internal(gb);
+}
+
+bool joypad_is_pressed(GameBoy const * const gb) {
+    uint8_t pressed = 0;
+    if (!(gb->joypad->p1 & P1_BIT_BUTTONS)) pressed |= gb->joypad->buttons;
+    if (!(gb->joypad->p1 & P1_BIT_DIRECTIONS)) pressed |= gb->joypad->directions;
+    return pressed != 0;
+}
@@ -20,4 +20,10 @@ void joypad_write_p1(GameBoy * const gb, uint8_t value);
 
 void joypad_update_p1(GameBoy * const gb, GameBoyInput input);
 
+// Presses exactly the buttons of a GameBoyButton mask and updates the P1 lines straight away
+void joypad_set_buttons(GameBoy * const gb, uint8_t mask);
+
+// Whether a button on a selected line is held, which is what wakes the processor from STOP
+bool joypad_is_pressed(GameBoy const * const gb);
+
 #endif /* !TRTLE_JOYPAD_H */
@@ -15,8 +15,21 @@
 #define TRTLE_LOGGING_VERBOSE
 #include "trtle.h"
 
+// RetroArch's own extension, numbered in its private block rather than the public range of libretro.h
+#ifndef RETRO_ENVIRONMENT_RETROARCH_START_BLOCK
+#define RETRO_ENVIRONMENT_RETROARCH_START_BLOCK 0x800000
+#endif
+#ifndef RETRO_ENVIRONMENT_POLL_TYPE_OVERRIDE
+#define RETRO_ENVIRONMENT_POLL_TYPE_OVERRIDE (4 | RETRO_ENVIRONMENT_RETROARCH_START_BLOCK)
+#endif
+
+// Matches RetroArch's poll type override values, where 0 leaves the choice to the frontend and 1 polls early
+enum RetroPollType {
+    RETRO_POLL_TYPE_NORMAL = 2,
+    RETRO_POLL_TYPE_LATE   = 3,
+};
+
 static GameBoy * gameboy;
-static Cartridge * cart;
 static uint32_t * frame_buf;
 static struct retro_log_callback logging;
 static retro_log_printf_t log_cb;
@@ -27,6 +40,32 @@ static retro_audio_sample_batch_t audio_batch_cb;
 static retro_input_poll_t input_poll_cb;
 static retro_input_state_t input_state_cb;
 
+// Late polling waits for the game's first P1 read in a frame, every frame after it in the same run reuses that input
+static bool input_late;
+static bool input_bitmasks;
+static bool input_polled;
+static GameBoyInput input_latched;
+
+// Frames emulated ahead of the one shown, restored afterwards so the game sees input sooner
+static unsigned runahead_frames;
+static GameBoySnapshot * runahead_snapshot;
+
+// Frames run on the core's own thread a frame behind the input, so retro_run only hands over the last finished frame
+// and never waits on the one in flight
+static Pipeline * pipeline;
+
+// The machine is suspended here on unload and resumed from it on the next load, empty without a game path
+static bool suspend_enabled;
+static char suspend_path[4096];
+
+// The frontend fills these after load, they are applied to the cartridge on the first frame
+static uint8_t rtc_data[CARTRIDGE_RTC_SAVE_SIZE];
+static bool load_pending;
+
+// With a frame in flight the frontend is handed this copy of save ram instead, refreshed only between frames
+static uint8_t * save_ram_mirror;
+static bool save_ram_mirrored;
+
 static void fallback_log(enum retro_log_level level, const char* fmt, ...) {
     (void)level;
     va_list va;
@@ -38,11 +77,16 @@ static void fallback_log(enum retro_log_level level, const char* fmt, ...) {
 void retro_init(void) {
     gameboy = gameboy_create();
     frame_buf = calloc(GAMEBOY_DISPLAY_PIXEL_COUNT, sizeof(uint32_t));
+    runahead_snapshot = gameboy_snapshot_create();
 }
 
 void retro_deinit(void) {
+    pipeline_delete(pipeline);
+    pipeline = NULL;
     free(frame_buf);
     frame_buf = NULL;
+    gameboy_snapshot_delete(runahead_snapshot);
+    runahead_snapshot = NULL;
     gameboy_delete(gameboy);
     gameboy = NULL;
 }
@@ -55,7 +99,7 @@ void retro_get_system_info(struct retro_system_info * info) {
     memset(info, 0, sizeof(*info));
     info->library_name     = "trtle";
     info->library_version  = "0.1";
-    info->need_fullpath    = false;
+    info->need_fullpath    = true;
     info->valid_extensions = "gb|gbc";
 }
 
@@ -98,6 +142,103 @@ void retro_set_environment(retro_environment_t cb) {
     };
 
     cb(RETRO_ENVIRONMENT_SET_CONTROLLER_INFO, (void*)ports);
+
+    static const struct retro_variable variables[] = {
+       { "trtle_runahead", "Run-ahead frames; 0|1|2|3|4" },
+       { "trtle_input_poll", "Input polling; late|normal" },
+       { "trtle_suspend", "Resume where the game was closed; disabled|enabled" },
+       { "trtle_threaded", "Emulate on a separate thread (adds a frame of latency); disabled|enabled" },
+       { NULL, NULL },
+    };
+
+    cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)variables);
+}
+
+static void poll_input(void) {
+    input_poll_cb();
+    input_polled = true;
+
+    int16_t mask = 0;
+    if (input_bitmasks) mask = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_MASK);
+    else {
+        for (unsigned id = RETRO_DEVICE_ID_JOYPAD_B; id <= RETRO_DEVICE_ID_JOYPAD_A; id++) {
+            if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, id)) mask |= 1 << id;
+        }
+    }
+
+    input_latched = (GameBoyInput){
+        mask & (1 << RETRO_DEVICE_ID_JOYPAD_A),
+        mask & (1 << RETRO_DEVICE_ID_JOYPAD_B),
+        mask & (1 << RETRO_DEVICE_ID_JOYPAD_START),
+        mask & (1 << RETRO_DEVICE_ID_JOYPAD_SELECT),
+        mask & (1 << RETRO_DEVICE_ID_JOYPAD_UP),
+        mask & (1 << RETRO_DEVICE_ID_JOYPAD_DOWN),
+        mask & (1 << RETRO_DEVICE_ID_JOYPAD_LEFT),
+        mask & (1 << RETRO_DEVICE_ID_JOYPAD_RIGHT)
+    };
+}
+
+static GameBoyInput late_input(void * userdata) {
+    (void)userdata;
+    if (!input_polled) poll_input();
+    return input_latched;
+}
+
+// Everything but retro_run has to let the frame in flight finish before touching the instance
+static void wait_for_frame(void) {
+    if (pipeline != NULL) pipeline_wait(pipeline);
+}
+
+// Only called while no frame is in flight, the emulation thread never touches the mirror
+static void sync_save_ram(void) {
+    if (save_ram_mirror != NULL) memcpy(save_ram_mirror, gameboy->cartridge->ram, gameboy->cartridge->ram_size);
+}
+
+static void check_variables(void) {
+    wait_for_frame();
+
+    // The frontend may only be asked for input on its own thread, and run-ahead would undo the point of threading
+    struct retro_variable var = { "trtle_threaded", NULL };
+    bool threaded = environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0;
+    if (threaded && pipeline == NULL) {
+        sync_save_ram();
+        pipeline = pipeline_create(gameboy);
+        if (pipeline == NULL) log_cb(RETRO_LOG_WARN, "Failed to start the emulation thread, running on the frontend's.\n");
+    }
+    else if (!threaded) {
+        pipeline_delete(pipeline);
+        pipeline = NULL;
+    }
+
+    var = (struct retro_variable){ "trtle_runahead", NULL };
+    runahead_frames = 0;
+    if (pipeline == NULL && environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value) runahead_frames = atoi(var.value);
+
+    var = (struct retro_variable){ "trtle_input_poll", NULL };
+    input_late = pipeline == NULL && !(environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "normal") == 0);
+    unsigned poll_type = input_late ? RETRO_POLL_TYPE_LATE : RETRO_POLL_TYPE_NORMAL;
+    environ_cb(RETRO_ENVIRONMENT_POLL_TYPE_OVERRIDE, &poll_type);
+    gameboy_set_input_callback(gameboy, input_late ? late_input : NULL, NULL);
+
+    var = (struct retro_variable){ "trtle_suspend", NULL };
+    suspend_enabled = environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0;
+}
+
+// The suspend file is named after the game and kept in the save directory, or next to the game without one
+static void set_suspend_path(const char * game_path) {
+    suspend_path[0] = '\0';
+    if (game_path == NULL) return;
+
+    const char * name = game_path;
+    for (const char * c = game_path; *c; c++) if (*c == '/' || *c == '\\') name = c + 1;
+    const char * extension = strrchr(name, '.');
+    int name_length = extension != NULL ? (int)(extension - name) : (int)strlen(name);
+
+    const char * directory = NULL;
+    if (environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &directory) && directory != NULL && directory[0] != '\0') {
+        snprintf(suspend_path, sizeof(suspend_path), "%s/%.*s.suspend", directory, name_length, name);
+    }
+    else snprintf(suspend_path, sizeof(suspend_path), "%.*s.suspend", (int)(name - game_path) + name_length, game_path);
 }
 
 void retro_set_audio_sample(retro_audio_sample_t cb) {
@@ -121,25 +262,57 @@ void retro_set_video_refresh(retro_video_refresh_t cb) {
 }
 
 void retro_reset(void) {
+    wait_for_frame();
     gameboy_reset(gameboy);
 }
 
 void retro_run(void) {
-    input_poll_cb();
-    GameBoyInput input = {
-        input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_A),
-        input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_B),
-        input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_START),
-        input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_SELECT),
-        input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_UP),
-        input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_DOWN),
-        input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_LEFT),
-        input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_RIGHT)
-    };
+    input_polled = false;
+    if (!input_late) poll_input();
+
+    if (load_pending) {
+        wait_for_frame();
+        cartridge_rtc_load(gameboy, rtc_data);
+        if (save_ram_mirrored) {
+            memcpy(gameboy->cartridge->ram, save_ram_mirror, gameboy->cartridge->ram_size);
+            gameboy_invalidate_snapshot(gameboy);
+        }
+        load_pending = false;
+    }
+
+    bool updated = false;
+    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated) check_variables();
+
+    if (pipeline != NULL) {
+        // A frame still in flight keeps running and the last finished one is shown again, so emulation that falls
+        // behind slows the game down instead of stalling the frontend
+        uint32_t const * frame = pipeline_get_frame(pipeline);
+        if (pipeline_is_idle(pipeline)) {
+            sync_save_ram();
+            pipeline_submit(pipeline, input_latched);
+        }
+        video_cb(frame != NULL ? frame : frame_buf, GAMEBOY_DISPLAY_WIDTH, GAMEBOY_DISPLAY_HEIGHT, sizeof(uint32_t) * GAMEBOY_DISPLAY_WIDTH);
+        return;
+    }
+
+    if (runahead_frames == 0) gameboy_run_frame(gameboy, input_latched);
+    else {
+        // Only the first frame is kept, the rest run ahead on the same input and only the last one is drawn
+        gameboy->skip_render = true;
+        gameboy_run_frame(gameboy, input_latched);
+        gameboy_snapshot_save(gameboy, runahead_snapshot);
+        for (unsigned i = 1; i < runahead_frames; i++) gameboy_run_frame(gameboy, input_latched);
+        gameboy->skip_render = false;
+        gameboy_run_frame(gameboy, input_latched);
+    }
+
+    // The frontend expects a poll every frame, even one where the game never read the joypad
+    if (!input_polled) poll_input();
 
-    gameboy_update_to_vblank(gameboy, input);
     gameboy_get_display_data(gameboy, frame_buf, GAMEBOY_DISPLAY_PIXEL_COUNT);
     video_cb(frame_buf, GAMEBOY_DISPLAY_WIDTH, GAMEBOY_DISPLAY_HEIGHT, sizeof(uint32_t) * GAMEBOY_DISPLAY_WIDTH);
+
+    if (runahead_frames > 0) gameboy_snapshot_restore(gameboy, runahead_snapshot);
 }
 
 bool retro_load_game(const struct retro_game_info *info) {
@@ -156,6 +329,8 @@ bool retro_load_game(const struct retro_game_info *info) {
     };
 
     environ_cb(RETRO_ENVIRONMENT_SET_INPUT_DESCRIPTORS, desc);
+    input_bitmasks = environ_cb(RETRO_ENVIRONMENT_GET_INPUT_BITMASKS, NULL);
+    check_variables();
 
     enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
     if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt)) {
@@ -163,20 +338,53 @@ bool retro_load_game(const struct retro_game_info *info) {
        return false;
     }
 
-    if (info && info->data) {
-        CartridgeError error = cartridge_from_memory(&gameboy->cartridge, info->data, info->size);
+    if (info && (info->path || info->data)) {
+        CartridgeImage * image;
+        CartridgeError error;
+        if (info->path) error = cartridge_image_from_file(&image, info->path);
+        else error = cartridge_image_from_memory(&image, info->data, info->size);
         if (error) {
             log_cb(RETRO_LOG_ERROR, "Error loading cartridge: %i.\n", error);
             return false;
         }
+
+        bool inserted = gameboy_set_cartridge(gameboy, image);
+        cartridge_image_release(image);
+        if (!inserted) {
+            log_cb(RETRO_LOG_ERROR, "Error inserting cartridge.\n");
+            return false;
+        }
+
+        // A resumed file is removed so a later crash never rolls the game back to it over newer saves
+        set_suspend_path(info->path);
+        if (suspend_enabled && suspend_path[0] != '\0' && gameboy_resume(gameboy, suspend_path)) remove(suspend_path);
+
+        Cartridge * const cart = gameboy->cartridge;
+        if (cart->image->battery && cart->ram_size > 0) {
+            save_ram_mirror = malloc(cart->ram_size);
+            if (save_ram_mirror == NULL) {
+                log_cb(RETRO_LOG_ERROR, "Error allocating save ram.\n");
+                gameboy_set_cartridge(gameboy, NULL);
+                return false;
+            }
+            sync_save_ram();
+        }
+
+        cartridge_rtc_save(gameboy, rtc_data);
+        load_pending = true;
     }
 
     return true;
 }
 
 void retro_unload_game(void) {
+    wait_for_frame();
+    if (suspend_enabled && suspend_path[0] != '\0' && gameboy->cartridge != NULL) gameboy_suspend(gameboy, suspend_path);
     gameboy_set_cartridge(gameboy, NULL);
-    cartridge_delete(cart);
+    free(save_ram_mirror);
+    save_ram_mirror = NULL;
+    save_ram_mirrored = false;
+    load_pending = false;
 }
 
 unsigned retro_get_region(void) {
@@ -188,23 +396,45 @@ bool retro_load_game_special(unsigned type, const struct retro_game_info *info,
 }
 
 size_t retro_serialize_size(void) {
-   return false;
+    wait_for_frame();
+    return gameboy_get_state_size(gameboy);
 }
 
 bool retro_serialize(void *data_, size_t size) {
-    return false;
+    wait_for_frame();
+    return gameboy_save_state(gameboy, data_, size);
 }
 
 bool retro_unserialize(const void *data_, size_t size) {
-    return false;
+    wait_for_frame();
+    return gameboy_load_state(gameboy, data_, size);
 }
 
 void * retro_get_memory_data(unsigned id) {
-    return NULL;
+    if (gameboy->cartridge == NULL || !gameboy->cartridge->image->battery) return NULL;
+    switch (id) {
+        case RETRO_MEMORY_SAVE_RAM:
+            // The frontend may read the pointer at any time, so it never gets the ram the emulation thread writes
+            save_ram_mirrored = pipeline != NULL && save_ram_mirror != NULL;
+            if (save_ram_mirrored) return save_ram_mirror;
+            wait_for_frame();
+            return gameboy->cartridge->ram;
+        case RETRO_MEMORY_RTC:
+            if (!gameboy->cartridge->image->rtc) return NULL;
+            wait_for_frame();
+            if (!load_pending) cartridge_rtc_save(gameboy, rtc_data);
+            return rtc_data;
+        default: return NULL;
+    }
 }
 
 size_t retro_get_memory_size(unsigned id) {
-    return 0;
+    if (gameboy->cartridge == NULL || !gameboy->cartridge->image->battery) return 0;
+    switch (id) {
+        case RETRO_MEMORY_SAVE_RAM: return gameboy->cartridge->ram_size;
+        case RETRO_MEMORY_RTC: return gameboy->cartridge->image->rtc ? CARTRIDGE_RTC_SAVE_SIZE : 0;
+        default: return 0;
+    }
 }
 
 void retro_cheat_reset(void) {
@@ -0,0 +1,47 @@
+#include "memory_map.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+MemoryMap * memory_map_create(void) {
+    MemoryMap * map = calloc(1, sizeof(MemoryMap));
+    if (map != NULL) atomic_init(&map->references, 1);
+    return map;
+}
+
+MemoryMap * memory_map_clone(MemoryMap const * const map) {
+    MemoryMap * clone = malloc(sizeof(MemoryMap));
+    if (clone == NULL) return NULL;
+
+    // The count is live in the other holders, so it is initialized rather than copied
+    atomic_init(&clone->references, 1);
+    memcpy(clone->read_pages, map->read_pages, sizeof(clone->read_pages));
+    memcpy(clone->write_pages, map->write_pages, sizeof(clone->write_pages));
+    memcpy(clone->read_handlers, map->read_handlers, sizeof(clone->read_handlers));
+    memcpy(clone->write_handlers, map->write_handlers, sizeof(clone->write_handlers));
+    return clone;
+}
+
+MemoryMap * memory_map_retain(MemoryMap * const map) {
+    atomic_fetch_add_explicit(&map->references, 1, memory_order_relaxed);
+    return map;
+}
+
+void memory_map_release(MemoryMap * const map) {
+    if (map != NULL && atomic_fetch_sub_explicit(&map->references, 1, memory_order_acq_rel) == 1) free(map);
+}
+
+void memory_map_map_read(MemoryMap * const map, uint8_t first_page, uint8_t last_page, uint8_t const * data, MemoryReadHandler handler) {
+    for (size_t page = first_page; page <= last_page; page++) {
+        map->read_pages[page] = data != NULL ? data + (page - first_page) * MEMORY_MAP_PAGE_SIZE : NULL;
+        map->read_handlers[page] = handler;
+    }
+}
+
+void memory_map_map_write(MemoryMap * const map, uint8_t first_page, uint8_t last_page, uint8_t * data, MemoryWriteHandler handler) {
+    for (size_t page = first_page; page <= last_page; page++) {
+        map->write_pages[page] = data != NULL ? data + (page - first_page) * MEMORY_MAP_PAGE_SIZE : NULL;
+        map->write_handlers[page] = handler;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef TRTLE_MEMORY_MAP_H
+#define TRTLE_MEMORY_MAP_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define MEMORY_MAP_PAGE_SHIFT (8)
+#define MEMORY_MAP_PAGE_SIZE  (1 << MEMORY_MAP_PAGE_SHIFT)
+#define MEMORY_MAP_PAGE_MASK  (MEMORY_MAP_PAGE_SIZE - 1)
+#define MEMORY_MAP_PAGE_COUNT (0x10000 >> MEMORY_MAP_PAGE_SHIFT)
+
+typedef struct GameBoy GameBoy;
+
+typedef uint8_t (*MemoryReadHandler)(GameBoy * const gb, uint16_t address);
+typedef void (*MemoryWriteHandler)(GameBoy * const gb, uint16_t address, uint8_t value);
+
+// Each 256 byte page either points directly at host memory or falls back to a handler.
+// A NULL page pointer means the matching handler must be used for that access.
+typedef struct MemoryMap {
+    uint8_t const * read_pages[MEMORY_MAP_PAGE_COUNT];
+    uint8_t * write_pages[MEMORY_MAP_PAGE_COUNT];
+    MemoryReadHandler read_handlers[MEMORY_MAP_PAGE_COUNT];
+    MemoryWriteHandler write_handlers[MEMORY_MAP_PAGE_COUNT];
+
+    atomic_uint references; // Forks share a map until one of them remaps a window
+} MemoryMap;
+
+MemoryMap * memory_map_create(void);
+MemoryMap * memory_map_clone(MemoryMap const * const map);
+MemoryMap * memory_map_retain(MemoryMap * const map);
+void memory_map_release(MemoryMap * const map);
+
+void memory_map_map_read(MemoryMap * const map, uint8_t first_page, uint8_t last_page, uint8_t const * data, MemoryReadHandler handler);
+
+void memory_map_map_write(MemoryMap * const map, uint8_t first_page, uint8_t last_page, uint8_t * data, MemoryWriteHandler handler);
+
+#endif /* !TRTLE_MEMORY_MAP_H */
@@ -0,0 +1,452 @@
+#include "movie.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cartridge.h"
+#include "logger.h"
+#include "save_file.h"
+
+#define MOVIE_MAGIC         (0x564D5254) // "TRMV"
+#define MOVIE_VERSION       (1)
+#define MOVIE_HEADER_SIZE   (32) // Magic, version, rom hash, frame count, keyframe interval, change and keyframe counts
+#define MOVIE_KEYFRAME_SIZE (29) // Cursor, hash and state size ahead of each embedded state
+#define MOVIE_CHANGE_MAX    (6)  // A 32 bit delta in LEB128 and the mask
+
+// Where a recording or a replay stands in the input stream
+typedef struct MovieCursor {
+    uint32_t frame;       // Next frame to run
+    uint32_t last_change; // Frame of the last change passed, deltas in the stream count from it
+    uint32_t offset;      // Next change in the stream
+    uint8_t input;        // Mask in effect
+} MovieCursor;
+
+typedef struct MovieKeyframe {
+    MovieCursor cursor;
+    uint64_t hash;
+    uint8_t * state;
+    size_t size;
+} MovieKeyframe;
+
+struct Movie {
+    uint64_t rom_hash;
+    uint32_t keyframe_interval;
+    uint32_t frame_count;
+
+    uint8_t * changes; // Frame delta as LEB128 and the new mask, for every frame the input changed on
+    size_t changes_size;
+    size_t changes_capacity;
+    MovieCursor record;
+
+    MovieKeyframe * keyframes; // Keyframe i is at frame i * keyframe_interval
+    size_t keyframe_count;
+    size_t keyframe_capacity;
+
+    MovieCursor play;
+    uint8_t * scratch; // Replayed state, hashed when passing a keyframe
+    size_t scratch_size;
+};
+
+static uint8_t movie_encode_input(GameBoyInput input) {
+    return input.a << 0 | input.b << 1 | input.start << 2 | input.select << 3
+        | input.up << 4 | input.down << 5 | input.left << 6 | input.right << 7;
+}
+
+static GameBoyInput movie_decode_input(uint8_t value) {
+    GameBoyInput input = {
+        value & 0b00000001, value & 0b00000010, value & 0b00000100, value & 0b00001000,
+        value & 0b00010000, value & 0b00100000, value & 0b01000000, value & 0b10000000
+    };
+    return input;
+}
+
+static void movie_put32(uint8_t * data, uint32_t value) {
+    for (int i = 0; i < 4; i++) data[i] = value >> (i * 8);
+}
+
+static void movie_put64(uint8_t * data, uint64_t value) {
+    for (int i = 0; i < 8; i++) data[i] = value >> (i * 8);
+}
+
+static uint32_t movie_get32(uint8_t const * data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)data[i] << (i * 8);
+    return value;
+}
+
+static uint64_t movie_get64(uint8_t const * data) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value |= (uint64_t)data[i] << (i * 8);
+    return value;
+}
+
+static size_t movie_put_varint(uint8_t * data, uint32_t value) {
+    size_t size = 0;
+    for (; value >= 0x80; value >>= 7) data[size++] = value | 0x80;
+    data[size++] = value;
+    return size;
+}
+
+// Returns false on a truncated or overlong value
+static bool movie_get_varint(uint8_t const * data, size_t size, uint32_t * offset, uint32_t * value) {
+    *value = 0;
+    for (int shift = 0; shift < 35 && *offset < size; shift += 7) {
+        uint8_t byte = data[(*offset)++];
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+static uint64_t movie_hash(uint8_t const * data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3;
+    }
+    for (; i < size; i++) hash = (hash ^ data[i]) * 0x100000001B3;
+    return hash;
+}
+
+static uint64_t movie_rom_hash(GameBoy const * const gb) {
+    return gb->cartridge != NULL ? cartridge_image_hash(gb->cartridge->image) : 0;
+}
+
+static bool movie_add_keyframe(Movie * const movie, GameBoy * const gb) {
+    if (movie->keyframe_count == movie->keyframe_capacity) {
+        size_t capacity = movie->keyframe_capacity ? movie->keyframe_capacity * 2 : 16;
+        MovieKeyframe * keyframes = realloc(movie->keyframes, capacity * sizeof(MovieKeyframe));
+        if (keyframes == NULL) return false;
+        movie->keyframes = keyframes;
+        movie->keyframe_capacity = capacity;
+    }
+
+    MovieKeyframe * const keyframe = &movie->keyframes[movie->keyframe_count];
+    keyframe->size = gameboy_get_state_size(gb);
+    keyframe->state = malloc(keyframe->size);
+    if (keyframe->state == NULL) return false;
+
+    gameboy_save_state(gb, keyframe->state, keyframe->size);
+    keyframe->hash = movie_hash(keyframe->state, keyframe->size);
+    keyframe->cursor = movie->record;
+    movie->keyframe_count++;
+    return true;
+}
+
+Movie * movie_create(GameBoy * const gb, uint32_t keyframe_interval) {
+    if (gb == NULL || keyframe_interval == 0) {
+        TRTLE_LOG_ERR("Invalid argument received while creating a movie");
+        return NULL;
+    }
+
+    Movie * movie = calloc(1, sizeof(Movie));
+    if (movie == NULL) return NULL;
+
+    movie->rom_hash = movie_rom_hash(gb);
+    movie->keyframe_interval = keyframe_interval;
+    if (!movie_add_keyframe(movie, gb)) {
+        movie_delete(movie);
+        return NULL;
+    }
+    return movie;
+}
+
+void movie_delete(Movie * movie) {
+    if (movie == NULL) return;
+
+    for (size_t i = 0; i < movie->keyframe_count; i++) free(movie->keyframes[i].state);
+    free(movie->keyframes);
+    free(movie->changes);
+    free(movie->scratch);
+    free(movie);
+}
+
+bool movie_record_frame(Movie * const movie, GameBoy * const gb, GameBoyInput input) {
+    if (movie == NULL || gb == NULL) {
+        TRTLE_LOG_ERR("Null argument received while recording a movie");
+        return false;
+    }
+
+    MovieCursor * const record = &movie->record;
+    if (record->frame == UINT32_MAX) return false;
+    if (record->frame % movie->keyframe_interval == 0 && record->frame != 0 && !movie_add_keyframe(movie, gb)) return false;
+
+    uint8_t value = movie_encode_input(input);
+    if (value != record->input) {
+        if (movie->changes_capacity - movie->changes_size < MOVIE_CHANGE_MAX) {
+            size_t capacity = movie->changes_capacity ? movie->changes_capacity * 2 : 1024;
+            uint8_t * changes = realloc(movie->changes, capacity);
+            if (changes == NULL) return false;
+            movie->changes = changes;
+            movie->changes_capacity = capacity;
+        }
+        movie->changes_size += movie_put_varint(movie->changes + movie->changes_size, record->frame - record->last_change);
+        movie->changes[movie->changes_size++] = value;
+        record->last_change = record->frame;
+        record->offset = movie->changes_size;
+        record->input = value;
+    }
+
+    gameboy_run_frame(gb, input);
+    movie->frame_count = ++record->frame;
+    return true;
+}
+
+// Takes the change due on the cursor's frame, if any, and runs that frame
+static void movie_run_frame(Movie const * const movie, MovieCursor * const cursor, GameBoy * const gb, bool render) {
+    uint32_t offset = cursor->offset;
+    uint32_t delta;
+    if (offset < movie->changes_size && movie_get_varint(movie->changes, movie->changes_size, &offset, &delta)
+        && cursor->last_change + delta == cursor->frame && offset < movie->changes_size) {
+        cursor->input = movie->changes[offset++];
+        cursor->offset = offset;
+        cursor->last_change = cursor->frame;
+    }
+
+    gb->skip_render = !render;
+    gameboy_run_frame(gb, movie_decode_input(cursor->input));
+    cursor->frame++;
+}
+
+static MovieResult movie_load_keyframe(Movie const * const movie, GameBoy * const gb, size_t index, MovieCursor * const cursor) {
+    if (movie_rom_hash(gb) != movie->rom_hash) {
+        TRTLE_LOG_WARN("Attempted to replay a movie recorded on a different rom\n");
+        return MOVIE_ERROR;
+    }
+
+    MovieKeyframe const * const keyframe = &movie->keyframes[index];
+    if (!gameboy_load_state(gb, keyframe->state, keyframe->size)) return MOVIE_ERROR;
+    *cursor = keyframe->cursor;
+    return MOVIE_OK;
+}
+
+static MovieResult movie_check_keyframe(Movie const * const movie, GameBoy * const gb, size_t index, uint8_t * scratch) {
+    MovieKeyframe const * const keyframe = &movie->keyframes[index];
+    if (gameboy_get_state_size(gb) != keyframe->size) return MOVIE_DESYNC;
+
+    gameboy_save_state(gb, scratch, keyframe->size);
+    return movie_hash(scratch, keyframe->size) == keyframe->hash ? MOVIE_OK : MOVIE_DESYNC;
+}
+
+MovieResult movie_seek(Movie * const movie, GameBoy * const gb, uint32_t frame) {
+    if (movie == NULL || gb == NULL) {
+        TRTLE_LOG_ERR("Null argument received while seeking a movie");
+        return MOVIE_ERROR;
+    }
+    if (frame > movie->frame_count) return MOVIE_END;
+
+    size_t index = frame / movie->keyframe_interval;
+    if (index >= movie->keyframe_count) index = movie->keyframe_count - 1;
+    MovieResult result = movie_load_keyframe(movie, gb, index, &movie->play);
+    if (result != MOVIE_OK) return result;
+
+    bool skip_render = gb->skip_render;
+    while (movie->play.frame < frame) movie_run_frame(movie, &movie->play, gb, false);
+    gb->skip_render = skip_render;
+    return MOVIE_OK;
+}
+
+MovieResult movie_play(Movie * const movie, GameBoy * const gb, uint32_t frames) {
+    if (movie == NULL || gb == NULL) {
+        TRTLE_LOG_ERR("Null argument received while playing a movie");
+        return MOVIE_ERROR;
+    }
+
+    bool skip_render = gb->skip_render;
+    MovieResult result = MOVIE_OK;
+    for (uint32_t i = 0; i < frames && result == MOVIE_OK; i++) {
+        MovieCursor * const play = &movie->play;
+        if (play->frame >= movie->frame_count) {
+            result = MOVIE_END;
+            break;
+        }
+
+        size_t index = play->frame / movie->keyframe_interval;
+        if (play->frame % movie->keyframe_interval == 0 && index < movie->keyframe_count) {
+            if (movie->scratch_size < movie->keyframes[index].size) {
+                uint8_t * scratch = realloc(movie->scratch, movie->keyframes[index].size);
+                if (scratch == NULL) {
+                    result = MOVIE_ERROR;
+                    break;
+                }
+                movie->scratch = scratch;
+                movie->scratch_size = movie->keyframes[index].size;
+            }
+            result = movie_check_keyframe(movie, gb, index, movie->scratch);
+            if (result != MOVIE_OK) break;
+        }
+
+        movie_run_frame(movie, play, gb, i + 1 == frames);
+    }
+    gb->skip_render = skip_render;
+    return result;
+}
+
+MovieResult movie_verify_segment(Movie const * const movie, GameBoy * const gb, size_t keyframe) {
+    if (movie == NULL || gb == NULL || keyframe >= movie->keyframe_count) {
+        TRTLE_LOG_ERR("Invalid argument received while verifying a movie");
+        return MOVIE_ERROR;
+    }
+
+    MovieCursor cursor;
+    MovieResult result = movie_load_keyframe(movie, gb, keyframe, &cursor);
+    if (result != MOVIE_OK) return result;
+
+    // The last segment ends with the recording and has nothing to be checked against
+    bool last = keyframe + 1 == movie->keyframe_count;
+    uint32_t end = last ? movie->frame_count : movie->keyframes[keyframe + 1].cursor.frame;
+
+    bool skip_render = gb->skip_render;
+    while (cursor.frame < end) movie_run_frame(movie, &cursor, gb, false);
+    gb->skip_render = skip_render;
+    if (last) return MOVIE_OK;
+
+    uint8_t * scratch = malloc(movie->keyframes[keyframe + 1].size);
+    if (scratch == NULL) return MOVIE_ERROR;
+    result = movie_check_keyframe(movie, gb, keyframe + 1, scratch);
+    free(scratch);
+    return result;
+}
+
+bool movie_save(Movie const * const movie, const char * path) {
+    if (movie == NULL || path == NULL) {
+        TRTLE_LOG_ERR("Null argument received while saving a movie");
+        return false;
+    }
+
+    size_t size = MOVIE_HEADER_SIZE + movie->changes_size;
+    for (size_t i = 0; i < movie->keyframe_count; i++) size += MOVIE_KEYFRAME_SIZE + movie->keyframes[i].size;
+
+    uint8_t * data = malloc(size);
+    if (data == NULL) return false;
+
+    uint8_t * out = data;
+    movie_put32(out, MOVIE_MAGIC);
+    movie_put32(out + 4, MOVIE_VERSION);
+    movie_put64(out + 8, movie->rom_hash);
+    movie_put32(out + 16, movie->frame_count);
+    movie_put32(out + 20, movie->keyframe_interval);
+    movie_put32(out + 24, movie->changes_size);
+    movie_put32(out + 28, movie->keyframe_count);
+    out += MOVIE_HEADER_SIZE;
+    if (movie->changes_size > 0) memcpy(out, movie->changes, movie->changes_size);
+    out += movie->changes_size;
+
+    for (size_t i = 0; i < movie->keyframe_count; i++) {
+        MovieKeyframe const * const keyframe = &movie->keyframes[i];
+        movie_put32(out, keyframe->cursor.frame);
+        movie_put32(out + 4, keyframe->cursor.last_change);
+        movie_put32(out + 8, keyframe->cursor.offset);
+        out[12] = keyframe->cursor.input;
+        movie_put64(out + 13, keyframe->hash);
+        movie_put64(out + 21, keyframe->size);
+        memcpy(out + MOVIE_KEYFRAME_SIZE, keyframe->state, keyframe->size);
+        out += MOVIE_KEYFRAME_SIZE + keyframe->size;
+    }
+
+    bool saved = save_file_write_atomic(path, data, size);
+    free(data);
+    return saved;
+}
+
+// Checks that the change stream decodes to increasing frames within the movie, and picks up recording at its end
+static bool movie_validate_changes(Movie * const movie) {
+    MovieCursor cursor = { 0 };
+    while (cursor.offset < movie->changes_size) {
+        // Only the first change may land on frame zero
+        bool first = cursor.offset == 0;
+        uint32_t delta;
+        if (!movie_get_varint(movie->changes, movie->changes_size, &cursor.offset, &delta)) return false;
+        if (cursor.offset >= movie->changes_size || (delta == 0 && !first)) return false;
+        if ((uint64_t)cursor.last_change + delta >= movie->frame_count) return false;
+        cursor.last_change += delta;
+        cursor.input = movie->changes[cursor.offset++];
+    }
+
+    cursor.frame = movie->frame_count;
+    movie->record = cursor;
+    return true;
+}
+
+static bool movie_parse(Movie * const movie, uint8_t const * data, size_t size) {
+    if (size < MOVIE_HEADER_SIZE || movie_get32(data) != MOVIE_MAGIC || movie_get32(data + 4) != MOVIE_VERSION) return false;
+
+    movie->rom_hash = movie_get64(data + 8);
+    movie->frame_count = movie_get32(data + 16);
+    movie->keyframe_interval = movie_get32(data + 20);
+    movie->changes_size = movie_get32(data + 24);
+    size_t keyframe_count = movie_get32(data + 28);
+    if (movie->keyframe_interval == 0) return false;
+
+    // Recording carries on from a loaded movie, so every keyframe it would have taken so far has to be there
+    uint64_t expected_keyframes = ((uint64_t)movie->frame_count + movie->keyframe_interval - 1) / movie->keyframe_interval;
+    if (keyframe_count != (expected_keyframes > 0 ? expected_keyframes : 1)) return false;
+
+    size_t offset = MOVIE_HEADER_SIZE;
+    if (size - offset < movie->changes_size) return false;
+    movie->changes = malloc(movie->changes_size ? movie->changes_size : 1);
+    movie->keyframes = calloc(keyframe_count, sizeof(MovieKeyframe));
+    if (movie->changes == NULL || movie->keyframes == NULL) return false;
+    movie->changes_capacity = movie->changes_size;
+    movie->keyframe_capacity = keyframe_count;
+    memcpy(movie->changes, data + offset, movie->changes_size);
+    offset += movie->changes_size;
+    if (!movie_validate_changes(movie)) return false;
+
+    for (size_t i = 0; i < keyframe_count; i++) {
+        if (size - offset < MOVIE_KEYFRAME_SIZE) return false;
+        MovieKeyframe * const keyframe = &movie->keyframes[i];
+        uint8_t const * in = data + offset;
+        keyframe->cursor.frame = movie_get32(in);
+        keyframe->cursor.last_change = movie_get32(in + 4);
+        keyframe->cursor.offset = movie_get32(in + 8);
+        keyframe->cursor.input = in[12];
+        keyframe->hash = movie_get64(in + 13);
+        keyframe->size = movie_get64(in + 21);
+        offset += MOVIE_KEYFRAME_SIZE;
+
+        if (keyframe->cursor.frame != i * movie->keyframe_interval || keyframe->cursor.offset > movie->changes_size) return false;
+        if (keyframe->size > size - offset) return false;
+        keyframe->state = malloc(keyframe->size);
+        if (keyframe->state == NULL) return false;
+        memcpy(keyframe->state, data + offset, keyframe->size);
+        offset += keyframe->size;
+        movie->keyframe_count++;
+    }
+    return true;
+}
+
+Movie * movie_load(const char * path) {
+    if (path == NULL) {
+        TRTLE_LOG_ERR("Null argument received while loading a movie");
+        return NULL;
+    }
+
+    size_t size = 0;
+    uint8_t const * data = save_file_map_readonly(path, &size);
+    if (data == NULL) return NULL;
+
+    Movie * movie = calloc(1, sizeof(Movie));
+    if (movie != NULL && !movie_parse(movie, data, size)) {
+        TRTLE_LOG_WARN("Rejected %s, it is not a valid movie\n", path);
+        movie_delete(movie);
+        movie = NULL;
+    }
+
+    save_file_unmap(data, size);
+    return movie;
+}
+
+uint32_t movie_get_frame_count(Movie const * const movie) {
+    return movie->frame_count;
+}
+
+uint32_t movie_get_position(Movie const * const movie) {
+    return movie->play.frame;
+}
+
+size_t movie_get_keyframe_count(Movie const * const movie) {
+    return movie->keyframe_count;
+}
@@ -0,0 +1,45 @@
+#ifndef TRTLE_MOVIE_H
+#define TRTLE_MOVIE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gameboy.h"
+
+typedef struct Movie Movie;
+
+typedef enum MovieResult {
+    MOVIE_OK,
+    MOVIE_END,    // The last recorded frame was reached before the requested one
+    MOVIE_DESYNC, // The replayed state hashed differently from the keyframe recorded at the same frame
+    MOVIE_ERROR,  // The instance runs a different cartridge, or a keyframe could not be loaded
+} MovieResult;
+
+// Records input from the current state of gb on. The input is stored as 8-bit masks at the frames it changes, and
+// every keyframe_interval frames a savestate and its hash are embedded, so seeking only replays up to that many frames.
+Movie * movie_create(GameBoy * const gb, uint32_t keyframe_interval);
+void movie_delete(Movie * movie);
+
+// Runs one frame on gb with input and appends it to the movie
+bool movie_record_frame(Movie * const movie, GameBoy * const gb, GameBoyInput input);
+
+bool movie_save(Movie const * const movie, const char * path);
+Movie * movie_load(const char * path);
+
+// Puts gb at the start of frame, from the keyframe at or before it
+MovieResult movie_seek(Movie * const movie, GameBoy * const gb, uint32_t frame);
+
+// Replays frames from the last seek or play as fast as possible, only drawing the last one.
+// Keyframes passed on the way are checked against the replayed state.
+MovieResult movie_play(Movie * const movie, GameBoy * const gb, uint32_t frames);
+
+// Replays from one keyframe to the next and checks the hash there. The movie is only read,
+// so segments can be verified in parallel, each with its own instance.
+MovieResult movie_verify_segment(Movie const * const movie, GameBoy * const gb, size_t keyframe);
+
+uint32_t movie_get_frame_count(Movie const * const movie);
+uint32_t movie_get_position(Movie const * const movie);
+size_t movie_get_keyframe_count(Movie const * const movie);
+
+#endif /* !TRTLE_MOVIE_H */
@@ -0,0 +1,138 @@
+#include "pipeline.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "logger.h"
+
+#define PIPELINE_BUFFERS    (3)
+#define PIPELINE_INDEX_MASK (0b011)
+#define PIPELINE_FRESH      (0b100) // Set on the latest index while it holds a frame the reader has not taken
+
+struct Pipeline {
+    GameBoy * gb;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    bool pending; // A frame was submitted and has not finished yet
+    bool running;
+    GameBoyInput input;
+
+    // Each buffer is only ever owned by one side, the two trade through latest with a single exchange
+    uint32_t * buffers[PIPELINE_BUFFERS];
+    uint8_t back;  // Drawn into by the emulation thread
+    uint8_t front; // Read by the caller
+    atomic_uint latest;
+    bool shown;
+};
+
+static void * pipeline_thread(void * argument) {
+    Pipeline * const pipeline = argument;
+
+    pthread_mutex_lock(&pipeline->mutex);
+    for (;;) {
+        while (pipeline->running && !pipeline->pending) pthread_cond_wait(&pipeline->start, &pipeline->mutex);
+        if (!pipeline->running) break;
+        GameBoyInput input = pipeline->input;
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        gameboy_run_frame(pipeline->gb, input);
+        gameboy_get_display_data(pipeline->gb, pipeline->buffers[pipeline->back], GAMEBOY_DISPLAY_PIXEL_COUNT);
+        unsigned previous = atomic_exchange_explicit(&pipeline->latest, pipeline->back | PIPELINE_FRESH, memory_order_acq_rel);
+        pipeline->back = previous & PIPELINE_INDEX_MASK;
+
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->pending = false;
+        pthread_cond_broadcast(&pipeline->done);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return NULL;
+}
+
+Pipeline * pipeline_create(GameBoy * const gb) {
+    if (gb == NULL) {
+        TRTLE_LOG_ERR("Attempted to pass a null argument into pipeline_create");
+        return NULL;
+    }
+
+    Pipeline * pipeline = calloc(1, sizeof(Pipeline));
+    if (pipeline == NULL) return NULL;
+
+    pipeline->buffers[0] = calloc(PIPELINE_BUFFERS * GAMEBOY_DISPLAY_PIXEL_COUNT, sizeof(uint32_t));
+    if (pipeline->buffers[0] == NULL) {
+        free(pipeline);
+        return NULL;
+    }
+    for (size_t i = 1; i < PIPELINE_BUFFERS; i++) pipeline->buffers[i] = pipeline->buffers[0] + i * GAMEBOY_DISPLAY_PIXEL_COUNT;
+    pipeline->front = 0;
+    atomic_init(&pipeline->latest, 1);
+    pipeline->back = 2;
+
+    pipeline->gb = gb;
+    pipeline->running = true;
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->start, NULL);
+    pthread_cond_init(&pipeline->done, NULL);
+    if (pthread_create(&pipeline->thread, NULL, pipeline_thread, pipeline) != 0) {
+        TRTLE_LOG_ERR("Failed to start the emulation thread");
+        pthread_cond_destroy(&pipeline->done);
+        pthread_cond_destroy(&pipeline->start);
+        pthread_mutex_destroy(&pipeline->mutex);
+        free(pipeline->buffers[0]);
+        free(pipeline);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+void pipeline_delete(Pipeline * pipeline) {
+    if (pipeline == NULL) return;
+
+    // A frame in flight is finished rather than abandoned, so the instance is never left midway through one
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->pending) pthread_cond_wait(&pipeline->done, &pipeline->mutex);
+    pipeline->running = false;
+    pthread_cond_signal(&pipeline->start);
+    pthread_mutex_unlock(&pipeline->mutex);
+    pthread_join(pipeline->thread, NULL);
+
+    pthread_cond_destroy(&pipeline->done);
+    pthread_cond_destroy(&pipeline->start);
+    pthread_mutex_destroy(&pipeline->mutex);
+    free(pipeline->buffers[0]);
+    free(pipeline);
+}
+
+void pipeline_submit(Pipeline * const pipeline, GameBoyInput input) {
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->pending) pthread_cond_wait(&pipeline->done, &pipeline->mutex);
+    pipeline->input = input;
+    pipeline->pending = true;
+    pthread_cond_signal(&pipeline->start);
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+bool pipeline_is_idle(Pipeline * const pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    bool idle = !pipeline->pending;
+    pthread_mutex_unlock(&pipeline->mutex);
+    return idle;
+}
+
+void pipeline_wait(Pipeline * const pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->pending) pthread_cond_wait(&pipeline->done, &pipeline->mutex);
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+uint32_t const * pipeline_get_frame(Pipeline * const pipeline) {
+    if (atomic_load_explicit(&pipeline->latest, memory_order_acquire) & PIPELINE_FRESH) {
+        unsigned previous = atomic_exchange_explicit(&pipeline->latest, pipeline->front, memory_order_acq_rel);
+        pipeline->front = previous & PIPELINE_INDEX_MASK;
+        pipeline->shown = true;
+    }
+    return pipeline->shown ? pipeline->buffers[pipeline->front] : NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef TRTLE_PIPELINE_H
+#define TRTLE_PIPELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gameboy.h"
+
+typedef struct Pipeline Pipeline;
+
+// Runs an instance's frames on a thread of its own, publishing each finished frame as XRGB pixels through a triple
+// buffer. The emulation thread always has a buffer to draw into and the reader always has the latest whole frame,
+// so neither ever waits on the other just to hand a frame over.
+Pipeline * pipeline_create(GameBoy * const gb);
+void pipeline_delete(Pipeline * pipeline);
+
+// Starts a frame with input held on the emulation thread, first waiting out the one in flight if there is one
+void pipeline_submit(Pipeline * const pipeline, GameBoyInput input);
+// Whether no frame is in flight. The answer only holds on the submitting thread, nothing else starts a frame.
+bool pipeline_is_idle(Pipeline * const pipeline);
+
+// Waits until no frame is in flight. The instance is only safe to touch from another thread between this and the
+// next submit.
+void pipeline_wait(Pipeline * const pipeline);
+
+// The most recently finished frame, NULL before the first one. It stays valid and unchanged until the next call,
+// however many frames finish in the meantime.
+uint32_t const * pipeline_get_frame(Pipeline * const pipeline);
+
+#endif /* !TRTLE_PIPELINE_H */
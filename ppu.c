@@ -1,7 +1,11 @@
 #include "ppu.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "gameboy.h"
 #include "interrupt_controller.h"
+#include "logger.h"
 
 typedef enum LCDCBit {
     LCDC_LCD_ENABLE_BIT           = 0b10000000,
@@ -71,6 +75,41 @@ void ppu_initialize(PPU * const ppu, bool skip_bootrom) {
     ppu->count = 80;
 }
 
+PPUCache * ppu_cache_create(void) {
+    PPUCache * cache = calloc(1, sizeof(PPUCache));
+    if (cache != NULL) atomic_init(&cache->references, 1);
+    return cache;
+}
+
+PPUCache * ppu_cache_retain(PPUCache * cache) {
+    atomic_fetch_add_explicit(&cache->references, 1, memory_order_relaxed);
+    return cache;
+}
+
+void ppu_cache_release(PPUCache * cache) {
+    if (cache != NULL && atomic_fetch_sub_explicit(&cache->references, 1, memory_order_acq_rel) == 1) free(cache);
+}
+
+// Gives the instance its own copy of a cache it still shares with a fork, before writing to it
+static bool ppu_own_cache(GameBoy * const gb) {
+    PPUCache * cache = gb->ppu_cache;
+    if (atomic_load_explicit(&cache->references, memory_order_acquire) == 1) return true;
+
+    PPUCache * copy = malloc(sizeof(PPUCache));
+    if (copy == NULL) {
+        TRTLE_LOG_ERR("Failed to allocate a private ppu cache");
+        return false;
+    }
+
+    atomic_init(&copy->references, 1);
+    memcpy(copy->tile_buffer, cache->tile_buffer, sizeof(copy->tile_buffer));
+    memcpy(copy->decoded_vram, cache->decoded_vram, sizeof(copy->decoded_vram));
+    memcpy(copy->display_buffer, cache->display_buffer, sizeof(copy->display_buffer));
+    ppu_cache_release(cache);
+    gb->ppu_cache = copy;
+    return true;
+}
+
 size_t scx_cycle_offsets[] = {
     0, 1, 1, 1, 1, 2, 2, 2
 };
@@ -89,6 +128,7 @@ static void ppu_vblank_enter(GameBoy * const gb) {
     gb->ppu->window_internal_line = 0;
 
     gb->interrupt_controller->flags |= VBLANK_INTERRUPT_BIT;
+    gameboy_signal(gb, GAMEBOY_EVENT_VBLANK);
     if ((gb->ppu->stat & STAT_VBLANK_CHECK_ENABLE) || (gb->ppu->stat & STAT_OAM_SEARCH_CHECK_ENABLE)) {
         gb->interrupt_controller->flags |= LCD_STAT_INTERRUPT_BIT;
     }
@@ -123,40 +163,56 @@ static void ppu_compare_ly_lyc(GameBoy * const gb) {
 }
 
 static void ppu_draw_line(GameBoy * const gb) {
+    // LY can be written directly, so guard the framebuffer against lines past the display
+    if (gb->ppu->ly >= PPU_DISPLAY_HEIGHT) return;
+
+    bool window_visible = (gb->ppu->lcdc & LCDC_WINDOW_ENABLE_BIT) && gb->ppu->wy <= gb->ppu->ly && gb->ppu->wx - 7 <= 0xA6;
+    if (gb->skip_render) {
+        // The window line counter is machine state, so it advances even when nothing is drawn
+        if (window_visible) gb->ppu->window_internal_line++;
+        return;
+    }
+    if (!ppu_own_cache(gb)) return;
+
     if (gb->ppu->lcdc & LCDC_BG_ENABLE_BIT) {
         uint8_t background_row = gb->ppu->scy + gb->ppu->ly;
+        uint16_t map_offset = (gb->ppu->lcdc & LCDC_BG_MAP_BIT) ? PPU_BACKGROUND2_START : PPU_BACKGROUND1_START;
+        map_offset += (background_row / 8) * PPU_BG_WIDTH_IN_TILES;
+        // A row of the map never crosses a page
+        uint8_t const * map_row = gameboy_get_page(gb, GAMEBOY_VRAM_PAGE + map_offset / GAMEBOY_PAGE_SIZE) + map_offset % GAMEBOY_PAGE_SIZE;
         for (size_t i = 0; i < GAMEBOY_DISPLAY_WIDTH; i++) {
             uint8_t background_column = gb->ppu->scx + i;
 
-            uint16_t map_offset = (gb->ppu->lcdc & LCDC_BG_MAP_BIT) ? PPU_BACKGROUND2_START : PPU_BACKGROUND1_START;
-            uint16_t tile_id = gb->ppu->vram[map_offset + (background_column / 8) + (background_row / 8) * PPU_BG_WIDTH_IN_TILES];
+            uint16_t tile_id = map_row[background_column / 8];
             tile_id = (gb->ppu->lcdc & LCDC_BG_WINDOW_MODE_BIT) ? tile_id : tile_id + (256 * (uint_fast16_t)(tile_id < 128));
 
-            uint8_t color = gb->ppu->tile_buffer[tile_id][background_row % 8][background_column % 8];
+            uint8_t color = gb->ppu_cache->tile_buffer[tile_id][background_row % 8][background_column % 8];
             uint8_t offset = color * 2;
             uint8_t bits = 0b00000011 << offset;
             color = (gb->ppu->bgp & bits) >> offset;
 
-            gb->ppu->display_buffer[i + (size_t)gb->ppu->ly * GAMEBOY_DISPLAY_WIDTH] = color;
+            gb->ppu_cache->display_buffer[i + (size_t)gb->ppu->ly * GAMEBOY_DISPLAY_WIDTH] = color;
         }
     }
 
-    if ((gb->ppu->lcdc & LCDC_WINDOW_ENABLE_BIT) && gb->ppu->wy <= gb->ppu->ly && gb->ppu->wx - 7 <= 0xA6) {
+    if (window_visible) {
         uint8_t wx = gb->ppu->wx - 7;
         uint16_t map_offset = (gb->ppu->lcdc & LCDC_WINDOW_MAP_BIT) ? PPU_BACKGROUND2_START : PPU_BACKGROUND1_START;
+        map_offset += (gb->ppu->window_internal_line / 8) * PPU_BG_WIDTH_IN_TILES;
+        uint8_t const * map_row = gameboy_get_page(gb, GAMEBOY_VRAM_PAGE + map_offset / GAMEBOY_PAGE_SIZE) + map_offset % GAMEBOY_PAGE_SIZE;
         for (size_t i = wx; i < GAMEBOY_DISPLAY_WIDTH; i++) {
             uint8_t window_column = gb->ppu->scx + i;
             if (window_column >= wx) window_column = i - wx;
 
-            uint16_t tile_id = gb->ppu->vram[map_offset + (window_column / 8) + (gb->ppu->window_internal_line / 8) * PPU_BG_WIDTH_IN_TILES];
+            uint16_t tile_id = map_row[window_column / 8];
             tile_id = (gb->ppu->lcdc & LCDC_BG_WINDOW_MODE_BIT) ? tile_id : tile_id + (256 * (uint_fast16_t)(tile_id < 128));
 
-            uint8_t color = gb->ppu->tile_buffer[tile_id][gb->ppu->window_internal_line % 8][window_column % 8];
+            uint8_t color = gb->ppu_cache->tile_buffer[tile_id][gb->ppu->window_internal_line % 8][window_column % 8];
             uint8_t offset = color * 2;
             uint8_t bits = 0b00000011 << offset;
             color = (gb->ppu->bgp & bits) >> offset;
 
-            gb->ppu->display_buffer[i + (size_t)gb->ppu->ly * GAMEBOY_DISPLAY_WIDTH] = color;
+            gb->ppu_cache->display_buffer[i + (size_t)gb->ppu->ly * GAMEBOY_DISPLAY_WIDTH] = color;
         }
         gb->ppu->window_internal_line++;
     }
@@ -168,9 +224,9 @@ static void ppu_draw_line(GameBoy * const gb) {
         size_t sprite_count = 0;
 
         for (size_t i = 0; i < 40; i++) {
-            int32_t sprite_y = gb->ppu->oam[i * 4] - 16;
+            int32_t sprite_y = gb->memory->oam[i * 4] - 16;
             if (sprite_y <= gb->ppu->ly && (gb->ppu->ly - sprite_y) < sprite_size) {
-                for (size_t k = 0; k < 4; k++) sprites[sprite_count][k] = gb->ppu->oam[i * 4 + k];
+                for (size_t k = 0; k < 4; k++) sprites[sprite_count][k] = gb->memory->oam[i * 4 + k];
                 if (++sprite_count == 10) break;
             }
         }
@@ -219,14 +275,14 @@ static void ppu_draw_line(GameBoy * const gb) {
             for (size_t tile_column = 0; tile_column < 8; tile_column++) {
                 if (sprite_x + tile_column < 0 || sprite_x + tile_column > GAMEBOY_DISPLAY_WIDTH - 1) continue;
 
-                uint8_t color = gb->ppu->tile_buffer[tile_id][tile_row & 0x7][flip_x ? 7 - tile_column : tile_column];
+                uint8_t color = gb->ppu_cache->tile_buffer[tile_id][tile_row & 0x7][flip_x ? 7 - tile_column : tile_column];
 
-                if (color != 0 && (!priority || (priority && (gb->ppu->display_buffer[(sprite_x + tile_column) + (size_t)gb->ppu->ly * GAMEBOY_DISPLAY_WIDTH] == 0)))) {
+                if (color != 0 && (!priority || (priority && (gb->ppu_cache->display_buffer[(sprite_x + tile_column) + (size_t)gb->ppu->ly * GAMEBOY_DISPLAY_WIDTH] == 0)))) {
                     uint8_t offset = color * 2;
                     uint8_t bits = 0b00000011 << offset;
                     uint8_t palette = (sprite_a >> 4) & 1 ? gb->ppu->obp1 : gb->ppu->obp0;
                     color = (palette & bits) >> offset;
-                    gb->ppu->display_buffer[sprite_x + tile_column + (size_t)gb->ppu->ly * GAMEBOY_DISPLAY_WIDTH] = color;
+                    gb->ppu_cache->display_buffer[sprite_x + tile_column + (size_t)gb->ppu->ly * GAMEBOY_DISPLAY_WIDTH] = color;
                 }
             }
         }
@@ -293,38 +349,70 @@ void ppu_write_stat(GameBoy * const gb, uint8_t value) {
 }
 
 uint8_t ppu_read_oam(GameBoy const * const gb, uint16_t address) {
-    return gb->ppu->oam[address];
+    return gb->memory->oam[address];
 }
 
 void ppu_write_oam(GameBoy * const gb, uint16_t address, uint8_t value) {
     if ((gb->ppu->stat & STAT_MODE_BITS) == GRAPHICS_MODE_DATA_TRANSFER) return;
     if ((gb->ppu->stat & STAT_MODE_BITS) == GRAPHICS_MODE_OAM_SEARCH) return;
-    gb->ppu->oam[address] = value;
+    gb->memory->oam[address] = value;
 }
 
 uint8_t ppu_read_vram(GameBoy const * const gb, uint16_t address) {
-    return gb->ppu->vram[address];
+    return gameboy_read_vram(gb, address);
 }
 
-void ppu_write_vram(GameBoy * const gb, uint16_t address, uint8_t value) {
-    gb->ppu->vram[address] = value;
-    if (address < 0x1800) {
-        uint8_t byte1 = gb->ppu->vram[(address & 0xFFFE)];
-        uint8_t byte2 = gb->ppu->vram[(address & 0xFFFE) + 1];
+// Each byte of a tile row spread out to one bit per pixel, leftmost pixel first
+#define PPU_SPREAD(b) { ((b) >> 7) & 1, ((b) >> 6) & 1, ((b) >> 5) & 1, ((b) >> 4) & 1, ((b) >> 3) & 1, ((b) >> 2) & 1, ((b) >> 1) & 1, (b) & 1 }
+#define PPU_SPREAD4(b) PPU_SPREAD(b), PPU_SPREAD((b) + 1), PPU_SPREAD((b) + 2), PPU_SPREAD((b) + 3)
+#define PPU_SPREAD16(b) PPU_SPREAD4(b), PPU_SPREAD4((b) + 4), PPU_SPREAD4((b) + 8), PPU_SPREAD4((b) + 12)
+#define PPU_SPREAD64(b) PPU_SPREAD16(b), PPU_SPREAD16((b) + 16), PPU_SPREAD16((b) + 32), PPU_SPREAD16((b) + 48)
 
-        size_t tile = address / PPU_BYTES_PER_TILE;
-        size_t row = (address % PPU_BYTES_PER_TILE) / PPU_BYTES_PER_ROW;
+static const uint8_t ppu_spread[256][PPU_PIXELS_PER_TILE_ROW] = {
+    PPU_SPREAD64(0), PPU_SPREAD64(64), PPU_SPREAD64(128), PPU_SPREAD64(192)
+};
 
-        for (size_t pixel = 0; pixel < PPU_PIXELS_PER_TILE_ROW; pixel++) {
-            uint8_t mask = 1 << (7 - pixel);
-            uint8_t bit1 = byte1 & mask;
-            uint8_t bit2 = byte2 & mask;
+static void ppu_decode_tile_row(GameBoy * const gb, uint16_t address) {
+    uint8_t const * low = ppu_spread[gameboy_read_vram(gb, address & 0xFFFE)];
+    uint8_t const * high = ppu_spread[gameboy_read_vram(gb, (address & 0xFFFE) + 1)];
 
-            uint8_t color_code;
-            if (bit1) color_code = bit2 ? 3 : 1;
-            else color_code = bit2 ? 2 : 0;
+    size_t tile = address / PPU_BYTES_PER_TILE;
+    size_t row = (address % PPU_BYTES_PER_TILE) / PPU_BYTES_PER_ROW;
 
-            gb->ppu->tile_buffer[tile][row][pixel] = color_code;
+    // Every pixel is 0 or 1 so the whole row can be combined as one word without carrying between pixels
+    uint64_t low_bits, high_bits;
+    memcpy(&low_bits, low, sizeof(low_bits));
+    memcpy(&high_bits, high, sizeof(high_bits));
+    uint64_t pixels = low_bits | (high_bits << 1);
+    memcpy(gb->ppu_cache->tile_buffer[tile][row], &pixels, sizeof(pixels));
+}
+
+void ppu_write_vram(GameBoy * const gb, uint16_t address, uint8_t value) {
+    uint8_t * page = gameboy_own_page(gb, GAMEBOY_VRAM_PAGE + address / GAMEBOY_PAGE_SIZE);
+    if (page == NULL) return;
+
+    page[address % GAMEBOY_PAGE_SIZE] = value;
+    if (address < 0x1800 && gb->ppu_cache->decoded_vram[address] != value && ppu_own_cache(gb)) {
+        gb->ppu_cache->decoded_vram[address] = value;
+        ppu_decode_tile_row(gb, address);
+    }
+}
+
+void ppu_rebuild_tiles(GameBoy * const gb) {
+    ppu_rebuild_tile_range(gb, 0, 0x1800);
+}
+
+// Only tiles whose vram differs from the cache are decoded, so restoring a few pages stays cheap
+void ppu_rebuild_tile_range(GameBoy * const gb, uint16_t address, uint16_t length) {
+    uint16_t end = address + length < 0x1800 ? address + length : 0x1800;
+    for (address -= address % PPU_BYTES_PER_TILE; address < end; address += PPU_BYTES_PER_TILE) {
+        uint8_t const * tile = gameboy_get_page(gb, GAMEBOY_VRAM_PAGE + address / GAMEBOY_PAGE_SIZE) + address % GAMEBOY_PAGE_SIZE;
+        if (memcmp(tile, &gb->ppu_cache->decoded_vram[address], PPU_BYTES_PER_TILE) == 0) continue;
+        if (!ppu_own_cache(gb)) return;
+
+        memcpy(&gb->ppu_cache->decoded_vram[address], tile, PPU_BYTES_PER_TILE);
+        for (uint16_t row = 0; row < PPU_BYTES_PER_TILE; row += PPU_BYTES_PER_ROW) {
+            ppu_decode_tile_row(gb, address + row);
         }
     }
 }
@@ -352,10 +440,10 @@ size_t ppu_get_background_data(GameBoy const * const gb, uint32_t * data, size_t
             for (size_t pixel = 0; pixel < PPU_PIXELS_PER_TILE_ROW; pixel++) {
                 size_t x = (tile % PPU_BG_WIDTH_IN_TILES) * PPU_PIXELS_PER_TILE_ROW + pixel;
 
-                uint_fast16_t tile_id = gb->ppu->vram[PPU_BACKGROUND1_START + tile];
+                uint_fast16_t tile_id = gameboy_read_vram(gb, PPU_BACKGROUND1_START + tile);
                 tile_id = (gb->ppu->lcdc & LCDC_BG_WINDOW_MODE_BIT) ? tile_id : tile_id + (256 * (uint_fast16_t)(tile_id < 128));
 
-                data[x + y * PPU_BG_WIDTH_IN_PIXELS] = gb->ppu->tile_buffer[tile_id][row][pixel];
+                data[x + y * PPU_BG_WIDTH_IN_PIXELS] = gb->ppu_cache->tile_buffer[tile_id][row][pixel];
                 if (x + y * PPU_BG_WIDTH_IN_PIXELS == length) return length;
             }
         }
@@ -365,7 +453,7 @@ size_t ppu_get_background_data(GameBoy const * const gb, uint32_t * data, size_t
 
 size_t ppu_get_display_data(GameBoy const * const gb, uint32_t * data, size_t length) {
     for (size_t x = 0; x < PPU_DISPLAY_WIDTH * PPU_DISPLAY_HEIGHT; x++) {
-        if (gb->ppu->lcdc & LCDC_LCD_ENABLE_BIT) data[x] = get_pixel_color(gb->ppu->display_buffer[x]);
+        if (gb->ppu->lcdc & LCDC_LCD_ENABLE_BIT) data[x] = get_pixel_color(gb->ppu_cache->display_buffer[x]);
         else data[x] = get_pixel_color(PPU_LCD_COLOR_CODE);
 
         if (x == length) return length;
@@ -373,6 +461,23 @@ size_t ppu_get_display_data(GameBoy const * const gb, uint32_t * data, size_t le
     return PPU_DISPLAY_WIDTH * PPU_DISPLAY_HEIGHT;
 }
 
+size_t ppu_get_display_shades(GameBoy const * const gb, uint8_t * data, size_t length) {
+    size_t count = PPU_DISPLAY_WIDTH * PPU_DISPLAY_HEIGHT / 4;
+    if (length < count) count = length;
+
+    // The LCD off color has no shade of its own, it reads as the lightest
+    if (!(gb->ppu->lcdc & LCDC_LCD_ENABLE_BIT)) {
+        memset(data, 0, count);
+        return count;
+    }
+
+    uint8_t const * pixels = gb->ppu_cache->display_buffer;
+    for (size_t i = 0; i < count; i++, pixels += 4) {
+        data[i] = pixels[0] << 6 | pixels[1] << 4 | pixels[2] << 2 | pixels[3];
+    }
+    return count;
+}
+
 size_t ppu_get_tileset_data(GameBoy const * const gb, uint32_t * data, size_t length) {
     for (size_t tile = 0; tile < PPU_TS_TILE_COUNT; tile++) {
         for (size_t row = 0; row < PPU_ROWS_PER_TILE; row++) {
@@ -380,7 +485,7 @@ size_t ppu_get_tileset_data(GameBoy const * const gb, uint32_t * data, size_t le
             for (size_t pixel = 0; pixel < PPU_PIXELS_PER_TILE_ROW; pixel++) {
                 size_t x = (tile % PPU_TS_WIDTH_IN_TILES) * PPU_PIXELS_PER_TILE_ROW + pixel;
 
-                data[x + y * PPU_TS_WIDTH_IN_PIXELS] = gb->ppu->tile_buffer[tile][row][pixel];
+                data[x + y * PPU_TS_WIDTH_IN_PIXELS] = gb->ppu_cache->tile_buffer[tile][row][pixel];
                 if (x + y * PPU_TS_WIDTH_IN_PIXELS == length) return length;
             }
         }
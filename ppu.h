@@ -1,7 +1,9 @@
 #ifndef TRTLE_PPU_H
 #define TRTLE_PPU_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define PPU_ROWS_PER_TILE       (8)
@@ -41,19 +43,25 @@ typedef struct PPU {
     uint8_t obp1;
     uint8_t wy;
     uint8_t wx;
-    uint8_t oam[0xA0];
-    uint8_t vram[0x2000];
 
     uint8_t window_internal_line;
+    uint32_t count;
+} PPU;
 
+// Derived from vram and the registers, rebuilt rather than saved
+typedef struct PPUCache {
+    atomic_uint references; // Forks share the cache until one of them draws or decodes a tile
     uint8_t tile_buffer[PPU_TS_TILE_COUNT][PPU_ROWS_PER_TILE][PPU_PIXELS_PER_TILE_ROW];
+    uint8_t decoded_vram[0x1800]; // Tile data as of the last decode, so a rebuild only touches changed tiles
     uint8_t display_buffer[PPU_DISPLAY_WIDTH * PPU_DISPLAY_HEIGHT];
-
-    size_t count;
-} PPU;
+} PPUCache;
 
 void ppu_initialize(PPU * const ppu, bool skip_bootrom);
 
+PPUCache * ppu_cache_create(void);
+PPUCache * ppu_cache_retain(PPUCache * cache);
+void ppu_cache_release(PPUCache * cache);
+
 void ppu_cycle(GameBoy * const gb);
 
 uint8_t ppu_read_lcdc(GameBoy const * const gb);
@@ -67,11 +75,14 @@ void ppu_write_oam(GameBoy * const gb, uint16_t address, uint8_t value);
 
 uint8_t ppu_read_vram(GameBoy const * const gb, uint16_t address);
 void ppu_write_vram(GameBoy * const gb, uint16_t address, uint8_t value);
+void ppu_rebuild_tiles(GameBoy * const gb);
+void ppu_rebuild_tile_range(GameBoy * const gb, uint16_t address, uint16_t length);
 
 GraphicsMode ppu_get_mode(GameBoy const * const gb);
 
 size_t ppu_get_background_data(GameBoy const* const gb, uint32_t data[], size_t length);
 size_t ppu_get_display_data(GameBoy const* const gb, uint32_t data[], size_t length);
+size_t ppu_get_display_shades(GameBoy const * const gb, uint8_t data[], size_t length);
 size_t ppu_get_tileset_data(GameBoy const * const gb, uint32_t data[], size_t length);
 
 #endif /* !TRTLE_PPU_H */
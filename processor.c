@@ -2,6 +2,7 @@
 
 #include "gameboy.h"
 #include "interrupt_controller.h"
+#include "joypad.h"
 #include "logger.h"
 
 #define INTERRUPT_FLAGS_ADDRESS  (0xFF0F)
@@ -20,6 +21,7 @@ void processor_initialize(Processor * const p, bool skip_bootrom) {
     p->sp = 0xFFFE;
     p->pc = skip_bootrom ? 0x0100 : 0x0000;
     p->halt_mode = false;
+    p->stop_mode = false;
     p->skip_pc_increment = false;
     p->skip_next_interrupt = false;
 }
@@ -826,7 +828,9 @@ static void halt(GameBoy * const gb) {
 }
 
 static void stop(GameBoy * const gb) {
-    TRTLE_LOG_ERR("Stop called and not implemented\n");
+    gb->processor->pc += 1;
+    gb->processor->halt_mode = true;
+    gb->processor->stop_mode = true;
 }
 
 static void di(GameBoy * const gb) {
@@ -1293,10 +1297,20 @@ static void (*instructions[])(GameBoy * const gb) = {
 
 void processor_process_instruction(GameBoy * const gb) {
     if (gb->processor->halt_mode) {
-        uint8_t interrupts = gb->interrupt_controller->flags & gb->interrupt_controller->enables & 0x1F;
-        if (interrupts == 0) {
-            gameboy_cycle(gb);
-            return; // Notice this and don't reorder it
+        if (gb->processor->stop_mode) {
+            // The system clock is stopped until a selected button is held, only the cartridge clock keeps time
+            if (!joypad_is_pressed(gb)) {
+                gb->cycles += 4;
+                return;
+            }
+            gb->processor->stop_mode = false;
+        }
+        else {
+            uint8_t interrupts = gb->interrupt_controller->flags & gb->interrupt_controller->enables & 0x1F;
+            if (interrupts == 0) {
+                gameboy_cycle(gb);
+                return; // Notice this and don't reorder it
+            }
         }
         gb->processor->halt_mode = false;
     }
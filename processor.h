@@ -59,9 +59,8 @@ typedef struct Processor {
     };
     uint16_t sp;
     uint16_t pc;
-    uint8_t ram[8192];
-    uint8_t hram[0x7F];
     bool halt_mode;
+    bool stop_mode; // Set with halt_mode, so only the halt check stands in the way of normal execution
     bool skip_pc_increment;
     bool skip_next_interrupt;
 } Processor;
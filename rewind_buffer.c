@@ -0,0 +1,294 @@
+#include "rewind_buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gameboy.h"
+#include "logger.h"
+
+typedef struct RewindEntry {
+    size_t offset;
+    size_t size;
+    bool keyframe;
+} RewindEntry;
+
+struct RewindBuffer {
+    uint32_t interval;
+    uint32_t keyframe_interval;
+    uint32_t frames;
+    uint64_t serial; // Captures taken so far, numbers entries for keyframe placement
+
+    // The newest capture, uncompressed, plus scratch space for the next one and for encoding
+    uint64_t * current;
+    uint64_t * next;
+    uint8_t * encoded;
+    size_t state_size;
+    size_t words;
+    bool has_current;
+
+    // Encoded entries, oldest first, in a ring of budget bytes
+    uint8_t * data;
+    size_t budget;
+    size_t write;
+
+    RewindEntry * entries;
+    size_t first;
+    size_t count;
+    size_t capacity;
+};
+
+static size_t rewind_write_varint(uint8_t * out, size_t value) {
+    size_t length = 0;
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        out[length++] = byte | (value ? 0x80 : 0);
+    } while (value);
+    return length;
+}
+
+static size_t rewind_read_varint(uint8_t const * in, size_t * value) {
+    size_t length = 0;
+    size_t shift = 0;
+    *value = 0;
+    do {
+        *value |= (size_t)(in[length] & 0x7F) << shift;
+        shift += 7;
+    } while (in[length++] & 0x80);
+    return length;
+}
+
+// Runs of identical words become a skip count, the rest are stored as their XOR so decoding is the same for both directions
+static size_t rewind_encode(uint64_t const * a, uint64_t const * b, size_t words, uint8_t * out) {
+    size_t length = 0;
+    size_t i = 0;
+    while (i < words) {
+        size_t start = i;
+        while (i < words && a[i] == (b ? b[i] : 0)) i++;
+        length += rewind_write_varint(out + length, i - start);
+
+        start = i;
+        while (i < words && a[i] != (b ? b[i] : 0)) i++;
+        length += rewind_write_varint(out + length, i - start);
+        for (size_t k = start; k < i; k++) {
+            uint64_t word = a[k] ^ (b ? b[k] : 0);
+            memcpy(out + length, &word, sizeof(word));
+            length += sizeof(word);
+        }
+    }
+    return length;
+}
+
+static void rewind_decode(uint64_t * state, uint8_t const * in, size_t size) {
+    size_t position = 0;
+    size_t i = 0;
+    while (position < size) {
+        size_t skip, literals;
+        position += rewind_read_varint(in + position, &skip);
+        position += rewind_read_varint(in + position, &literals);
+        i += skip;
+        for (size_t k = 0; k < literals; k++, i++) {
+            uint64_t word;
+            memcpy(&word, in + position, sizeof(word));
+            state[i] ^= word;
+            position += sizeof(word);
+        }
+    }
+}
+
+RewindBuffer * rewind_buffer_create(size_t budget, uint32_t interval, uint32_t keyframe_interval) {
+    RewindBuffer * rewind = calloc(1, sizeof(RewindBuffer));
+    if (rewind == NULL) return NULL;
+
+    rewind->data = malloc(budget);
+    if (rewind->data == NULL) {
+        free(rewind);
+        return NULL;
+    }
+
+    rewind->budget = budget;
+    rewind->interval = interval > 0 ? interval : 1;
+    rewind->keyframe_interval = keyframe_interval;
+    return rewind;
+}
+
+void rewind_buffer_delete(RewindBuffer * rewind) {
+    if (rewind != NULL) {
+        free(rewind->current);
+        free(rewind->next);
+        free(rewind->encoded);
+        free(rewind->data);
+        free(rewind->entries);
+        free(rewind);
+    }
+}
+
+void rewind_buffer_clear(RewindBuffer * rewind) {
+    rewind->frames = 0;
+    rewind->serial = 0;
+    rewind->has_current = false;
+    rewind->write = 0;
+    rewind->first = 0;
+    rewind->count = 0;
+}
+
+static RewindEntry * rewind_get_entry(RewindBuffer const * rewind, size_t index) {
+    return &rewind->entries[(rewind->first + index) % rewind->capacity];
+}
+
+static void rewind_drop_oldest(RewindBuffer * rewind) {
+    rewind->first = (rewind->first + 1) % rewind->capacity;
+    if (--rewind->count == 0) {
+        rewind->first = 0;
+        rewind->write = 0;
+    }
+}
+
+// Finds room for size bytes after the newest entry, evicting from the oldest end until it fits
+static bool rewind_reserve(RewindBuffer * rewind, size_t size, size_t * offset) {
+    if (size > rewind->budget) return false;
+
+    while (rewind->count > 0) {
+        size_t tail = rewind_get_entry(rewind, 0)->offset;
+        if (rewind->write > tail) {
+            if (rewind->write + size <= rewind->budget) break;
+            if (size <= tail) {
+                rewind->write = 0;
+                break;
+            }
+        }
+        else if (rewind->write + size <= tail) break;
+        rewind_drop_oldest(rewind);
+    }
+
+    if (rewind->count == rewind->capacity) {
+        size_t capacity = rewind->capacity ? rewind->capacity * 2 : 256;
+        RewindEntry * entries = malloc(capacity * sizeof(RewindEntry));
+        if (entries == NULL) return false;
+        for (size_t i = 0; i < rewind->count; i++) entries[i] = *rewind_get_entry(rewind, i);
+        free(rewind->entries);
+        rewind->entries = entries;
+        rewind->capacity = capacity;
+        rewind->first = 0;
+    }
+
+    *offset = rewind->write;
+    return true;
+}
+
+static bool rewind_resize(RewindBuffer * rewind, size_t state_size) {
+    size_t words = (state_size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    uint64_t * current = calloc(words, sizeof(uint64_t));
+    uint64_t * next = calloc(words, sizeof(uint64_t));
+    // Worst case every word is a literal, plus the two run headers
+    uint8_t * encoded = malloc(words * sizeof(uint64_t) + 32);
+    if (current == NULL || next == NULL || encoded == NULL) {
+        free(current);
+        free(next);
+        free(encoded);
+        return false;
+    }
+
+    free(rewind->current);
+    free(rewind->next);
+    free(rewind->encoded);
+    rewind->current = current;
+    rewind->next = next;
+    rewind->encoded = encoded;
+    rewind->state_size = state_size;
+    rewind->words = words;
+    rewind_buffer_clear(rewind);
+    return true;
+}
+
+bool rewind_buffer_push(RewindBuffer * rewind, GameBoy * const gb) {
+    if (rewind->frames++ % rewind->interval != 0) return true;
+
+    size_t state_size = gameboy_get_state_size(gb);
+    if (state_size != rewind->state_size && !rewind_resize(rewind, state_size)) return false;
+
+    if (!gameboy_save_state(gb, rewind->next, state_size)) return false;
+    if (rewind->has_current) {
+        // The entry for the previous capture describes how to get back to it from this one
+        bool keyframe = rewind->keyframe_interval > 0 && (rewind->serial - 1) % rewind->keyframe_interval == 0;
+        size_t size = rewind_encode(rewind->current, keyframe ? NULL : rewind->next, rewind->words, rewind->encoded);
+
+        size_t offset;
+        if (!rewind_reserve(rewind, size, &offset)) {
+            TRTLE_LOG_WARN("Rewind entry of %zu bytes does not fit the buffer\n", size);
+            rewind_buffer_clear(rewind);
+        }
+        else {
+            memcpy(rewind->data + offset, rewind->encoded, size);
+            rewind->write = offset + size;
+            *rewind_get_entry(rewind, rewind->count++) = (RewindEntry){ offset, size, keyframe };
+        }
+    }
+
+    uint64_t * swap = rewind->current;
+    rewind->current = rewind->next;
+    rewind->next = swap;
+    rewind->has_current = true;
+    rewind->serial++;
+    return true;
+}
+
+bool rewind_buffer_seek(RewindBuffer * rewind, GameBoy * const gb, size_t steps) {
+    if (!rewind->has_current || steps > rewind->count) return false;
+
+    // Start from the closest keyframe at or after the target, or from the newest capture
+    size_t target = rewind->count - steps;
+    size_t start = rewind->count;
+    for (size_t i = target; i < rewind->count; i++) {
+        if (rewind_get_entry(rewind, i)->keyframe) {
+            start = i;
+            break;
+        }
+    }
+
+    if (start < rewind->count) {
+        RewindEntry const * entry = rewind_get_entry(rewind, start);
+        memset(rewind->next, 0, rewind->words * sizeof(uint64_t));
+        rewind_decode(rewind->next, rewind->data + entry->offset, entry->size);
+    }
+    else memcpy(rewind->next, rewind->current, rewind->words * sizeof(uint64_t));
+
+    for (size_t i = start; i > target; i--) {
+        RewindEntry const * entry = rewind_get_entry(rewind, i - 1);
+        if (entry->keyframe) memset(rewind->next, 0, rewind->words * sizeof(uint64_t));
+        rewind_decode(rewind->next, rewind->data + entry->offset, entry->size);
+    }
+
+    if (!gameboy_load_state(gb, rewind->next, rewind->state_size)) return false;
+
+    // The target becomes the newest capture, so its own entry and everything after it go away
+    uint64_t * swap = rewind->current;
+    rewind->current = rewind->next;
+    rewind->next = swap;
+    rewind->count = target;
+    rewind->serial -= steps;
+    if (rewind->count == 0) {
+        rewind->first = 0;
+        rewind->write = 0;
+    }
+    else {
+        RewindEntry const * newest = rewind_get_entry(rewind, rewind->count - 1);
+        rewind->write = newest->offset + newest->size;
+    }
+    rewind->frames = 1;
+    return true;
+}
+
+bool rewind_buffer_pop(RewindBuffer * rewind, GameBoy * const gb) {
+    return rewind_buffer_seek(rewind, gb, 1);
+}
+
+size_t rewind_buffer_get_count(RewindBuffer const * rewind) {
+    return rewind->has_current ? rewind->count + 1 : 0;
+}
+
+size_t rewind_buffer_get_used(RewindBuffer const * rewind) {
+    size_t used = 0;
+    for (size_t i = 0; i < rewind->count; i++) used += rewind_get_entry(rewind, i)->size;
+    return used;
+}
@@ -0,0 +1,29 @@
+#ifndef TRTLE_REWIND_BUFFER_H
+#define TRTLE_REWIND_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct GameBoy GameBoy;
+typedef struct RewindBuffer RewindBuffer;
+
+// Keeps the newest state whole and every older one as a compressed XOR delta against its successor.
+// Every keyframe_interval entries a compressed full state is stored instead, so seeking far back stays bounded.
+// Entries live in a single ring of budget bytes, the oldest are dropped once it is full.
+RewindBuffer * rewind_buffer_create(size_t budget, uint32_t interval, uint32_t keyframe_interval);
+void rewind_buffer_delete(RewindBuffer * rewind);
+void rewind_buffer_clear(RewindBuffer * rewind);
+
+// Called once per frame, captures the state every interval frames
+bool rewind_buffer_push(RewindBuffer * rewind, GameBoy * const gb);
+
+// Loads the state steps captures back and discards everything newer
+bool rewind_buffer_seek(RewindBuffer * rewind, GameBoy * const gb, size_t steps);
+bool rewind_buffer_pop(RewindBuffer * rewind, GameBoy * const gb);
+
+// Number of captures that can be returned to, including the newest
+size_t rewind_buffer_get_count(RewindBuffer const * rewind);
+size_t rewind_buffer_get_used(RewindBuffer const * rewind);
+
+#endif /* !TRTLE_REWIND_BUFFER_H */
@@ -0,0 +1,496 @@
+#include "rollback.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ROLLBACK_SOCKETS
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "logger.h"
+
+#define ROLLBACK_NO_FRAME    (UINT32_MAX)
+#define ROLLBACK_MAX_RESEND  (ROLLBACK_HISTORY / 2)
+
+struct RollbackSession {
+    GameBoy * consoles[ROLLBACK_PLAYERS];
+    GameBoySnapshot * snapshots[ROLLBACK_PLAYERS][ROLLBACK_HISTORY]; // State at the start of each frame
+    RollbackTransport transport;
+    size_t local_player;
+    size_t remote_player;
+
+    uint32_t frame;          // Next frame to run
+    uint32_t remote_frames;  // Remote inputs before this frame are confirmed
+    uint32_t acked_frames;   // Local inputs before this frame have reached the peer
+    uint32_t rollback_frame; // Earliest frame that ran on a wrong prediction
+    uint8_t inputs[ROLLBACK_PLAYERS][ROLLBACK_HISTORY];
+
+    // Hashes of confirmed states, tagged with their frame, for both peers
+    uint32_t checked_frames;
+    uint32_t checksum_frames[ROLLBACK_HISTORY];
+    uint64_t checksums[ROLLBACK_HISTORY];
+    uint32_t remote_checksum_frames[ROLLBACK_HISTORY];
+    uint64_t remote_checksums[ROLLBACK_HISTORY];
+    bool desync;
+
+    uint64_t resimulated;
+};
+
+static uint8_t rollback_encode_input(GameBoyInput input) {
+    return input.a << 0 | input.b << 1 | input.start << 2 | input.select << 3
+        | input.up << 4 | input.down << 5 | input.left << 6 | input.right << 7;
+}
+
+static GameBoyInput rollback_decode_input(uint8_t value) {
+    GameBoyInput input = {
+        value & 0b00000001, value & 0b00000010, value & 0b00000100, value & 0b00001000,
+        value & 0b00010000, value & 0b00100000, value & 0b01000000, value & 0b10000000
+    };
+    return input;
+}
+
+static void rollback_put32(uint8_t * data, uint32_t value) {
+    for (int i = 0; i < 4; i++) data[i] = value >> (i * 8);
+}
+
+static void rollback_put64(uint8_t * data, uint64_t value) {
+    for (int i = 0; i < 8; i++) data[i] = value >> (i * 8);
+}
+
+static uint32_t rollback_get32(uint8_t const * data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)data[i] << (i * 8);
+    return value;
+}
+
+static uint64_t rollback_get64(uint8_t const * data) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value |= (uint64_t)data[i] << (i * 8);
+    return value;
+}
+
+static uint64_t rollback_hash(uint64_t hash, uint8_t const * data, size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3;
+    }
+    for (; i < size; i++) hash = (hash ^ data[i]) * 0x100000001B3;
+    return hash;
+}
+
+RollbackSession * rollback_create(GameBoy * const consoles[ROLLBACK_PLAYERS], size_t local_player, RollbackTransport transport) {
+    if (local_player >= ROLLBACK_PLAYERS || transport.send == NULL || transport.receive == NULL) {
+        TRTLE_LOG_ERR("Invalid arguments passed to rollback_create");
+        return NULL;
+    }
+
+    RollbackSession * session = calloc(1, sizeof(RollbackSession));
+    if (session == NULL) return NULL;
+
+    for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) {
+        session->consoles[player] = consoles[player];
+        for (size_t i = 0; i < ROLLBACK_HISTORY; i++) {
+            session->snapshots[player][i] = gameboy_snapshot_create();
+            if (session->snapshots[player][i] == NULL) {
+                rollback_delete(session);
+                return NULL;
+            }
+        }
+    }
+
+    session->transport = transport;
+    session->local_player = local_player;
+    session->remote_player = local_player ^ 1;
+    session->rollback_frame = ROLLBACK_NO_FRAME;
+    for (size_t i = 0; i < ROLLBACK_HISTORY; i++) {
+        session->checksum_frames[i] = ROLLBACK_NO_FRAME;
+        session->remote_checksum_frames[i] = ROLLBACK_NO_FRAME;
+    }
+
+    return session;
+}
+
+void rollback_delete(RollbackSession * session) {
+    if (session != NULL) {
+        for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) {
+            for (size_t i = 0; i < ROLLBACK_HISTORY; i++) gameboy_snapshot_delete(session->snapshots[player][i]);
+        }
+        free(session);
+    }
+}
+
+static void rollback_compare_checksum(RollbackSession * session, uint32_t frame) {
+    size_t slot = frame % ROLLBACK_HISTORY;
+    if (session->checksum_frames[slot] != frame || session->remote_checksum_frames[slot] != frame) return;
+
+    if (session->checksums[slot] != session->remote_checksums[slot] && !session->desync) {
+        TRTLE_LOG_ERR("Rollback peers desynchronized at frame %u\n", frame);
+        session->desync = true;
+    }
+}
+
+static void rollback_send(RollbackSession * session) {
+    uint8_t message[ROLLBACK_MESSAGE_MAX];
+    uint32_t first = session->acked_frames;
+    if (session->frame - first > ROLLBACK_MAX_RESEND) first = session->frame - ROLLBACK_MAX_RESEND;
+
+    size_t size = 0;
+    rollback_put32(message + size, first);
+    size += 4;
+    rollback_put32(message + size, session->remote_frames);
+    size += 4;
+    message[size++] = session->frame - first;
+    for (uint32_t frame = first; frame < session->frame; frame++) {
+        message[size++] = session->inputs[session->local_player][frame % ROLLBACK_HISTORY];
+    }
+
+    uint32_t checked = session->checked_frames > 0 ? session->checked_frames - 1 : ROLLBACK_NO_FRAME;
+    rollback_put32(message + size, checked);
+    size += 4;
+    rollback_put64(message + size, checked != ROLLBACK_NO_FRAME ? session->checksums[checked % ROLLBACK_HISTORY] : 0);
+    size += 8;
+
+    session->transport.send(session->transport.context, message, size);
+}
+
+static void rollback_receive(RollbackSession * session) {
+    uint8_t message[ROLLBACK_MESSAGE_MAX];
+    size_t size;
+    while ((size = session->transport.receive(session->transport.context, message, sizeof(message))) > 0) {
+        if (size < 9 || size != 9u + message[8] + 12) {
+            TRTLE_LOG_WARN("Dropped a malformed rollback message of %zu bytes\n", size);
+            continue;
+        }
+
+        uint32_t first = rollback_get32(message);
+        uint32_t ack = rollback_get32(message + 4);
+        uint8_t count = message[8];
+        if (ack > session->acked_frames && ack <= session->frame) session->acked_frames = ack;
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t frame = first + i;
+            if (frame < session->remote_frames) continue;
+            // A gap means an earlier message was lost, the peer resends it with the next one
+            if (frame > session->remote_frames) break;
+            // Inputs this far ahead would overwrite ones that can still be rolled back to
+            if (frame >= session->frame + ROLLBACK_HISTORY - ROLLBACK_MAX_FRAMES - 1) break;
+
+            uint8_t * slot = &session->inputs[session->remote_player][frame % ROLLBACK_HISTORY];
+            uint8_t value = message[9 + i];
+            if (frame < session->frame && *slot != value && frame < session->rollback_frame) session->rollback_frame = frame;
+            *slot = value;
+            session->remote_frames++;
+        }
+
+        uint32_t checked = rollback_get32(message + 9 + count);
+        if (checked != ROLLBACK_NO_FRAME) {
+            size_t slot = checked % ROLLBACK_HISTORY;
+            session->remote_checksum_frames[slot] = checked;
+            session->remote_checksums[slot] = rollback_get64(message + 13 + count);
+            rollback_compare_checksum(session, checked);
+        }
+    }
+}
+
+static void rollback_run_frame(RollbackSession * session, uint32_t frame, bool render) {
+    size_t slot = frame % ROLLBACK_HISTORY;
+
+    // Unconfirmed remote input is predicted to repeat the last confirmed one
+    if (frame >= session->remote_frames) {
+        uint8_t predicted = 0;
+        if (session->remote_frames > 0) predicted = session->inputs[session->remote_player][(session->remote_frames - 1) % ROLLBACK_HISTORY];
+        session->inputs[session->remote_player][slot] = predicted;
+    }
+
+    for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) {
+        gameboy_snapshot_save(session->consoles[player], session->snapshots[player][slot]);
+        session->consoles[player]->skip_render = !render;
+    }
+
+    // Consoles joined by a link cable run together, so a peer plays over the network exactly as it would in one process
+    if (gameboy_get_link(session->consoles[0]) == session->consoles[1]) {
+        gameboy_link_run_frame(session->consoles[0], rollback_decode_input(session->inputs[0][slot]), rollback_decode_input(session->inputs[1][slot]));
+    }
+    else {
+        for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) {
+            gameboy_run_frame(session->consoles[player], rollback_decode_input(session->inputs[player][slot]));
+        }
+    }
+
+    for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) session->consoles[player]->skip_render = false;
+}
+
+static void rollback_update_checksums(RollbackSession * session) {
+    // The state at the start of a frame is final once every input before it is confirmed
+    uint32_t final = session->remote_frames < session->frame - 1 ? session->remote_frames : session->frame - 1;
+    if (session->frame - session->checked_frames > ROLLBACK_HISTORY) session->checked_frames = session->frame - ROLLBACK_HISTORY;
+
+    for (; session->checked_frames <= final; session->checked_frames++) {
+        uint32_t frame = session->checked_frames;
+        size_t slot = frame % ROLLBACK_HISTORY;
+
+        uint64_t hash = 0xCBF29CE484222325;
+        for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) {
+            size_t size;
+            void const * data = gameboy_snapshot_get_data(session->snapshots[player][slot], &size);
+            hash = rollback_hash(hash, data, size);
+        }
+
+        session->checksum_frames[slot] = frame;
+        session->checksums[slot] = hash;
+        rollback_compare_checksum(session, frame);
+    }
+}
+
+RollbackResult rollback_advance(RollbackSession * session, GameBoyInput input) {
+    rollback_receive(session);
+
+    if (session->frame >= session->remote_frames + ROLLBACK_MAX_FRAMES) {
+        rollback_send(session);
+        return session->desync ? ROLLBACK_DESYNC : ROLLBACK_STALLED;
+    }
+
+    // Replay everything since the first misprediction without drawing, snapshots are retaken along the way
+    if (session->rollback_frame < session->frame) {
+        size_t slot = session->rollback_frame % ROLLBACK_HISTORY;
+        for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) {
+            gameboy_snapshot_restore(session->consoles[player], session->snapshots[player][slot]);
+        }
+        for (uint32_t frame = session->rollback_frame; frame < session->frame; frame++) {
+            rollback_run_frame(session, frame, false);
+            session->resimulated++;
+        }
+    }
+    session->rollback_frame = ROLLBACK_NO_FRAME;
+
+    session->inputs[session->local_player][session->frame % ROLLBACK_HISTORY] = rollback_encode_input(input);
+    rollback_run_frame(session, session->frame, true);
+    session->frame++;
+
+    rollback_update_checksums(session);
+    rollback_send(session);
+    return session->desync ? ROLLBACK_DESYNC : ROLLBACK_OK;
+}
+
+uint32_t rollback_get_frame(RollbackSession const * session) {
+    return session->frame;
+}
+
+uint32_t rollback_get_confirmed_frame(RollbackSession const * session) {
+    return session->remote_frames < session->frame ? session->remote_frames : session->frame;
+}
+
+uint64_t rollback_get_resimulated_frames(RollbackSession const * session) {
+    return session->resimulated;
+}
+
+#define ROLLBACK_LOOPBACK_CAPACITY (64)
+
+typedef struct RollbackLoopbackMessage {
+    uint32_t due;
+    uint32_t size;
+    uint8_t data[ROLLBACK_MESSAGE_MAX];
+} RollbackLoopbackMessage;
+
+typedef struct RollbackLoopbackEndpoint {
+    RollbackLoopback * loopback;
+    size_t side;
+} RollbackLoopbackEndpoint;
+
+// queues[side] holds the messages addressed to that side, time is counted in each side's own sends
+struct RollbackLoopback {
+    uint32_t latency;
+    uint32_t sends[2];
+    RollbackLoopbackMessage queues[2][ROLLBACK_LOOPBACK_CAPACITY];
+    size_t heads[2];
+    size_t counts[2];
+    RollbackLoopbackEndpoint endpoints[2];
+};
+
+static bool rollback_loopback_send(void * context, void const * data, size_t size) {
+    RollbackLoopbackEndpoint * endpoint = context;
+    RollbackLoopback * loopback = endpoint->loopback;
+    size_t side = endpoint->side;
+    size_t peer = side ^ 1;
+
+    uint32_t now = loopback->sends[side]++;
+    if (size > ROLLBACK_MESSAGE_MAX || loopback->counts[peer] == ROLLBACK_LOOPBACK_CAPACITY) return false;
+
+    RollbackLoopbackMessage * message = &loopback->queues[peer][(loopback->heads[peer] + loopback->counts[peer]++) % ROLLBACK_LOOPBACK_CAPACITY];
+    message->due = now + loopback->latency;
+    message->size = size;
+    memcpy(message->data, data, size);
+    return true;
+}
+
+static size_t rollback_loopback_receive(void * context, void * data, size_t capacity) {
+    RollbackLoopbackEndpoint * endpoint = context;
+    RollbackLoopback * loopback = endpoint->loopback;
+    size_t side = endpoint->side;
+    while (loopback->counts[side] > 0) {
+        RollbackLoopbackMessage * message = &loopback->queues[side][loopback->heads[side]];
+        if (loopback->sends[side] < message->due) return 0;
+
+        loopback->heads[side] = (loopback->heads[side] + 1) % ROLLBACK_LOOPBACK_CAPACITY;
+        loopback->counts[side]--;
+
+        // Like a datagram too large for the buffer, a message that does not fit is lost rather than left blocking the rest
+        if (message->size > capacity) continue;
+        memcpy(data, message->data, message->size);
+        return message->size;
+    }
+    return 0;
+}
+
+RollbackLoopback * rollback_loopback_create(uint32_t latency) {
+    RollbackLoopback * loopback = calloc(1, sizeof(RollbackLoopback));
+    if (loopback == NULL) return NULL;
+
+    loopback->latency = latency;
+    for (size_t side = 0; side < 2; side++) {
+        loopback->endpoints[side].loopback = loopback;
+        loopback->endpoints[side].side = side;
+    }
+    return loopback;
+}
+
+void rollback_loopback_delete(RollbackLoopback * loopback) {
+    free(loopback);
+}
+
+RollbackTransport rollback_loopback_get_transport(RollbackLoopback * loopback, size_t side) {
+    RollbackTransport transport = {
+        &loopback->endpoints[side & 1],
+        rollback_loopback_send,
+        rollback_loopback_receive
+    };
+    return transport;
+}
+
+#if defined(ROLLBACK_SOCKETS)
+
+struct RollbackSocket {
+    int fd;
+    struct sockaddr_storage remote;
+    socklen_t remote_size;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)]; // The bound Unix socket, removed again on delete
+};
+
+// family is AF_UNSPEC for the remote address, the local one then has to resolve to the same family
+static bool rollback_socket_resolve(char const * address, int family, struct sockaddr_storage * storage, socklen_t * size) {
+    memset(storage, 0, sizeof(*storage));
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un * un = (struct sockaddr_un *)storage;
+        if ((family != AF_UNSPEC && family != AF_UNIX) || strlen(address) >= sizeof(un->sun_path)) return false;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address);
+        *size = sizeof(struct sockaddr_un);
+        return true;
+    }
+
+    char host[256];
+    char const * port = strrchr(address, ':');
+    if (port == NULL || (size_t)(port - address) >= sizeof(host)) return false;
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo * info;
+    if (getaddrinfo(host[0] != '\0' ? host : NULL, port + 1, &hints, &info) != 0) return false;
+    memcpy(storage, info->ai_addr, info->ai_addrlen);
+    *size = info->ai_addrlen;
+    freeaddrinfo(info);
+    return true;
+}
+
+static bool rollback_socket_send(void * context, void const * data, size_t size) {
+    RollbackSocket * sock = context;
+    return sendto(sock->fd, data, size, 0, (struct sockaddr const *)&sock->remote, sock->remote_size) == (ssize_t)size;
+}
+
+static size_t rollback_socket_receive(void * context, void * data, size_t capacity) {
+    RollbackSocket * sock = context;
+    ssize_t size = recv(sock->fd, data, capacity, 0);
+    return size > 0 ? (size_t)size : 0;
+}
+
+RollbackSocket * rollback_socket_create(char const * local_address, char const * remote_address) {
+    RollbackSocket * sock = calloc(1, sizeof(RollbackSocket));
+    if (sock == NULL) return NULL;
+    sock->fd = -1;
+
+    struct sockaddr_storage local;
+    socklen_t local_size;
+    if (!rollback_socket_resolve(remote_address, AF_UNSPEC, &sock->remote, &sock->remote_size)
+        || !rollback_socket_resolve(local_address, sock->remote.ss_family, &local, &local_size)) {
+        TRTLE_LOG_ERR("Failed to resolve the rollback socket addresses %s and %s\n", local_address, remote_address);
+        free(sock);
+        return NULL;
+    }
+
+    // A socket left behind by an earlier session would keep the path from being bound again
+    struct stat info;
+    if (local.ss_family == AF_UNIX && stat(local_address, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(local_address);
+
+    sock->fd = socket(local.ss_family, SOCK_DGRAM, 0);
+    if (sock->fd < 0 || bind(sock->fd, (struct sockaddr const *)&local, local_size) != 0 || fcntl(sock->fd, F_SETFL, O_NONBLOCK) != 0) {
+        TRTLE_LOG_ERR("Failed to open a rollback socket on %s\n", local_address);
+        rollback_socket_delete(sock);
+        return NULL;
+    }
+    if (local.ss_family == AF_UNIX) strcpy(sock->path, local_address);
+
+    return sock;
+}
+
+void rollback_socket_delete(RollbackSocket * sock) {
+    if (sock != NULL) {
+        if (sock->fd >= 0) close(sock->fd);
+        if (sock->path[0] != '\0') unlink(sock->path);
+        free(sock);
+    }
+}
+
+RollbackTransport rollback_socket_get_transport(RollbackSocket * sock) {
+    RollbackTransport transport = {
+        sock,
+        rollback_socket_send,
+        rollback_socket_receive
+    };
+    return transport;
+}
+
+#else
+
+struct RollbackSocket {
+    int unused;
+};
+
+RollbackSocket * rollback_socket_create(char const * local_address, char const * remote_address) {
+    TRTLE_LOG_ERR("Rollback sockets are not supported on this platform");
+    return NULL;
+}
+
+void rollback_socket_delete(RollbackSocket * sock) {
+    free(sock);
+}
+
+RollbackTransport rollback_socket_get_transport(RollbackSocket * sock) {
+    RollbackTransport transport = { sock, NULL, NULL };
+    return transport;
+}
+
+#endif
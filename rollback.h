@@ -0,0 +1,56 @@
+#ifndef TRTLE_ROLLBACK_H
+#define TRTLE_ROLLBACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gameboy.h"
+
+#define ROLLBACK_PLAYERS     (2)
+#define ROLLBACK_MAX_FRAMES  (8)  // How far a session may run ahead of the last confirmed remote input
+#define ROLLBACK_HISTORY     (32) // Frames of inputs, snapshots and checksums kept, a power of two
+#define ROLLBACK_MESSAGE_MAX (64)
+
+typedef struct RollbackSession RollbackSession;
+typedef struct RollbackLoopback RollbackLoopback;
+typedef struct RollbackSocket RollbackSocket;
+
+// Unreliable, unordered datagrams are enough, every message repeats all inputs the peer has not acknowledged.
+// receive returns the size of one pending message, or 0 when there is none.
+typedef struct RollbackTransport {
+    void * context;
+    bool (*send)(void * context, void const * data, size_t size);
+    size_t (*receive)(void * context, void * data, size_t capacity);
+} RollbackTransport;
+
+typedef enum RollbackResult {
+    ROLLBACK_OK,
+    ROLLBACK_STALLED, // Too far ahead of the remote peer, the frame did not advance and its input was dropped
+    ROLLBACK_DESYNC,  // A confirmed frame hashed differently on the two peers
+} RollbackResult;
+
+// Each peer simulates one console per player, consoles[i] is driven by player i. Consoles linked to each other run
+// as a pair, so link cable play over the network hides latency the same way input does.
+RollbackSession * rollback_create(GameBoy * const consoles[ROLLBACK_PLAYERS], size_t local_player, RollbackTransport transport);
+void rollback_delete(RollbackSession * session);
+
+// Runs one frame with the local input and a prediction for the remote one, first replaying any mispredicted frames
+RollbackResult rollback_advance(RollbackSession * session, GameBoyInput input);
+
+uint32_t rollback_get_frame(RollbackSession const * session);
+uint32_t rollback_get_confirmed_frame(RollbackSession const * session);
+uint64_t rollback_get_resimulated_frames(RollbackSession const * session);
+
+// In-memory transport pair for tests, delivering each message latency sends after it was posted
+RollbackLoopback * rollback_loopback_create(uint32_t latency);
+void rollback_loopback_delete(RollbackLoopback * loopback);
+RollbackTransport rollback_loopback_get_transport(RollbackLoopback * loopback, size_t side);
+
+// Datagram socket transport, over Unix domain sockets when the addresses are paths and UDP when they are host:port.
+// An empty host binds every interface. Only built where BSD sockets are, creating one fails elsewhere.
+RollbackSocket * rollback_socket_create(char const * local_address, char const * remote_address);
+void rollback_socket_delete(RollbackSocket * sock);
+RollbackTransport rollback_socket_get_transport(RollbackSocket * sock);
+
+#endif /* !TRTLE_ROLLBACK_H */
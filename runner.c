@@ -0,0 +1,462 @@
+// Runs a manifest of test roms and snapshots across every core, reporting the results as JUnit or JSON.
+//
+// Each manifest line names a rom, the frames to run it for and the results it is expected to produce:
+//     cpu_instrs.gb 4000 serial="Passed all tests"
+//     game.gb 600 state=game.suspend frame=9f3c0d5a1e2b4c6d ram=C000:256:0123456789abcdef
+// Paths are relative to the manifest. serial passes once the text shows up in what the rom sent over the link
+// port, and a rom that only expects serial text stops as soon as it does. frame is a hash of the last frame's
+// shades and ram a hash of a memory range, both printed for every rom so new expectations can be copied out.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+#include "trtle.h"
+
+#define RUNNER_SERIAL_MAX (1024)
+#define RUNNER_PATH_MAX   (4096)
+
+typedef enum RunnerStatus {
+    RUNNER_PASS,
+    RUNNER_FAIL,
+    RUNNER_ERROR, // The rom or snapshot could not be loaded
+} RunnerStatus;
+
+typedef struct RunnerJob {
+    char * name;
+    char * rom;
+    char * state;
+    uint32_t frames;
+
+    char * expect_serial;
+    bool expect_frame;
+    uint64_t frame_hash;
+    bool expect_ram;
+    uint16_t ram_address;
+    uint16_t ram_size;
+    uint64_t ram_hash;
+
+    RunnerStatus status;
+    char message[256];
+    char serial[RUNNER_SERIAL_MAX];
+    uint64_t actual_frame_hash;
+    uint64_t actual_ram_hash;
+    uint32_t frames_run;
+    uint64_t cycles;
+    double seconds;
+} RunnerJob;
+
+typedef struct Runner {
+    RunnerJob * jobs;
+    size_t count;
+    atomic_size_t next;
+} Runner;
+
+static double runner_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t runner_hash(uint8_t const * data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < size; i++) hash = (hash ^ data[i]) * 0x100000001B3;
+    return hash;
+}
+
+// Copies the most recent bytes the rom sent over the link port
+static void runner_copy_serial(GameBoy * const gb, RunnerJob * const job) {
+    size_t size;
+    uint8_t const * capture = gameboy_get_serial_capture(gb, &size);
+    if (size >= RUNNER_SERIAL_MAX) {
+        capture += size - (RUNNER_SERIAL_MAX - 1);
+        size = RUNNER_SERIAL_MAX - 1;
+    }
+
+    // A zero byte would end the text early, so it is kept as a placeholder
+    for (size_t i = 0; i < size; i++) job->serial[i] = capture[i] != 0 ? (char)capture[i] : '?';
+    job->serial[size] = '\0';
+}
+
+static bool runner_serial_passed(RunnerJob const * const job) {
+    return job->expect_serial != NULL && strstr(job->serial, job->expect_serial) != NULL;
+}
+
+static void runner_fail(RunnerJob * const job, RunnerStatus status, char const * message) {
+    if (job->status != RUNNER_PASS) return;
+    job->status = status;
+    snprintf(job->message, sizeof(job->message), "%s", message);
+}
+
+static void runner_run_job(RunnerJob * const job) {
+    double start = runner_now();
+    job->status = RUNNER_PASS;
+
+    GameBoy * gb = gameboy_create();
+    CartridgeImage * image = NULL;
+    if (gb == NULL || cartridge_image_from_file(&image, job->rom) != CARTRIDGE_ERROR_NONE || !gameboy_set_cartridge(gb, image)) {
+        runner_fail(job, RUNNER_ERROR, "Failed to load the rom");
+    }
+    else if (job->state != NULL && !gameboy_resume(gb, job->state)) {
+        runner_fail(job, RUNNER_ERROR, "Failed to resume the snapshot");
+    }
+    cartridge_image_release(image);
+
+    // Only the last frame is drawn, and a rom that only reports over the link port stops once it has
+    bool serial_only = job->expect_serial != NULL && !job->expect_frame && !job->expect_ram;
+    uint64_t cycles = gb != NULL ? gb->cycles : 0;
+    GameBoyInput input = { 0 };
+    for (uint32_t frame = 0; job->status == RUNNER_PASS && frame < job->frames; frame++) {
+        gb->skip_render = frame + 1 < job->frames;
+        gameboy_run_frame(gb, input);
+        job->frames_run++;
+        if (serial_only) {
+            runner_copy_serial(gb, job);
+            if (runner_serial_passed(job)) break;
+        }
+    }
+
+    if (job->status == RUNNER_PASS) {
+        job->cycles = gb->cycles - cycles;
+        runner_copy_serial(gb, job);
+
+        uint8_t shades[GAMEBOY_DISPLAY_PACKED_SIZE];
+        gameboy_get_display_shades(gb, shades, sizeof(shades));
+        job->actual_frame_hash = runner_hash(shades, sizeof(shades));
+
+        if (job->expect_ram) {
+            uint8_t ram[0x10000];
+            for (uint32_t i = 0; i < job->ram_size; i++) ram[i] = gameboy_read(gb, job->ram_address + i);
+            job->actual_ram_hash = runner_hash(ram, job->ram_size);
+        }
+
+        if (job->expect_serial != NULL && !runner_serial_passed(job)) runner_fail(job, RUNNER_FAIL, "Serial output did not contain the expected text");
+        else if (job->expect_frame && job->actual_frame_hash != job->frame_hash) runner_fail(job, RUNNER_FAIL, "Frame hash mismatch");
+        else if (job->expect_ram && job->actual_ram_hash != job->ram_hash) runner_fail(job, RUNNER_FAIL, "RAM hash mismatch");
+    }
+
+    gameboy_delete(gb);
+    job->seconds = runner_now() - start;
+}
+
+static void * runner_thread(void * arg) {
+    Runner * const runner = arg;
+    size_t index;
+    while ((index = atomic_fetch_add_explicit(&runner->next, 1, memory_order_relaxed)) < runner->count) {
+        runner_run_job(&runner->jobs[index]);
+    }
+    return NULL;
+}
+
+static size_t runner_get_processor_count(void) {
+#if defined(__unix__) || defined(__APPLE__)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 0) return (size_t)count;
+#endif
+    return 1;
+}
+
+// Splits off the next token, a double quoted one keeping its spaces
+static char * runner_next_token(char ** line) {
+    char * c = *line;
+    while (*c == ' ' || *c == '\t') c++;
+    if (*c == '\0') return NULL;
+
+    char * token = c;
+    bool quoted = false;
+    char * out = c;
+    for (; *c != '\0' && (quoted || (*c != ' ' && *c != '\t')); c++) {
+        if (*c == '"') quoted = !quoted;
+        else *out++ = *c;
+    }
+    if (*c != '\0') c++;
+    *out = '\0';
+    *line = c;
+    return token;
+}
+
+static char * runner_resolve(char const * directory, char const * name) {
+    if (name[0] == '/' || directory[0] == '\0') return strdup(name);
+
+    size_t size = strlen(directory) + strlen(name) + 2;
+    char * path = malloc(size);
+    if (path != NULL) snprintf(path, size, "%s/%s", directory, name);
+    return path;
+}
+
+static void runner_free_job(RunnerJob * const job) {
+    free(job->name);
+    free(job->rom);
+    free(job->state);
+    free(job->expect_serial);
+}
+
+static bool runner_parse_job(RunnerJob * const job, char * line, char const * directory) {
+    char * rom = runner_next_token(&line);
+    char * frames = runner_next_token(&line);
+    if (rom == NULL || frames == NULL) return false;
+
+    job->name = strdup(rom);
+    job->rom = runner_resolve(directory, rom);
+    if (job->name == NULL || job->rom == NULL) return false;
+    job->frames = (uint32_t)strtoul(frames, NULL, 10);
+
+    char * token;
+    while ((token = runner_next_token(&line)) != NULL) {
+        char * value = strchr(token, '=');
+        if (value == NULL) return false;
+        *value++ = '\0';
+
+        if (strcmp(token, "serial") == 0) {
+            free(job->expect_serial);
+            job->expect_serial = strdup(value);
+        }
+        else if (strcmp(token, "state") == 0) {
+            free(job->state);
+            job->state = runner_resolve(directory, value);
+            if (job->state == NULL) return false;
+        }
+        else if (strcmp(token, "frame") == 0) {
+            job->expect_frame = true;
+            job->frame_hash = strtoull(value, NULL, 16);
+        }
+        else if (strcmp(token, "ram") == 0) {
+            unsigned address, size;
+            char hash[32];
+            if (sscanf(value, "%x:%u:%31s", &address, &size, hash) != 3 || address > 0xFFFF || size == 0 || address + size > 0x10000) return false;
+            job->expect_ram = true;
+            job->ram_address = address;
+            job->ram_size = size;
+            job->ram_hash = strtoull(hash, NULL, 16);
+        }
+        else return false;
+    }
+    return true;
+}
+
+static bool runner_load_manifest(Runner * const runner, char const * path) {
+    FILE * file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open manifest %s\n", path);
+        return false;
+    }
+
+    char directory[RUNNER_PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+    char * slash = strrchr(directory, '/');
+    if (slash != NULL) *slash = '\0';
+    else directory[0] = '\0';
+
+    size_t capacity = 0;
+    char line[RUNNER_PATH_MAX];
+    for (size_t number = 1; fgets(line, sizeof(line), file) != NULL; number++) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char * start = line;
+        while (*start == ' ' || *start == '\t') start++;
+        if (*start == '\0' || *start == '#') continue;
+
+        if (runner->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            RunnerJob * jobs = realloc(runner->jobs, capacity * sizeof(RunnerJob));
+            if (jobs == NULL) {
+                fclose(file);
+                return false;
+            }
+            runner->jobs = jobs;
+        }
+
+        RunnerJob * const job = &runner->jobs[runner->count];
+        memset(job, 0, sizeof(RunnerJob));
+        if (!runner_parse_job(job, start, directory)) {
+            fprintf(stderr, "%s:%zu: malformed manifest line\n", path, number);
+            runner_free_job(job);
+            fclose(file);
+            return false;
+        }
+        runner->count++;
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Longest first, so the last jobs to start are the short ones and no core is left finishing a long one alone
+static int runner_compare_jobs(void const * a, void const * b) {
+    uint32_t frames_a = ((RunnerJob const *)a)->frames;
+    uint32_t frames_b = ((RunnerJob const *)b)->frames;
+    return (frames_a < frames_b) - (frames_a > frames_b);
+}
+
+static char const * runner_status_name(RunnerStatus status) {
+    switch (status) {
+        case RUNNER_PASS: return "pass";
+        case RUNNER_FAIL: return "fail";
+        case RUNNER_ERROR:
+        default: return "error";
+    }
+}
+
+static double runner_mhz(RunnerJob const * const job) {
+    return job->seconds > 0 ? job->cycles / job->seconds / 1e6 : 0;
+}
+
+static void runner_write_json_string(FILE * out, char const * text) {
+    fputc('"', out);
+    for (unsigned char const * c = (unsigned char const *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+        else if (*c < 0x20 || *c >= 0x7F) fprintf(out, "\\u%04x", *c);
+        else fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void runner_write_json(FILE * out, Runner const * const runner, double seconds) {
+    size_t totals[3] = { 0 };
+    fprintf(out, "{\n  \"roms\": [\n");
+    for (size_t i = 0; i < runner->count; i++) {
+        RunnerJob const * const job = &runner->jobs[i];
+        totals[job->status]++;
+        fprintf(out, "    {\"name\": ");
+        runner_write_json_string(out, job->name);
+        fprintf(out, ", \"status\": \"%s\", \"frames\": %u, \"wall_seconds\": %.6f, \"emulated_mhz\": %.2f",
+            runner_status_name(job->status), job->frames_run, job->seconds, runner_mhz(job));
+        fprintf(out, ", \"frame\": \"%016llx\"", (unsigned long long)job->actual_frame_hash);
+        if (job->expect_ram) fprintf(out, ", \"ram\": \"%016llx\"", (unsigned long long)job->actual_ram_hash);
+        fprintf(out, ", \"serial\": ");
+        runner_write_json_string(out, job->serial);
+        if (job->status != RUNNER_PASS) {
+            fprintf(out, ", \"message\": ");
+            runner_write_json_string(out, job->message);
+        }
+        fprintf(out, "}%s\n", i + 1 < runner->count ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"passed\": %zu,\n  \"failed\": %zu,\n  \"errors\": %zu,\n  \"wall_seconds\": %.6f\n}\n",
+        totals[RUNNER_PASS], totals[RUNNER_FAIL], totals[RUNNER_ERROR], seconds);
+}
+
+static void runner_write_xml_string(FILE * out, char const * text) {
+    for (unsigned char const * c = (unsigned char const *)text; *c; c++) {
+        switch (*c) {
+            case '&': fputs("&amp;", out); break;
+            case '<': fputs("&lt;", out); break;
+            case '>': fputs("&gt;", out); break;
+            case '"': fputs("&quot;", out); break;
+            default:
+                // XML 1.0 has no way to write the other control characters, even as references
+                if (*c == '\n' || *c == '\t' || (*c >= 0x20 && *c < 0x7F)) fputc(*c, out);
+                else if (*c < 0x20) fputc('?', out);
+                else fprintf(out, "&#x%X;", *c);
+                break;
+        }
+    }
+}
+
+static void runner_write_junit(FILE * out, Runner const * const runner, double seconds) {
+    size_t totals[3] = { 0 };
+    for (size_t i = 0; i < runner->count; i++) totals[runner->jobs[i].status]++;
+
+    fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(out, "<testsuite name=\"trtle\" tests=\"%zu\" failures=\"%zu\" errors=\"%zu\" time=\"%.6f\">\n",
+        runner->count, totals[RUNNER_FAIL], totals[RUNNER_ERROR], seconds);
+    for (size_t i = 0; i < runner->count; i++) {
+        RunnerJob const * const job = &runner->jobs[i];
+        fprintf(out, "  <testcase classname=\"trtle\" name=\"");
+        runner_write_xml_string(out, job->name);
+        fprintf(out, "\" time=\"%.6f\">\n", job->seconds);
+        if (job->status != RUNNER_PASS) {
+            fprintf(out, "    <%s message=\"", job->status == RUNNER_FAIL ? "failure" : "error");
+            runner_write_xml_string(out, job->message);
+            fprintf(out, "\"/>\n");
+        }
+        fprintf(out, "    <system-out>frames %u, %.2f MHz, frame %016llx", job->frames_run, runner_mhz(job), (unsigned long long)job->actual_frame_hash);
+        if (job->expect_ram) fprintf(out, ", ram %016llx", (unsigned long long)job->actual_ram_hash);
+        fprintf(out, "\n");
+        runner_write_xml_string(out, job->serial);
+        fprintf(out, "</system-out>\n  </testcase>\n");
+    }
+    fprintf(out, "</testsuite>\n");
+}
+
+static bool runner_write_report(char const * path, Runner const * const runner, double seconds, bool junit) {
+    FILE * out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open %s for writing\n", path);
+        return false;
+    }
+    if (junit) runner_write_junit(out, runner, seconds);
+    else runner_write_json(out, runner, seconds);
+    return out == stdout || fclose(out) == 0;
+}
+
+static void runner_usage(char const * name) {
+    fprintf(stderr, "Usage: %s [--threads N] [--json FILE] [--junit FILE] MANIFEST\n", name);
+}
+
+int main(int argc, char ** argv) {
+    char const * manifest = NULL;
+    char const * json = NULL;
+    char const * junit = NULL;
+    size_t threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) json = argv[++i];
+        else if (strcmp(argv[i], "--junit") == 0 && i + 1 < argc) junit = argv[++i];
+        else if (argv[i][0] != '-' && manifest == NULL) manifest = argv[i];
+        else {
+            runner_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (manifest == NULL) {
+        runner_usage(argv[0]);
+        return 2;
+    }
+
+    Runner runner = { 0 };
+    if (!runner_load_manifest(&runner, manifest)) return 2;
+    qsort(runner.jobs, runner.count, sizeof(RunnerJob), runner_compare_jobs);
+
+    if (threads == 0) threads = runner_get_processor_count();
+    if (threads > runner.count) threads = runner.count > 0 ? runner.count : 1;
+
+    // Jobs are claimed one at a time from a shared counter, so a worker that finishes early takes the next one
+    double start = runner_now();
+    pthread_t * workers = calloc(threads, sizeof(pthread_t));
+    size_t started = 0;
+    for (; workers != NULL && started + 1 < threads; started++) {
+        if (pthread_create(&workers[started], NULL, runner_thread, &runner) != 0) break;
+    }
+    runner_thread(&runner);
+    for (size_t i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    double seconds = runner_now() - start;
+
+    size_t failed = 0;
+    uint64_t cycles = 0;
+    for (size_t i = 0; i < runner.count; i++) {
+        RunnerJob const * const job = &runner.jobs[i];
+        cycles += job->cycles;
+        if (job->status == RUNNER_PASS) continue;
+        failed++;
+        fprintf(stderr, "%s %s: %s\n", runner_status_name(job->status), job->name, job->message);
+    }
+    printf("%zu of %zu passed in %.2fs on %zu threads, %.1f emulated MHz\n",
+        runner.count - failed, runner.count, seconds, threads, seconds > 0 ? cycles / seconds / 1e6 : 0);
+
+    bool written = true;
+    if (json != NULL) written &= runner_write_report(json, &runner, seconds, false);
+    if (junit != NULL) written &= runner_write_report(junit, &runner, seconds, true);
+
+    for (size_t i = 0; i < runner.count; i++) runner_free_job(&runner.jobs[i]);
+    free(runner.jobs);
+    return failed > 0 || !written ? 1 : 0;
+}
@@ -0,0 +1,260 @@
+#include "save_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct SaveFile {
+    int fd;
+    uint8_t * data;
+    size_t size;
+    size_t host_page_size;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t pending[SAVE_FILE_DIRTY_WORDS];
+    bool has_pending;
+    bool running;
+};
+
+static void save_file_sync_pages(SaveFile * const save, uint64_t const dirty[SAVE_FILE_DIRTY_WORDS]) {
+    size_t page_count = (save->size + SAVE_FILE_PAGE_SIZE - 1) >> SAVE_FILE_PAGE_SHIFT;
+    size_t page = 0;
+    while (page < page_count) {
+        if (!(dirty[page / 64] & (1ull << (page % 64)))) {
+            page++;
+            continue;
+        }
+
+        // Coalesce runs of dirty pages into a single msync aligned to host pages
+        size_t first = page;
+        while (page < page_count && (dirty[page / 64] & (1ull << (page % 64)))) page++;
+
+        size_t start = (first << SAVE_FILE_PAGE_SHIFT) & ~(save->host_page_size - 1);
+        size_t end = page << SAVE_FILE_PAGE_SHIFT;
+        if (end > save->size) end = save->size;
+        if (msync(save->data + start, end - start, MS_SYNC) != 0) {
+            TRTLE_LOG_ERR("Failed to flush save file pages %zX-%zX\n", start, end);
+        }
+    }
+}
+
+static void * save_file_thread(void * arg) {
+    SaveFile * const save = arg;
+    uint64_t dirty[SAVE_FILE_DIRTY_WORDS];
+
+    pthread_mutex_lock(&save->mutex);
+    while (true) {
+        while (save->running && !save->has_pending) pthread_cond_wait(&save->cond, &save->mutex);
+        if (!save->has_pending) break;
+
+        memcpy(dirty, save->pending, sizeof(dirty));
+        save->has_pending = false;
+
+        // Disk I/O happens outside the lock so the emulation thread never waits on it
+        pthread_mutex_unlock(&save->mutex);
+        save_file_sync_pages(save, dirty);
+        pthread_mutex_lock(&save->mutex);
+    }
+    pthread_mutex_unlock(&save->mutex);
+
+    return NULL;
+}
+
+SaveFile * save_file_open(const char * path, uint8_t const * initial, size_t size) {
+    if (size == 0 || size > SAVE_FILE_MAX_SIZE) return NULL;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // Files written by other emulators can carry a footer after the RAM, so never shrink them
+    bool created = st.st_size == 0;
+    size_t file_size = (size_t)st.st_size > size ? (size_t)st.st_size : size;
+    if ((size_t)st.st_size < file_size && ftruncate(fd, file_size) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t * data = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (created && initial != NULL) memcpy(data, initial, size);
+
+    SaveFile * save = calloc(1, sizeof(SaveFile));
+    if (save == NULL) {
+        munmap(data, file_size);
+        close(fd);
+        return NULL;
+    }
+
+    save->fd = fd;
+    save->data = data;
+    save->size = file_size;
+    save->host_page_size = (size_t)sysconf(_SC_PAGESIZE);
+    save->running = true;
+    pthread_mutex_init(&save->mutex, NULL);
+    pthread_cond_init(&save->cond, NULL);
+    if (pthread_create(&save->thread, NULL, save_file_thread, save) != 0) {
+        pthread_cond_destroy(&save->cond);
+        pthread_mutex_destroy(&save->mutex);
+        munmap(data, file_size);
+        close(fd);
+        free(save);
+        return NULL;
+    }
+
+    return save;
+}
+
+void save_file_close(SaveFile * save) {
+    if (save == NULL) return;
+
+    pthread_mutex_lock(&save->mutex);
+    save->running = false;
+    pthread_cond_signal(&save->cond);
+    pthread_mutex_unlock(&save->mutex);
+    pthread_join(save->thread, NULL);
+
+    msync(save->data, save->size, MS_SYNC);
+    munmap(save->data, save->size);
+    close(save->fd);
+    pthread_cond_destroy(&save->cond);
+    pthread_mutex_destroy(&save->mutex);
+    free(save);
+}
+
+uint8_t * save_file_get_data(SaveFile * save) {
+    return save->data;
+}
+
+bool save_file_flush_async(SaveFile * save, uint64_t const dirty[SAVE_FILE_DIRTY_WORDS]) {
+    if (pthread_mutex_trylock(&save->mutex) != 0) return false;
+
+    for (size_t i = 0; i < SAVE_FILE_DIRTY_WORDS; i++) save->pending[i] |= dirty[i];
+    save->has_pending = true;
+    pthread_cond_signal(&save->cond);
+    pthread_mutex_unlock(&save->mutex);
+
+    return true;
+}
+
+void const * save_file_map_readonly(const char * path, size_t * size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void * data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    *size = st.st_size;
+    return data;
+}
+
+void save_file_unmap(void const * data, size_t size) {
+    if (data != NULL) munmap((void *)data, size);
+}
+
+bool save_file_write_atomic(const char * path, void const * data, size_t size) {
+    char temp[4096];
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) return false;
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    bool written = true;
+    for (size_t offset = 0; written && offset < size;) {
+        ssize_t count = write(fd, (uint8_t const *)data + offset, size - offset);
+        written = count > 0;
+        if (written) offset += count;
+    }
+    written = written && fsync(fd) == 0;
+    written = close(fd) == 0 && written;
+
+    if (!written || rename(temp, path) != 0) {
+        TRTLE_LOG_ERR("Failed to write %s\n", path);
+        unlink(temp);
+        return false;
+    }
+    return true;
+}
+
+#else
+
+SaveFile * save_file_open(const char * path, uint8_t const * initial, size_t size) {
+    TRTLE_LOG_WARN("Memory mapped save files are not supported on this platform\n");
+    return NULL;
+}
+
+void save_file_close(SaveFile * save) {}
+
+uint8_t * save_file_get_data(SaveFile * save) {
+    return NULL;
+}
+
+bool save_file_flush_async(SaveFile * save, uint64_t const dirty[SAVE_FILE_DIRTY_WORDS]) {
+    return false;
+}
+
+// Without mmap the file is read into a heap copy instead
+void const * save_file_map_readonly(const char * path, size_t * size) {
+    FILE * file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    uint8_t * data = NULL;
+    long end = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (end > 0 && fseek(file, 0, SEEK_SET) == 0) data = malloc(end);
+    if (data != NULL && fread(data, 1, end, file) != (size_t)end) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+
+    if (data != NULL) *size = end;
+    return data;
+}
+
+void save_file_unmap(void const * data, size_t size) {
+    free((void *)data);
+}
+
+bool save_file_write_atomic(const char * path, void const * data, size_t size) {
+    char temp[4096];
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) return false;
+
+    FILE * file = fopen(temp, "wb");
+    if (file == NULL) return false;
+
+    bool written = fwrite(data, 1, size, file) == size;
+    written = fclose(file) == 0 && written;
+
+    // Rename does not replace an existing file on every platform
+    remove(path);
+    if (!written || rename(temp, path) != 0) {
+        TRTLE_LOG_ERR("Failed to write %s\n", path);
+        remove(temp);
+        return false;
+    }
+    return true;
+}
+
+#endif
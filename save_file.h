@@ -0,0 +1,33 @@
+#ifndef TRTLE_SAVE_FILE_H
+#define TRTLE_SAVE_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SAVE_FILE_PAGE_SHIFT (8)
+#define SAVE_FILE_PAGE_SIZE  (1 << SAVE_FILE_PAGE_SHIFT)
+#define SAVE_FILE_MAX_SIZE   (0x20000)
+#define SAVE_FILE_DIRTY_WORDS (SAVE_FILE_MAX_SIZE / SAVE_FILE_PAGE_SIZE / 64)
+
+typedef struct SaveFile SaveFile;
+
+// Maps a save file shared and read/write, growing it to at least size bytes.
+// A newly created file is seeded from initial so it starts out matching the cartridge.
+SaveFile * save_file_open(const char * path, uint8_t const * initial, size_t size);
+void save_file_close(SaveFile * save);
+
+uint8_t * save_file_get_data(SaveFile * save);
+
+// Hands a dirty page bitmap to the flush thread without waiting on it.
+// Returns false if the thread is still busy, in which case the caller keeps its bitmap and retries later.
+bool save_file_flush_async(SaveFile * save, uint64_t const dirty[SAVE_FILE_DIRTY_WORDS]);
+
+// Maps a whole file read only, so large states are restored straight from the page cache
+void const * save_file_map_readonly(const char * path, size_t * size);
+void save_file_unmap(void const * data, size_t size);
+
+// Replaces a file through a temporary and a rename, so an interrupted write never leaves a torn file behind
+bool save_file_write_atomic(const char * path, void const * data, size_t size);
+
+#endif /* !TRTLE_SAVE_FILE_H */
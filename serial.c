@@ -1,13 +1,94 @@
 #include "serial.h"
 
 #include "gameboy.h"
+#include "interrupt_controller.h"
+#include "timer.h"
 
-#define SERIAL_SC_MASK (0b01111110)
+#define SERIAL_SC_MASK           (0b01111110)
+#define SERIAL_SC_TRANSFER_START (0b10000000)
+#define SERIAL_SC_INTERNAL_CLOCK (0b00000001)
 
 void serial_initialize(Serial * const s, bool skip_bootrom) {
-    // Stub
+    s->sb = 0x00;
+    s->sc = 0x00;
+    s->received = 0xFF;
+    s->transfer_end = UINT64_MAX;
+}
+
+static void serial_schedule(GameBoy * const gb, uint64_t end) {
+    gb->serial->transfer_end = end;
+    if (gb->run_deadline > end) gb->run_deadline = end;
+}
+
+// An internally clocked transfer runs whether anything answers or not, an external one waits for the other side.
+// A linked instance on the external clock waits for its peer to complete the transfer.
+static void serial_start(GameBoy * const gb) {
+    gb->serial->received = 0xFF;
+    if (gb->serial->sc & SERIAL_SC_INTERNAL_CLOCK) {
+        // The first bit shifts on the next falling edge of the divider bit, the other seven a period apart
+        uint16_t phase = gb->timer->internal_counter & (SERIAL_BIT_CYCLES - 1);
+        serial_schedule(gb, gb->cycles + (SERIAL_BIT_CYCLES - phase) + 7 * SERIAL_BIT_CYCLES);
+    }
+    else if (gameboy_get_link(gb) == NULL) {
+        int byte = gameboy_serial_receive(gb);
+        if (byte < 0) return;
+        gb->serial->received = (uint8_t)byte;
+        serial_schedule(gb, gb->cycles + 8 * SERIAL_BIT_CYCLES);
+    }
+}
+
+// The clocking side swaps bytes with the other end as its transfer completes. A linked peer only shifts while its
+// own transfer waits on the external clock, otherwise the line reads high as if nothing were connected.
+static uint8_t serial_exchange(GameBoy * const gb, uint8_t sent) {
+    GameBoy * const peer = gameboy_get_link(gb);
+    if (peer == NULL) {
+        int byte = gameboy_serial_receive(gb);
+        return byte >= 0 ? (uint8_t)byte : 0xFF;
+    }
+
+    Serial * const s = peer->serial;
+    if ((s->sc & (SERIAL_SC_TRANSFER_START | SERIAL_SC_INTERNAL_CLOCK)) != SERIAL_SC_TRANSFER_START) return 0xFF;
+    uint8_t received = s->sb;
+    s->received = sent;
+    s->transfer_end = peer->cycles;
+    return received;
+}
+
+void serial_update(GameBoy * const gb) {
+    Serial * const s = gb->serial;
+    if (gb->cycles >= s->transfer_end) {
+        uint8_t sent = s->sb;
+        if (s->sc & SERIAL_SC_INTERNAL_CLOCK) s->received = serial_exchange(gb, sent);
+        s->sb = s->received;
+        s->sc &= ~SERIAL_SC_TRANSFER_START;
+        s->transfer_end = UINT64_MAX;
+        gb->interrupt_controller->flags |= SERIAL_INTERRUPT_BIT;
+        gameboy_serial_send(gb, sent);
+        gameboy_signal(gb, GAMEBOY_EVENT_SERIAL);
+    }
+    else if (s->transfer_end == UINT64_MAX && (s->sc & (SERIAL_SC_TRANSFER_START | SERIAL_SC_INTERNAL_CLOCK)) == SERIAL_SC_TRANSFER_START) {
+        serial_start(gb);
+    }
+}
+
+// Bits shift out of the top of SB as the received ones shift in at the bottom, worked out from the time alone
+uint8_t serial_read_sb(GameBoy const * const gb) {
+    Serial const * const s = gb->serial;
+    if (s->transfer_end == UINT64_MAX || gb->cycles + 7 * SERIAL_BIT_CYCLES < s->transfer_end) return s->sb;
+
+    uint64_t shifted = (gb->cycles + 7 * SERIAL_BIT_CYCLES - s->transfer_end) / SERIAL_BIT_CYCLES + 1;
+    if (shifted >= 8) return s->received;
+    return (uint8_t)(s->sb << shifted) | (s->received >> (8 - shifted));
 }
 
 uint8_t serial_read_sc(GameBoy const * const gb) {
     return gb->serial->sc | SERIAL_SC_MASK;
 }
+
+// Writing the start bit again leaves a transfer on the same clock running, clearing it stops the transfer
+void serial_write_sc(GameBoy * const gb, uint8_t value) {
+    bool running = gb->serial->transfer_end != UINT64_MAX && !((gb->serial->sc ^ value) & SERIAL_SC_INTERNAL_CLOCK);
+    gb->serial->sc = value;
+    if (!(value & SERIAL_SC_TRANSFER_START)) gb->serial->transfer_end = UINT64_MAX;
+    else if (!running) serial_start(gb);
+}
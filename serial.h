@@ -4,15 +4,27 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// The internal clock shifts a bit on every falling edge of bit 8 of the divider, 8192 times a second
+#define SERIAL_BIT_CYCLES (512)
+
 typedef struct GameBoy GameBoy;
 
 typedef struct Serial {
     uint8_t sb;
     uint8_t sc;
+    uint8_t received;      // The byte shifting in, it only lands in SB once the transfer completes
+    uint64_t transfer_end; // The cycle the transfer in progress completes on, UINT64_MAX while none is clocked
 } Serial;
 
 void serial_initialize(Serial * const s, bool skip_bootrom);
 
+// Completes a transfer that is due and starts an externally clocked one once the other side has a byte.
+// Transfers are only checked here, at the deadlines they set, so nothing runs for them per cycle.
+void serial_update(GameBoy * const gb);
+
+uint8_t serial_read_sb(GameBoy const * const gb);
+
 uint8_t serial_read_sc(GameBoy const * const gb);
+void serial_write_sc(GameBoy * const gb, uint8_t value);
 
 #endif /* !TRTLE_SERIAL_H */
@@ -0,0 +1,155 @@
+#include "speculation.h"
+
+#include <stdlib.h>
+
+#include "cartridge.h"
+#include "logger.h"
+
+#define SPECULATION_BUTTONS (8)
+
+struct Speculation {
+    Batch * batch;
+    size_t capacity;
+    uint8_t * displays; // Where the batch copies each branch's frame, only asked for so the frames get drawn
+    uint32_t edges[SPECULATION_BUTTONS]; // How often each button changed between frames, to pick the likeliest toggles
+    uint64_t hits;
+    uint64_t misses;
+
+    // The branches in flight, all forked from parent at cycles
+    GameBoy * parent;
+    uint64_t cycles;
+    uint8_t held;
+    size_t count;
+    GameBoy * branches[SPECULATION_MAX_BRANCHES];
+    uint8_t masks[SPECULATION_MAX_BRANCHES];
+};
+
+Speculation * speculation_create(Batch * const batch, size_t branches) {
+    if (batch == NULL) {
+        TRTLE_LOG_ERR("Attempted to pass a null argument into speculation_create");
+        return NULL;
+    }
+    if (branches == 0 || branches > SPECULATION_MAX_BRANCHES) branches = SPECULATION_MAX_BRANCHES;
+
+    Speculation * speculation = calloc(1, sizeof(Speculation));
+    if (speculation == NULL) return NULL;
+
+    speculation->displays = malloc(branches * GAMEBOY_DISPLAY_PACKED_SIZE);
+    if (speculation->displays == NULL) {
+        free(speculation);
+        return NULL;
+    }
+    speculation->batch = batch;
+    speculation->capacity = branches;
+    return speculation;
+}
+
+void speculation_delete(Speculation * speculation) {
+    if (speculation == NULL) return;
+
+    speculation_discard(speculation);
+    free(speculation->displays);
+    free(speculation);
+}
+
+// Buttons by how often they changed, ties going to the lower bit
+static void speculation_rank_buttons(Speculation const * const speculation, uint8_t order[SPECULATION_BUTTONS]) {
+    for (uint8_t button = 0; button < SPECULATION_BUTTONS; button++) {
+        uint8_t i = button;
+        for (; i > 0 && speculation->edges[order[i - 1]] < speculation->edges[button]; i--) order[i] = order[i - 1];
+        order[i] = button;
+    }
+}
+
+bool speculation_start(Speculation * const speculation, GameBoy * const gb, uint8_t mask) {
+    if (speculation == NULL || gb == NULL) {
+        TRTLE_LOG_ERR("Null argument received while starting speculation");
+        return false;
+    }
+
+    speculation_discard(speculation);
+    if (gameboy_get_link(gb) != NULL) return false;
+
+    uint8_t order[SPECULATION_BUTTONS];
+    speculation_rank_buttons(speculation, order);
+    speculation->masks[0] = mask;
+    for (size_t i = 1; i < speculation->capacity; i++) speculation->masks[i] = mask ^ (1u << order[i - 1]);
+
+    for (size_t i = 0; i < speculation->capacity; i++) {
+        speculation->branches[i] = gameboy_fork(gb);
+        if (speculation->branches[i] == NULL) {
+            TRTLE_LOG_WARN("Failed to fork speculative branch %zu\n", i);
+            speculation_discard(speculation);
+            return false;
+        }
+        speculation->count++;
+    }
+    speculation->parent = gb;
+    speculation->cycles = gb->cycles;
+    speculation->held = mask;
+
+    BatchOutput output = { BATCH_OUTPUT_DISPLAY, 0, 0, speculation->displays };
+    if (!batch_step(speculation->batch, speculation->branches, speculation->masks, speculation->count, 1, &output)) {
+        speculation_discard(speculation);
+        return false;
+    }
+    return true;
+}
+
+bool speculation_commit(Speculation * const speculation, GameBoy * const gb, uint8_t mask) {
+    if (speculation == NULL || gb == NULL) {
+        TRTLE_LOG_ERR("Null argument received while committing speculation");
+        return false;
+    }
+
+    // Branches of another instance, or of one that has run since, no longer follow from gb
+    if (speculation->count == 0 || speculation->parent != gb || speculation->cycles != gb->cycles) {
+        speculation_discard(speculation);
+        return false;
+    }
+
+    uint8_t changed = speculation->held ^ mask;
+    for (uint8_t button = 0; button < SPECULATION_BUTTONS; button++) {
+        if (changed & (1u << button)) speculation->edges[button]++;
+    }
+
+    GameBoy * branch = NULL;
+    for (size_t i = 0; i < speculation->count; i++) {
+        if (speculation->masks[i] != mask) continue;
+        branch = speculation->branches[i];
+        speculation->branches[i] = NULL;
+        break;
+    }
+
+    // The losers go first, so ram and pages they still share with the winner need not be copied when it is adopted
+    speculation_discard(speculation);
+    if (branch == NULL || !gameboy_adopt(gb, branch)) {
+        gameboy_delete(branch);
+        speculation->misses++;
+        return false;
+    }
+
+    // The branch ended its frame without the save file, so gb counts it towards the next flush instead
+    cartridge_end_frame(gb);
+    speculation->hits++;
+    return true;
+}
+
+void speculation_discard(Speculation * const speculation) {
+    if (speculation == NULL) return;
+
+    for (size_t i = 0; i < speculation->count; i++) {
+        gameboy_delete(speculation->branches[i]);
+        speculation->branches[i] = NULL;
+    }
+    speculation->count = 0;
+    speculation->parent = NULL;
+}
+
+uint64_t speculation_get_hits(Speculation const * const speculation) {
+    return speculation->hits;
+}
+
+uint64_t speculation_get_misses(Speculation const * const speculation) {
+    return speculation->misses;
+}
@@ -0,0 +1,33 @@
+#ifndef TRTLE_SPECULATION_H
+#define TRTLE_SPECULATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "batch.h"
+#include "gameboy.h"
+
+#define SPECULATION_MAX_BRANCHES (9) // The buttons held as they are, and each of the eight pressed or released
+
+typedef struct Speculation Speculation;
+
+// Runs the next frame ahead of time for the inputs most likely to come, one fork per input on the batch's workers,
+// so once the real input arrives its frame is usually already done. 0 branches uses the most there are.
+Speculation * speculation_create(Batch * const batch, size_t branches);
+void speculation_delete(Speculation * speculation);
+
+// Forks gb once per branch and runs a frame on each, starting with mask held as it is and then toggling the buttons
+// that changed most often so far. gb must not run again until the branches are committed or discarded. Linked
+// instances are not speculated on, their peer would have to be forked along with them.
+bool speculation_start(Speculation * const speculation, GameBoy * const gb, uint8_t mask);
+
+// Adopts the branch that held mask into gb and discards the rest. Returns false on a miss, in which case gb is
+// untouched and the frame still has to be run.
+bool speculation_commit(Speculation * const speculation, GameBoy * const gb, uint8_t mask);
+void speculation_discard(Speculation * const speculation);
+
+uint64_t speculation_get_hits(Speculation const * const speculation);
+uint64_t speculation_get_misses(Speculation const * const speculation);
+
+#endif /* !TRTLE_SPECULATION_H */
@@ -0,0 +1,48 @@
+#include "test.h"
+
+static uint8_t const program[] = {
+    0x18, 0xFE, // jr -2
+};
+
+int main(int argc, char ** argv) {
+    (void)argc;
+
+    // MBC3 selects clock registers from bank 8 on, so a 128KB header is clamped to the 64KB it can reach
+    CartridgeImage * image = test_cartridge(program, sizeof(program), MBC_MBC3_TIMER_RAM_BATTERY, 0x04);
+    TEST_CHECK(image->ram_size == 0x10000);
+    GameBoy * gb = test_console(image);
+    cartridge_image_release(image);
+    TEST_CHECK(gb->cartridge->ram_size == 0x10000);
+
+    // The footer goes straight after ram, both in the file and in the dirty page bits
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.sav", argv[0]);
+    remove(path);
+    TEST_CHECK(cartridge_attach_save_file(gb, path, 1) == CARTRIDGE_ERROR_NONE);
+
+    gameboy_write(gb, 0x0000, 0x0A); // Enable ram and the clock
+    gameboy_write(gb, 0x4000, 0x07); // Last ram bank
+    gameboy_write(gb, 0xBFFF, 0x5A);
+    gameboy_write(gb, 0x4000, 0x08); // Seconds register
+    gameboy_write(gb, 0xA000, 0x2A);
+    cartridge_flush(gb);
+    gameboy_delete(gb);
+
+    FILE * file = fopen(path, "rb");
+    TEST_CHECK(file != NULL);
+    static uint8_t save[0x10000 + CARTRIDGE_RTC_SAVE_SIZE + 1];
+    size_t size = fread(save, 1, sizeof(save), file);
+    fclose(file);
+    remove(path);
+    TEST_CHECK(size == 0x10000 + CARTRIDGE_RTC_SAVE_SIZE);
+    TEST_CHECK(save[0xFFFF] == 0x5A);
+    TEST_CHECK(save[0x10000] == 0x2A);
+
+    // Other controllers keep the full 128KB
+    image = test_cartridge(program, sizeof(program), MBC_MBC5_RAM_BATTERY, 0x04);
+    TEST_CHECK(image->ram_size == 0x20000);
+    cartridge_image_release(image);
+
+    printf("cartridge: passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+#include "test.h"
+
+#define FORK_COUNT  (8)
+#define FORK_FRAMES (4)
+
+// Mixes the buttons with the divider into VRAM, so every fork takes its own pages, map and tile cache
+static uint8_t const program[] = {
+    0xF3,             // di
+    0x21, 0x00, 0x80, // ld hl, 0x8000
+    0x3E, 0x10,       // loop: ld a, 0x10
+    0xE0, 0x00,       // ldh (P1), a
+    0xF0, 0x00,       // ldh a, (P1)
+    0x47,             // ld b, a
+    0xF0, 0x04,       // ldh a, (DIV)
+    0xA8,             // xor b
+    0x22,             // ld (hl+), a
+    0x7C,             // ld a, h
+    0xFE, 0xA0,       // cp 0xA0
+    0x20, 0x02,       // jr nz, +2
+    0x26, 0x80,       // ld h, 0x80
+    0x18, 0xEC,       // jr loop
+};
+
+// A console of its own loaded from the parent's state, so nothing it runs on is shared
+static GameBoy * test_copy(CartridgeImage * image, GameBoy * parent) {
+    size_t size = gameboy_get_state_size(parent);
+    uint8_t * state = malloc(size);
+    TEST_CHECK(state != NULL);
+    TEST_CHECK(gameboy_save_state(parent, state, size));
+    GameBoy * copy = test_console(image);
+    TEST_CHECK(gameboy_load_state(copy, state, size));
+    free(state);
+    return copy;
+}
+
+int main(void) {
+    CartridgeImage * image = test_rom(program, sizeof(program));
+    GameBoy * parent = test_console(image);
+    for (size_t frame = 0; frame < 10; frame++) TEST_CHECK(gameboy_run_frame(parent, test_input(0)));
+
+    GameBoy * untouched = test_copy(image, parent);
+    GameBoy * forks[FORK_COUNT];
+    GameBoy * copies[FORK_COUNT];
+    uint8_t actions[FORK_COUNT];
+    for (size_t i = 0; i < FORK_COUNT; i++) {
+        forks[i] = gameboy_fork(parent);
+        TEST_CHECK(forks[i] != NULL);
+        copies[i] = test_copy(image, parent);
+        actions[i] = (uint8_t)(i * 0x25);
+    }
+
+    // The forks copy shared pages, maps and caches on several threads at once while the others still hold them
+    Batch * batch = batch_create(4);
+    TEST_CHECK(batch != NULL);
+    static uint8_t display[FORK_COUNT][GAMEBOY_DISPLAY_PACKED_SIZE];
+    BatchOutput output = { BATCH_OUTPUT_DISPLAY, 0, 0, display[0] };
+    TEST_CHECK(batch_step(batch, forks, actions, FORK_COUNT, FORK_FRAMES, &output));
+
+    uint8_t shades[GAMEBOY_DISPLAY_PACKED_SIZE];
+    for (size_t i = 0; i < FORK_COUNT; i++) {
+        for (size_t frame = 0; frame < FORK_FRAMES; frame++) TEST_CHECK(gameboy_run_frame(copies[i], test_input(actions[i])));
+        TEST_CHECK(test_same_state(forks[i], copies[i]));
+        TEST_CHECK(gameboy_get_display_shades(copies[i], shades, sizeof(shades)) == sizeof(shades));
+        TEST_CHECK(memcmp(display[i], shades, sizeof(shades)) == 0);
+    }
+
+    // None of it leaks back into the parent
+    TEST_CHECK(test_same_state(parent, untouched));
+    TEST_CHECK(gameboy_run_frame(parent, test_input(0)));
+    TEST_CHECK(gameboy_run_frame(untouched, test_input(0)));
+    TEST_CHECK(test_same_state(parent, untouched));
+
+    batch_delete(batch);
+    for (size_t i = 0; i < FORK_COUNT; i++) {
+        gameboy_delete(forks[i]);
+        gameboy_delete(copies[i]);
+    }
+    gameboy_delete(untouched);
+    gameboy_delete(parent);
+    cartridge_image_release(image);
+
+    printf("fork: passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+#include "test.h"
+
+#define LINK_BYTES (8)
+
+// Sends LINK_BYTES counting up from a first byte, storing each one received from 0xC000, then keeps copying the
+// buttons into 0xD000 so the consoles also depend on input. The first byte and the clock are patched in per side.
+static uint8_t const program[] = {
+    0xF3,             // di
+    0x21, 0x00, 0xC0, // ld hl, 0xC000
+    0x06, 0x00,       // ld b, first byte
+    0x78,             // loop: ld a, b
+    0xE0, 0x01,       // ldh (SB), a
+    0x3E, 0x80,       // ld a, SC
+    0xE0, 0x02,       // ldh (SC), a
+    0xF0, 0x02,       // wait: ldh a, (SC)
+    0xE6, 0x80,       // and 0x80
+    0x20, 0xFA,       // jr nz, wait
+    0xF0, 0x01,       // ldh a, (SB)
+    0x22,             // ld (hl+), a
+    0x04,             // inc b
+    0x7D,             // ld a, l
+    0xFE, LINK_BYTES, // cp LINK_BYTES
+    0x20, 0xEA,       // jr nz, loop
+    0x3E, 0x10,       // buttons: ld a, 0x10
+    0xE0, 0x00,       // ldh (P1), a
+    0xF0, 0x00,       // ldh a, (P1)
+    0xEA, 0x00, 0xD0, // ld (0xD000), a
+    0x18, 0xF5,       // jr buttons
+};
+
+#define LINK_FIRST_BYTE (5)
+#define LINK_CLOCK      (10)
+
+static CartridgeImage * link_rom(uint8_t first, bool internal_clock) {
+    uint8_t code[sizeof(program)];
+    memcpy(code, program, sizeof(program));
+    code[LINK_FIRST_BYTE] = first;
+    code[LINK_CLOCK] = internal_clock ? 0x81 : 0x80;
+    return test_rom(code, sizeof(code));
+}
+
+static void check_received(GameBoy * gb, uint8_t first) {
+    for (uint16_t i = 0; i < LINK_BYTES; i++) TEST_CHECK(gameboy_read(gb, 0xC000 + i) == (uint8_t)(first + i));
+}
+
+// The clocking side shifts its bytes into the other while receiving the other's in return
+static void test_exchange(CartridgeImage * master_rom, CartridgeImage * slave_rom) {
+    GameBoy * master = test_console(master_rom);
+    GameBoy * slave = test_console(slave_rom);
+    TEST_CHECK(gameboy_link(master, slave));
+    TEST_CHECK(gameboy_get_link(master) == slave && gameboy_get_link(slave) == master);
+
+    for (int frame = 0; frame < 3; frame++) gameboy_link_run_frame(master, test_input(0), test_input(0));
+    check_received(master, 0xA0);
+    check_received(slave, 0x10);
+
+    gameboy_delete(slave);
+    TEST_CHECK(gameboy_get_link(master) == NULL);
+    gameboy_delete(master);
+}
+
+// A linked pair in a rollback session runs through gameboy_link_run_frame on both peers and must stay in sync
+static void test_rollback(CartridgeImage * master_rom, CartridgeImage * slave_rom) {
+    RollbackLoopback * loopback = rollback_loopback_create(2);
+    TEST_CHECK(loopback != NULL);
+
+    GameBoy * consoles[2][ROLLBACK_PLAYERS];
+    RollbackSession * sessions[2];
+    for (size_t side = 0; side < 2; side++) {
+        consoles[side][0] = test_console(master_rom);
+        consoles[side][1] = test_console(slave_rom);
+        TEST_CHECK(gameboy_link(consoles[side][0], consoles[side][1]));
+        sessions[side] = rollback_create(consoles[side], side, rollback_loopback_get_transport(loopback, side));
+        TEST_CHECK(sessions[side] != NULL);
+    }
+
+    for (uint32_t frame = 0; frame < 150; frame++) {
+        for (size_t side = 0; side < 2; side++) {
+            uint8_t mask = frame < 120 ? (frame / (3 + side)) & GAMEBOY_BUTTON_A : 0;
+            TEST_CHECK(rollback_advance(sessions[side], test_input(mask)) == ROLLBACK_OK);
+        }
+    }
+
+    for (size_t side = 0; side < 2; side++) TEST_CHECK(rollback_get_resimulated_frames(sessions[side]) > 0);
+    for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) {
+        TEST_CHECK(test_same_state(consoles[0][player], consoles[1][player]));
+    }
+    for (size_t side = 0; side < 2; side++) {
+        check_received(consoles[side][0], 0xA0);
+        check_received(consoles[side][1], 0x10);
+    }
+
+    for (size_t side = 0; side < 2; side++) {
+        rollback_delete(sessions[side]);
+        for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) gameboy_delete(consoles[side][player]);
+    }
+    rollback_loopback_delete(loopback);
+}
+
+int main(void) {
+    CartridgeImage * master_rom = link_rom(0x10, true);
+    CartridgeImage * slave_rom = link_rom(0xA0, false);
+    test_exchange(master_rom, slave_rom);
+    test_rollback(master_rom, slave_rom);
+    cartridge_image_release(slave_rom);
+    cartridge_image_release(master_rom);
+
+    printf("link: passed\n");
+    return EXIT_SUCCESS;
+}
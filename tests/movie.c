@@ -0,0 +1,72 @@
+#include "test.h"
+
+#define MOVIE_INTERVAL (8)
+
+// Stores the buttons into WRAM, so the input shows up in the keyframes
+static uint8_t const program[] = {
+    0xF3,             // di
+    0x3E, 0x10,       // loop: ld a, 0x10
+    0xE0, 0x00,       // ldh (P1), a
+    0xF0, 0x00,       // ldh a, (P1)
+    0xEA, 0x00, 0xC0, // ld (0xC000), a
+    0x18, 0xF5,       // jr loop
+};
+
+static size_t test_read_file(char const * path, uint8_t * data, size_t capacity) {
+    FILE * file = fopen(path, "rb");
+    TEST_CHECK(file != NULL);
+    size_t size = fread(data, 1, capacity, file);
+    fclose(file);
+    return size;
+}
+
+static void test_write_file(char const * path, uint8_t const * data, size_t size) {
+    FILE * file = fopen(path, "wb");
+    TEST_CHECK(file != NULL);
+    TEST_CHECK(fwrite(data, 1, size, file) == size);
+    fclose(file);
+}
+
+int main(int argc, char ** argv) {
+    (void)argc;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.movie", argv[0]);
+
+    CartridgeImage * image = test_rom(program, sizeof(program));
+    GameBoy * gb = test_console(image);
+    Movie * movie = movie_create(gb, MOVIE_INTERVAL);
+    TEST_CHECK(movie != NULL);
+    for (uint32_t frame = 0; frame < MOVIE_INTERVAL * 2; frame++) {
+        TEST_CHECK(movie_record_frame(movie, gb, test_input(frame & GAMEBOY_BUTTON_A)));
+    }
+    TEST_CHECK(movie_get_keyframe_count(movie) == 2);
+    TEST_CHECK(movie_save(movie, path));
+    movie_delete(movie);
+
+    movie = movie_load(path);
+    TEST_CHECK(movie != NULL);
+    TEST_CHECK(movie_get_frame_count(movie) == MOVIE_INTERVAL * 2);
+    TEST_CHECK(movie_get_keyframe_count(movie) == 2);
+    movie_delete(movie);
+
+    // One more frame would have taken a third keyframe, so two are too few
+    static uint8_t data[0x100000];
+    size_t size = test_read_file(path, data, sizeof(data));
+    TEST_CHECK(size > 32 && size < sizeof(data));
+    data[16]++; // Frame count, little endian
+    test_write_file(path, data, size);
+    TEST_CHECK(movie_load(path) == NULL);
+
+    // And a keyframe count of zero is never valid
+    data[16]--;
+    memset(data + 28, 0, 4);
+    test_write_file(path, data, size);
+    TEST_CHECK(movie_load(path) == NULL);
+
+    remove(path);
+    gameboy_delete(gb);
+    cartridge_image_release(image);
+
+    printf("movie: passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+#include "test.h"
+
+#define REWIND_BUDGET   (0x10000)
+#define REWIND_KEYFRAME (8)
+#define REWIND_FRAMES   (300)
+
+// Mixes the action buttons with the divider into a ring in WRAM, so every capture differs from the last
+static uint8_t const program[] = {
+    0xF3,             // di
+    0x21, 0x00, 0xC0, // ld hl, 0xC000
+    0x3E, 0x10,       // loop: ld a, 0x10
+    0xE0, 0x00,       // ldh (P1), a
+    0xF0, 0x00,       // ldh a, (P1)
+    0x47,             // ld b, a
+    0xF0, 0x04,       // ldh a, (DIV)
+    0xA8,             // xor b
+    0x22,             // ld (hl+), a
+    0x7C,             // ld a, h
+    0xFE, 0xD0,       // cp 0xD0
+    0x20, 0x02,       // jr nz, +2
+    0x26, 0xC0,       // ld h, 0xC0
+    0x18, 0xEC,       // jr loop
+};
+
+// Every capture is kept whole on the side, states[i] being the one taken after i frames
+static uint8_t * states[REWIND_FRAMES * 2];
+static size_t state_size;
+
+static void test_capture(RewindBuffer * rewind, GameBoy * gb, size_t index) {
+    TEST_CHECK(index < sizeof(states) / sizeof(states[0]));
+    if (states[index] == NULL) states[index] = malloc(state_size);
+    TEST_CHECK(states[index] != NULL);
+    TEST_CHECK(gameboy_save_state(gb, states[index], state_size));
+    TEST_CHECK(rewind_buffer_push(rewind, gb));
+}
+
+static void test_seek(RewindBuffer * rewind, GameBoy * gb, size_t * newest, size_t steps) {
+    size_t count = rewind_buffer_get_count(rewind);
+    TEST_CHECK(rewind_buffer_seek(rewind, gb, steps));
+    TEST_CHECK(rewind_buffer_get_count(rewind) == count - steps);
+    *newest -= steps;
+
+    uint8_t * state = malloc(state_size);
+    TEST_CHECK(state != NULL);
+    TEST_CHECK(gameboy_save_state(gb, state, state_size));
+    TEST_CHECK(memcmp(state, states[*newest], state_size) == 0);
+    free(state);
+}
+
+static void test_run(RewindBuffer * rewind, GameBoy * gb, size_t * newest, size_t frames, uint8_t mask) {
+    for (size_t frame = 0; frame < frames; frame++) {
+        TEST_CHECK(gameboy_run_frame(gb, test_input((frame / 3) % 2 ? mask : 0)));
+        test_capture(rewind, gb, ++*newest);
+    }
+}
+
+int main(void) {
+    CartridgeImage * image = test_rom(program, sizeof(program));
+    GameBoy * gb = test_console(image);
+    cartridge_image_release(image);
+    state_size = gameboy_get_state_size(gb);
+
+    RewindBuffer * rewind = rewind_buffer_create(REWIND_BUDGET, 1, REWIND_KEYFRAME);
+    TEST_CHECK(rewind != NULL);
+    size_t newest = 0;
+    test_capture(rewind, gb, newest);
+    test_run(rewind, gb, &newest, REWIND_FRAMES - 1, GAMEBOY_BUTTON_A);
+
+    // The ring wrapped and dropped the oldest captures, but kept enough to reach past several keyframes
+    size_t count = rewind_buffer_get_count(rewind);
+    TEST_CHECK(count < REWIND_FRAMES);
+    TEST_CHECK(count > REWIND_KEYFRAME * 3);
+    TEST_CHECK(rewind_buffer_get_used(rewind) <= REWIND_BUDGET);
+    TEST_CHECK(!rewind_buffer_seek(rewind, gb, count));
+
+    // One step back is a single delta from the newest capture
+    test_seek(rewind, gb, &newest, 1);
+
+    // Further back than a keyframe interval, so the seek starts from a keyframe and replays deltas across another
+    test_seek(rewind, gb, &newest, REWIND_KEYFRAME + 3);
+
+    // Captures taken after a seek replace the discarded ones and evict as usual
+    test_run(rewind, gb, &newest, REWIND_FRAMES / 2, GAMEBOY_BUTTON_B);
+    TEST_CHECK(rewind_buffer_get_used(rewind) <= REWIND_BUDGET);
+    test_seek(rewind, gb, &newest, REWIND_KEYFRAME * 2 + 1);
+
+    // All the way back to the oldest capture still in the ring
+    test_seek(rewind, gb, &newest, rewind_buffer_get_count(rewind) - 1);
+    TEST_CHECK(rewind_buffer_get_count(rewind) == 1);
+    TEST_CHECK(!rewind_buffer_pop(rewind, gb));
+
+    rewind_buffer_delete(rewind);
+    for (size_t i = 0; i < sizeof(states) / sizeof(states[0]); i++) free(states[i]);
+    gameboy_delete(gb);
+
+    printf("rewind: passed\n");
+    return EXIT_SUCCESS;
+}
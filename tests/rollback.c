@@ -0,0 +1,131 @@
+#include "test.h"
+
+// Mixes the action buttons with the divider into a ring in WRAM, so every input leaves its mark on the state
+static uint8_t const program[] = {
+    0xF3,             // di
+    0x21, 0x00, 0xC0, // ld hl, 0xC000
+    0x3E, 0x10,       // loop: ld a, 0x10
+    0xE0, 0x00,       // ldh (P1), a
+    0xF0, 0x00,       // ldh a, (P1)
+    0x47,             // ld b, a
+    0xF0, 0x04,       // ldh a, (DIV)
+    0xA8,             // xor b
+    0x22,             // ld (hl+), a
+    0x7C,             // ld a, h
+    0xFE, 0xD0,       // cp 0xD0
+    0x20, 0x02,       // jr nz, +2
+    0x26, 0xC0,       // ld h, 0xC0
+    0x18, 0xEC,       // jr loop
+};
+
+typedef struct LossyTransport {
+    RollbackTransport inner;
+    uint32_t sends;
+} LossyTransport;
+
+// Every fourth message is lost, the inputs in it have to reach the peer with a later one
+static bool lossy_send(void * context, void const * data, size_t size) {
+    LossyTransport * lossy = context;
+    if (++lossy->sends % 4 == 0) return true;
+    return lossy->inner.send(lossy->inner.context, data, size);
+}
+
+static size_t lossy_receive(void * context, void * data, size_t capacity) {
+    LossyTransport * lossy = context;
+    return lossy->inner.receive(lossy->inner.context, data, capacity);
+}
+
+typedef struct Peer {
+    GameBoy * consoles[ROLLBACK_PLAYERS];
+    LossyTransport lossy;
+    RollbackSession * session;
+} Peer;
+
+static void peer_create(Peer * peer, CartridgeImage * image, RollbackLoopback * loopback, size_t side) {
+    for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) peer->consoles[player] = test_console(image);
+    peer->lossy = (LossyTransport){ rollback_loopback_get_transport(loopback, side), 0 };
+    RollbackTransport transport = { &peer->lossy, lossy_send, lossy_receive };
+    peer->session = rollback_create(peer->consoles, side, transport);
+    TEST_CHECK(peer->session != NULL);
+}
+
+static void peer_delete(Peer * peer) {
+    rollback_delete(peer->session);
+    for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) gameboy_delete(peer->consoles[player]);
+}
+
+// Player p flips A and B on its own rhythm, so the other side keeps mispredicting it
+static uint8_t player_input(size_t player, uint32_t frame) {
+    return (frame / (5 + 2 * player)) & (GAMEBOY_BUTTON_A | GAMEBOY_BUTTON_B);
+}
+
+static void test_sessions(CartridgeImage * image) {
+    RollbackLoopback * loopback = rollback_loopback_create(3);
+    TEST_CHECK(loopback != NULL);
+    Peer peers[2];
+    for (size_t side = 0; side < 2; side++) peer_create(&peers[side], image, loopback, side);
+
+    uint32_t frame = 0;
+    for (; frame < 240; frame++) {
+        for (size_t side = 0; side < 2; side++) {
+            TEST_CHECK(rollback_advance(peers[side].session, test_input(player_input(side, frame))) == ROLLBACK_OK);
+        }
+    }
+    for (size_t side = 0; side < 2; side++) TEST_CHECK(rollback_get_resimulated_frames(peers[side].session) > 0);
+
+    // Once the inputs hold still every prediction comes true, and both peers settle on the same consoles
+    for (uint32_t held = frame + 30; frame < held; frame++) {
+        for (size_t side = 0; side < 2; side++) {
+            TEST_CHECK(rollback_advance(peers[side].session, test_input(player_input(side, 239))) == ROLLBACK_OK);
+        }
+    }
+    for (size_t player = 0; player < ROLLBACK_PLAYERS; player++) {
+        TEST_CHECK(test_same_state(peers[0].consoles[player], peers[1].consoles[player]));
+    }
+
+    // A byte changed on one peer only must be caught by the checksums of the frames confirmed after it
+    gameboy_write(peers[0].consoles[1], 0xFF90, gameboy_read(peers[0].consoles[1], 0xFF90) ^ 0xFF);
+    bool desync[2] = { false, false };
+    for (uint32_t held = frame + 40; frame < held && !(desync[0] && desync[1]); frame++) {
+        for (size_t side = 0; side < 2; side++) {
+            RollbackResult result = rollback_advance(peers[side].session, test_input(player_input(side, 239)));
+            TEST_CHECK(result != ROLLBACK_STALLED);
+            desync[side] |= result == ROLLBACK_DESYNC;
+        }
+    }
+    TEST_CHECK(desync[0] && desync[1]);
+
+    for (size_t side = 0; side < 2; side++) peer_delete(&peers[side]);
+    rollback_loopback_delete(loopback);
+}
+
+// A message too large for the receiver is lost like an oversized datagram, without holding up the ones behind it
+static void test_loopback_oversized(void) {
+    RollbackLoopback * loopback = rollback_loopback_create(0);
+    TEST_CHECK(loopback != NULL);
+    RollbackTransport sender = rollback_loopback_get_transport(loopback, 0);
+    RollbackTransport receiver = rollback_loopback_get_transport(loopback, 1);
+
+    uint8_t large[ROLLBACK_MESSAGE_MAX] = { 0 };
+    uint8_t small[4] = { 1, 2, 3, 4 };
+    TEST_CHECK(sender.send(sender.context, large, sizeof(large)));
+    TEST_CHECK(sender.send(sender.context, small, sizeof(small)));
+    TEST_CHECK(receiver.send(receiver.context, small, sizeof(small)));
+
+    uint8_t data[8];
+    TEST_CHECK(receiver.receive(receiver.context, data, sizeof(data)) == sizeof(small));
+    TEST_CHECK(memcmp(data, small, sizeof(small)) == 0);
+    TEST_CHECK(receiver.receive(receiver.context, data, sizeof(data)) == 0);
+
+    rollback_loopback_delete(loopback);
+}
+
+int main(void) {
+    CartridgeImage * image = test_rom(program, sizeof(program));
+    test_sessions(image);
+    test_loopback_oversized();
+    cartridge_image_release(image);
+
+    printf("rollback: passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+#include "test.h"
+
+#define SPECULATION_FRAMES (90)
+
+// Mixes the action buttons with the divider into cartridge ram, switching banks on A and B, so a branch that adopts
+// the wrong input or drops a ram write never matches
+static uint8_t const program[] = {
+    0xF3,             // di
+    0x3E, 0x0A,       // ld a, 0x0A
+    0xEA, 0x00, 0x00, // ld (0x0000), a
+    0x21, 0x00, 0xA0, // ld hl, 0xA000
+    0x3E, 0x10,       // loop: ld a, 0x10
+    0xE0, 0x00,       // ldh (P1), a
+    0xF0, 0x00,       // ldh a, (P1)
+    0x47,             // ld b, a
+    0xE6, 0x03,       // and 0x03
+    0xEA, 0x00, 0x40, // ld (0x4000), a
+    0xF0, 0x04,       // ldh a, (DIV)
+    0xA8,             // xor b
+    0x22,             // ld (hl+), a
+    0x7C,             // ld a, h
+    0xFE, 0xC0,       // cp 0xC0
+    0x20, 0x02,       // jr nz, +2
+    0x26, 0xA0,       // ld h, 0xA0
+    0x18, 0xE7,       // jr loop
+};
+
+// Mostly held or single button changes the branches cover, with both A and B flipping at once every so often
+static uint8_t test_mask(uint32_t frame) {
+    uint8_t mask = (frame / 3) % 2 ? GAMEBOY_BUTTON_A : 0;
+    if ((frame / 10) % 2) mask ^= GAMEBOY_BUTTON_A | GAMEBOY_BUTTON_B;
+    if ((frame / 7) % 2) mask |= GAMEBOY_BUTTON_START;
+    return mask;
+}
+
+int main(void) {
+    CartridgeImage * image = test_cartridge(program, sizeof(program), MBC_MBC5_RAM_BATTERY, 0x03);
+    GameBoy * gb = test_console(image);
+    GameBoy * reference = test_console(image);
+    cartridge_image_release(image);
+
+    Batch * batch = batch_create(2);
+    TEST_CHECK(batch != NULL);
+    Speculation * speculation = speculation_create(batch, 0);
+    TEST_CHECK(speculation != NULL);
+
+    size_t size = gameboy_get_state_size(gb);
+    uint8_t * before = malloc(size);
+    uint8_t * after = malloc(size);
+    TEST_CHECK(before != NULL && after != NULL);
+    uint8_t shades[GAMEBOY_DISPLAY_PACKED_SIZE];
+    uint8_t reference_shades[GAMEBOY_DISPLAY_PACKED_SIZE];
+
+    uint8_t held = 0;
+    for (uint32_t frame = 0; frame < SPECULATION_FRAMES; frame++) {
+        uint8_t mask = test_mask(frame);
+        TEST_CHECK(gameboy_save_state(gb, before, size));
+        TEST_CHECK(speculation_start(speculation, gb, held));
+
+        if (!speculation_commit(speculation, gb, mask)) {
+            // A miss leaves the instance exactly as the branches were started from
+            TEST_CHECK(gameboy_save_state(gb, after, size));
+            TEST_CHECK(memcmp(before, after, size) == 0);
+            TEST_CHECK(gameboy_run_frame(gb, test_input(mask)));
+        }
+
+        // Committed or not, the frame has to come out as if it had been run directly
+        TEST_CHECK(gameboy_run_frame(reference, test_input(mask)));
+        TEST_CHECK(test_same_state(gb, reference));
+        TEST_CHECK(gameboy_get_display_shades(gb, shades, sizeof(shades)) == sizeof(shades));
+        TEST_CHECK(gameboy_get_display_shades(reference, reference_shades, sizeof(reference_shades)) == sizeof(reference_shades));
+        TEST_CHECK(memcmp(shades, reference_shades, sizeof(shades)) == 0);
+        held = mask;
+    }
+    TEST_CHECK(speculation_get_hits(speculation) > 0);
+    TEST_CHECK(speculation_get_misses(speculation) > 0);
+    TEST_CHECK(speculation_get_hits(speculation) + speculation_get_misses(speculation) == SPECULATION_FRAMES);
+
+    free(before);
+    free(after);
+    speculation_delete(speculation);
+    batch_delete(batch);
+    gameboy_delete(reference);
+    gameboy_delete(gb);
+
+    printf("speculation: passed\n");
+    return EXIT_SUCCESS;
+}
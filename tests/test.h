@@ -0,0 +1,74 @@
+#ifndef TRTLE_TESTS_TEST_H
+#define TRTLE_TESTS_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trtle.h"
+
+// Each test is a program of its own that stops at the first failed check and exits non-zero
+#define TEST_CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define TEST_ROM_SIZE  (0x8000)
+#define TEST_ROM_ENTRY (0x150)
+
+// A cartridge of the given header type and ram size code running code from 0x150, with just enough of a header to load
+static inline CartridgeImage * test_cartridge(uint8_t const * code, size_t size, MBC type, uint8_t ram_size) {
+    static uint8_t rom[TEST_ROM_SIZE];
+    memset(rom, 0, sizeof(rom));
+    rom[0x147] = type;
+    rom[0x149] = ram_size;
+    rom[0x101] = 0xC3; // jp 0x150
+    rom[0x102] = TEST_ROM_ENTRY & 0xFF;
+    rom[0x103] = TEST_ROM_ENTRY >> 8;
+    memcpy(rom + TEST_ROM_ENTRY, code, size);
+
+    uint8_t checksum = 0;
+    for (size_t i = 0x134; i < 0x14D; i++) checksum = checksum - rom[i] - 1;
+    rom[0x14D] = checksum;
+
+    CartridgeImage * image = NULL;
+    TEST_CHECK(cartridge_image_from_memory(&image, rom, sizeof(rom)) == CARTRIDGE_ERROR_NONE);
+    return image;
+}
+
+static inline CartridgeImage * test_rom(uint8_t const * code, size_t size) {
+    return test_cartridge(code, size, MBC_NONE, 0x00);
+}
+
+static inline GameBoy * test_console(CartridgeImage * image) {
+    GameBoy * gb = gameboy_create();
+    TEST_CHECK(gb != NULL);
+    TEST_CHECK(gameboy_set_cartridge(gb, image));
+    return gb;
+}
+
+static inline GameBoyInput test_input(uint8_t mask) {
+    GameBoyInput input = {
+        mask & GAMEBOY_BUTTON_A, mask & GAMEBOY_BUTTON_B, mask & GAMEBOY_BUTTON_START, mask & GAMEBOY_BUTTON_SELECT,
+        mask & GAMEBOY_BUTTON_UP, mask & GAMEBOY_BUTTON_DOWN, mask & GAMEBOY_BUTTON_LEFT, mask & GAMEBOY_BUTTON_RIGHT
+    };
+    return input;
+}
+
+static inline bool test_same_state(GameBoy * a, GameBoy * b) {
+    size_t size = gameboy_get_state_size(a);
+    if (size != gameboy_get_state_size(b)) return false;
+
+    uint8_t * state_a = malloc(size);
+    uint8_t * state_b = malloc(size);
+    TEST_CHECK(state_a != NULL && state_b != NULL);
+    TEST_CHECK(gameboy_save_state(a, state_a, size) && gameboy_save_state(b, state_b, size));
+    bool same = memcmp(state_a, state_b, size) == 0;
+    free(state_a);
+    free(state_b);
+    return same;
+}
+
+#endif /* !TRTLE_TESTS_TEST_H */
@@ -1,8 +1,14 @@
 #ifndef TRTLE_TRTLE_H
 #define TRTLE_TRTLE_H
 
+#include "batch.h"
 #include "cartridge.h"
 #include "gameboy.h"
 #include "logger.h"
+#include "movie.h"
+#include "pipeline.h"
+#include "rewind_buffer.h"
+#include "rollback.h"
+#include "speculation.h"
 
 #endif /* !TRTLE_TRTLE_H */